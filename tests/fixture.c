@@ -0,0 +1,351 @@
+/*
+ * Test fixtures for vsfsck
+ *
+ * Builds small VSFS images for tests/run.sh, pokes at files the tool
+ * writes and talks to a --daemon socket, so the tests need nothing beyond
+ * a C compiler and a shell.
+ *
+ *     fixture make KIND OUT          write fixture image KIND to OUT
+ *     fixture poke FILE OFFSET VALUE store a 32-bit little-endian value
+ *     fixture send SOCKET LINE...    send request lines to a --daemon socket
+ *                                    and print the replies
+ *     fixture hold SOCKET            connect to a --daemon socket without
+ *                                    sending and print what it replies
+ *     fixture zero FILE BLOCK        exit 0 when block BLOCK of FILE is all zero
+ *     fixture csum-owner FILE SLOT VALUE
+ *                                    set an indirect block owner in the
+ *                                    checksum table and re-sign the table
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BLOCK_SIZE 4096
+#define TOTAL_BLOCKS 64
+#define INODE_BITMAP_BLOCK 1
+#define DATA_BITMAP_BLOCK 2
+#define INODE_TABLE_START 3
+#define DATA_START 8
+#define INODE_SIZE 212
+#define DIRENT_SIZE 32
+#define TIME_NOW 1700000000u
+
+// Checksum table layout in the superblock reserved area
+#define CSUM_TABLE_OFFSET 36
+#define CSUM_TABLE_SIZE 392
+#define CSUM_TABLE_CRC 16
+#define CSUM_TREE_OWNER 276
+
+#define MODE_DIR 0040755
+#define MODE_FILE 0100644
+
+// Inode record fields, in on-disk order
+enum { F_MODE, F_UID, F_GID, F_SIZE, F_ATIME, F_CTIME, F_MTIME, F_DTIME, F_LINKS, F_BLOCKS,
+       F_DIRECT, F_SINGLE, F_DOUBLE, F_TRIPLE };
+
+static uint8_t img[TOTAL_BLOCKS * BLOCK_SIZE];
+
+static void put32(size_t offset, uint32_t value) {
+    for (int k = 0; k < 4; k++) {
+        img[offset + k] = (uint8_t)(value >> (8 * k));
+    }
+}
+
+static void set_bit(int blk, int n) {
+    img[(size_t)blk * BLOCK_SIZE + n / 8] |= (uint8_t)(1 << (n % 8));
+}
+
+static void superblock(void) {
+    img[0] = 0x4D;
+    img[1] = 0xD3;
+    uint32_t fields[] = { BLOCK_SIZE, TOTAL_BLOCKS, INODE_BITMAP_BLOCK, DATA_BITMAP_BLOCK,
+                          INODE_TABLE_START, DATA_START, 256, 80 };
+    for (int f = 0; f < 8; f++) {
+        put32(4 + 4 * f, fields[f]);
+    }
+}
+
+static void inode_field(int ino, int field, uint32_t value) {
+    put32((size_t)INODE_TABLE_START * BLOCK_SIZE + (size_t)ino * INODE_SIZE + 4 * field, value);
+}
+
+// A live inode marked in the inode bitmap, with no blocks
+static void inode(int ino, uint32_t mode, uint32_t links) {
+    inode_field(ino, F_MODE, mode);
+    inode_field(ino, F_ATIME, TIME_NOW);
+    inode_field(ino, F_CTIME, TIME_NOW);
+    inode_field(ino, F_MTIME, TIME_NOW);
+    inode_field(ino, F_LINKS, links);
+    set_bit(INODE_BITMAP_BLOCK, ino);
+}
+
+// Give an inode one direct data block of size bytes, marked in the bitmap
+static void direct_block(int ino, int blk, uint32_t size) {
+    inode_field(ino, F_DIRECT, blk);
+    inode_field(ino, F_BLOCKS, 1);
+    inode_field(ino, F_SIZE, size);
+    set_bit(DATA_BITMAP_BLOCK, blk - DATA_START);
+}
+
+static void dirent(int blk, int slot, uint32_t ino, const char *name) {
+    size_t offset = (size_t)blk * BLOCK_SIZE + (size_t)slot * DIRENT_SIZE;
+    put32(offset, ino);
+    strncpy((char *)&img[offset + 4], name, DIRENT_SIZE - 5);
+}
+
+// A directory with "." and ".." in block blk
+static void directory(int ino, int parent, int blk, uint32_t links) {
+    inode(ino, MODE_DIR, links);
+    direct_block(ino, blk, BLOCK_SIZE);
+    dirent(blk, 0, ino, ".");
+    dirent(blk, 1, parent, "..");
+}
+
+static void fill(int blk, uint8_t byte) {
+    memset(&img[(size_t)blk * BLOCK_SIZE], byte, BLOCK_SIZE);
+}
+
+static bool make(const char *kind) {
+    memset(img, 0, sizeof(img));
+    superblock();
+    if (strcmp(kind, "clean") == 0) {
+        // Root holding a one-block file and a file with a single indirect block
+        directory(0, 0, 8, 2);
+        dirent(8, 2, 1, "a");
+        dirent(8, 3, 2, "b");
+        inode(1, MODE_FILE, 1);
+        direct_block(1, 9, 100);
+        fill(9, 'a');
+        inode(2, MODE_FILE, 1);
+        direct_block(2, 10, 2 * BLOCK_SIZE);
+        inode_field(2, F_SINGLE, 11);
+        inode_field(2, F_BLOCKS, 2);
+        put32(11 * BLOCK_SIZE, 12);
+        set_bit(DATA_BITMAP_BLOCK, 11 - DATA_START);
+        set_bit(DATA_BITMAP_BLOCK, 12 - DATA_START);
+        fill(10, 'b');
+        fill(12, 'c');
+    } else if (strcmp(kind, "bad") == 0) {
+        // One of each bitmap, duplicate, bad block and time error
+        directory(0, 0, 8, 2);
+        dirent(8, 2, 1, "a");
+        dirent(8, 3, 2, "b");
+        inode(1, MODE_FILE, 1);
+        direct_block(1, 9, 100);
+        inode(2, MODE_FILE, 1);
+        direct_block(2, 9, 100);               // Duplicate of inode 1's block
+        inode_field(2, F_SINGLE, 999);         // Bad block
+        inode(3, MODE_FILE, 1);                // Orphan
+        inode_field(3, F_MTIME, 4000000000u);  // In the future
+        img[INODE_BITMAP_BLOCK * BLOCK_SIZE] &= ~(1 << 3);  // Not marked
+        set_bit(INODE_BITMAP_BLOCK, 5);        // Marked but not valid
+        set_bit(DATA_BITMAP_BLOCK, 40);        // Marked but unreferenced, twice
+        set_bit(DATA_BITMAP_BLOCK, 41);
+    } else if (strcmp(kind, "noroot") == 0) {
+        // Directories exist, but inode 0 is a regular file
+        inode(0, MODE_FILE, 1);
+        directory(1, 1, 8, 2);
+    } else if (strcmp(kind, "links") == 0) {
+        // A file with one entry but a links_count of 3
+        directory(0, 0, 8, 2);
+        dirent(8, 2, 1, "a");
+        inode(1, MODE_FILE, 3);
+        direct_block(1, 9, 100);
+    } else if (strcmp(kind, "orphans") == 0) {
+        // An orphaned directory holding a file
+        directory(0, 0, 8, 3);
+        dirent(8, 2, 1, "d");
+        directory(1, 0, 9, 2);
+        directory(2, 1, 10, 2);
+        dirent(10, 2, 3, "child");
+        inode(3, MODE_FILE, 1);
+    } else if (strcmp(kind, "fullroot") == 0) {
+        // A root block with no free entry, and an orphan for lost+found
+        directory(0, 0, 8, 2);
+        for (int slot = 2; slot < BLOCK_SIZE / DIRENT_SIZE; slot++) {
+            char name[16];
+            snprintf(name, sizeof(name), "link%d", slot);
+            dirent(8, slot, 1, name);
+        }
+        inode(1, MODE_FILE, BLOCK_SIZE / DIRENT_SIZE - 2);
+        inode(2, MODE_FILE, 1);
+    } else if (strcmp(kind, "copies") == 0) {
+        // Two files with the same contents, a different one and an empty one
+        directory(0, 0, 8, 2);
+        dirent(8, 2, 1, "a");
+        dirent(8, 3, 2, "a2");
+        dirent(8, 4, 3, "b");
+        dirent(8, 5, 4, "z");
+        inode(1, MODE_FILE, 1);
+        direct_block(1, 9, BLOCK_SIZE);
+        fill(9, 'a');
+        inode(2, MODE_FILE, 1);
+        direct_block(2, 10, BLOCK_SIZE);
+        fill(10, 'a');
+        inode(3, MODE_FILE, 1);
+        direct_block(3, 11, BLOCK_SIZE);
+        fill(11, 'b');
+        inode(4, MODE_FILE, 1);
+        direct_block(4, 12, BLOCK_SIZE);
+    } else if (strcmp(kind, "holes") == 0) {
+        // The same 2 blocks and 100 bytes, sparse in inode 1 and dense in inode 2
+        directory(0, 0, 8, 2);
+        dirent(8, 2, 1, "sparse");
+        dirent(8, 3, 2, "dense");
+        inode(1, MODE_FILE, 1);
+        inode_field(1, F_SIZE, 2 * BLOCK_SIZE + 100);
+        inode_field(1, F_SINGLE, 9);
+        inode_field(1, F_BLOCKS, 1);
+        put32(9 * BLOCK_SIZE + 4, 10);
+        set_bit(DATA_BITMAP_BLOCK, 9 - DATA_START);
+        set_bit(DATA_BITMAP_BLOCK, 10 - DATA_START);
+        fill(10, 'x');
+        inode(2, MODE_FILE, 1);
+        direct_block(2, 11, 2 * BLOCK_SIZE + 100);
+        inode_field(2, F_SINGLE, 12);
+        inode_field(2, F_BLOCKS, 3);
+        put32(12 * BLOCK_SIZE, 13);
+        put32(12 * BLOCK_SIZE + 4, 14);
+        for (int blk = 12; blk <= 14; blk++) {
+            set_bit(DATA_BITMAP_BLOCK, blk - DATA_START);
+        }
+        fill(14, 'y');                         // Only the bytes below the size are 'x'
+        memset(&img[14 * BLOCK_SIZE], 'x', 100);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static uint32_t crc32c(const uint8_t *data, size_t len) {
+    uint32_t crc = ~UINT32_C(0);
+    for (size_t k = 0; k < len; k++) {
+        crc ^= data[k];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (UINT32_C(0x82F63B78) & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+// Rewrite one tree_owner entry of a stamped image as a valid-looking table
+static int set_csum_owner(const char *path, int slot, uint16_t owner) {
+    FILE *f = fopen(path, "rb+");
+    if (!f || fread(img, sizeof(img), 1, f) != 1) {
+        perror(path);
+        return 1;
+    }
+    uint8_t *table = &img[CSUM_TABLE_OFFSET];
+    table[CSUM_TREE_OWNER + 2 * slot] = (uint8_t)owner;
+    table[CSUM_TREE_OWNER + 2 * slot + 1] = (uint8_t)(owner >> 8);
+    memset(table + CSUM_TABLE_CRC, 0, 4);
+    uint32_t crc = crc32c(table, CSUM_TABLE_SIZE);
+    put32(CSUM_TABLE_OFFSET + CSUM_TABLE_CRC, crc);
+    rewind(f);
+    if (fwrite(img, sizeof(img), 1, f) != 1 || fclose(f) != 0) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+static int connect_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Copy replies to stdout until the daemon closes the connection
+static int print_replies(int fd) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, (size_t)n, stdout);
+    }
+    close(fd);
+    return 0;
+}
+
+static int send_requests(const char *path, int count, char **lines) {
+    int fd = connect_socket(path);
+    if (fd < 0) {
+        return 1;
+    }
+    for (int l = 0; l < count; l++) {
+        if (write(fd, lines[l], strlen(lines[l])) < 0 || write(fd, "\n", 1) < 0) {
+            perror("write");
+            close(fd);
+            return 1;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+    return print_replies(fd);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "make") == 0) {
+        if (!make(argv[2])) {
+            fprintf(stderr, "Unknown fixture: %s\n", argv[2]);
+            return 1;
+        }
+        FILE *f = fopen(argv[3], "wb");
+        if (!f || fwrite(img, sizeof(img), 1, f) != 1 || fclose(f) != 0) {
+            perror(argv[3]);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 5 && strcmp(argv[1], "poke") == 0) {
+        FILE *f = fopen(argv[2], "rb+");
+        uint32_t value = (uint32_t)strtoul(argv[4], NULL, 0);
+        uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16),
+                             (uint8_t)(value >> 24) };
+        if (!f || fseek(f, strtol(argv[3], NULL, 0), SEEK_SET) != 0 || fwrite(bytes, 4, 1, f) != 1 ||
+            fclose(f) != 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 4 && strcmp(argv[1], "zero") == 0) {
+        FILE *f = fopen(argv[2], "rb");
+        if (!f || fread(img, sizeof(img), 1, f) != 1) {
+            perror(argv[2]);
+            return 2;
+        }
+        fclose(f);
+        int blk = atoi(argv[3]);
+        for (int k = 0; k < BLOCK_SIZE; k++) {
+            if (img[(size_t)blk * BLOCK_SIZE + k] != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (argc == 5 && strcmp(argv[1], "csum-owner") == 0) {
+        return set_csum_owner(argv[2], atoi(argv[3]), (uint16_t)strtoul(argv[4], NULL, 0));
+    }
+    if (argc >= 4 && strcmp(argv[1], "send") == 0) {
+        return send_requests(argv[2], argc - 3, argv + 3);
+    }
+    if (argc == 3 && strcmp(argv[1], "hold") == 0) {
+        int fd = connect_socket(argv[2]);
+        return fd < 0 ? 1 : print_replies(fd);
+    }
+    fprintf(stderr, "Usage: %s make KIND OUT | poke FILE OFFSET VALUE | send SOCKET LINE... | hold SOCKET |\n"
+            "       zero FILE BLOCK | csum-owner FILE SLOT VALUE\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,467 @@
+#!/bin/sh
+#
+# Regression tests for vsfsck, run by "make check". Each test builds its
+# images with tests/fixture in a scratch directory and checks the tool's
+# output and exit status.
+#
+VSFSCK=${VSFSCK:-./vsfsck}
+FIXTURE=${FIXTURE:-tests/fixture}
+SHIPPED=${SHIPPED:-vsfs.img}
+LIBVSFSCK=${LIBVSFSCK:-./libvsfsck.so}
+HEADER=${HEADER:-vsfsck.h}
+
+# Tests run in their own directories, so the paths must be absolute
+absolute() {
+    case $1 in
+        /*) echo "$1" ;;
+        *) echo "$PWD/$1" ;;
+    esac
+}
+VSFSCK=$(absolute "$VSFSCK")
+FIXTURE=$(absolute "$FIXTURE")
+SHIPPED=$(absolute "$SHIPPED")
+LIBVSFSCK=$(absolute "$LIBVSFSCK")
+HEADER=$(absolute "$HEADER")
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+passed=0
+failed=0
+
+# run_test NAME: run test_NAME in a fresh directory and tally the result
+run_test() {
+    mkdir "$WORK/$1"
+    if (cd "$WORK/$1" && "test_$1") >"$WORK/$1.log" 2>&1; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL: $1"
+        sed 's/^/    /' "$WORK/$1.log"
+    fi
+}
+
+# fail MESSAGE: end the current test
+fail() {
+    echo "$1"
+    exit 1
+}
+
+fixture() {
+    "$FIXTURE" make "$1" "$2" || fail "cannot build fixture $1"
+}
+
+# expect FILE PATTERN / expect_not FILE PATTERN
+expect() {
+    grep -q -- "$2" "$1" || fail "expected '$2' in $1"
+}
+
+expect_not() {
+    ! grep -q -- "$2" "$1" || fail "unexpected '$2' in $1"
+}
+
+test_clean() {
+    fixture clean c.img
+    "$VSFSCK" c.img >out || fail "exit status $?"
+    expect out "Overall file system status: CONSISTENT"
+    "$VSFSCK" c.img --format=json --jobs=4 >json
+    expect json '"type":"summary"'
+    expect_not json '"type":"finding"'
+}
+
+test_shipped_image() {
+    cp "$SHIPPED" s.img
+    "$VSFSCK" s.img --index=s.idx >out
+    expect out "Overall file system status: CONSISTENT"
+    expect out "No directories on this image"
+    [ -f s.idx ] || fail "index not saved for a consistent image"
+}
+
+test_missing_root() {
+    fixture noroot n.img
+    "$VSFSCK" n.img --format=json >json
+    expect json '"code":"root_not_dir"'
+}
+
+test_findings() {
+    fixture bad b.img
+    "$VSFSCK" b.img --format=json >json
+    for code in block_not_referenced inode_not_marked inode_not_valid duplicate_block bad_block \
+                inode_time_future orphan_inode; do
+        expect json "\"code\":\"$code\""
+    done
+    "$VSFSCK" b.img >out
+    expect out "Overall file system status: ERRORS DETECTED"
+}
+
+# Codes of the records in a binary report, one per line, after the version
+binary_codes() {
+    od -An -v -tu1 "$1" | tr -s ' ' '\n' | sed '/^$/d' |
+        awk 'NR == 5 { print "version " $0 } NR > 8 && (NR - 9) % 20 == 1 { print }'
+}
+
+test_binary_report() {
+    fixture bad b.img
+    "$VSFSCK" b.img --format=binary >bin
+    [ "$(head -c 4 bin)" = "VSFN" ] || fail "bad magic"
+    binary_codes bin >codes
+    expect codes "^version 2$"
+    [ "$(grep -c '^2$' codes)" -eq 2 ] || fail "expected both block_not_referenced findings"
+}
+
+test_directory_tree() {
+    fixture orphans o.img
+    "$VSFSCK" o.img --format=json >json
+    expect json '"code":"orphan_inode","severity":"error","inode":2'
+    # The contents of an orphaned directory are not orphans of their own
+    expect_not json '"code":"orphan_inode","severity":"error","inode":3'
+    fixture links l.img
+    "$VSFSCK" l.img --format=json >json
+    expect json '"code":"link_count","severity":"error","inode":1'
+    "$VSFSCK" l.img --fix >fix
+    expect fix "Setting links_count of inode 1 to 1"
+    expect fix "Post-fix file system status: CONSISTENT"
+}
+
+test_rate_limit() {
+    fixture bad b.img
+    "$VSFSCK" b.img --max-per-inode=1 >out
+    expect out "Note: 1 further data_bitmap findings suppressed"
+    "$VSFSCK" b.img --max-per-inode=1 --format=json >json
+    expect json '"type":"suppressed","check":"data_bitmap","inode":-1,"count":1'
+    # Binary reports carry the dropped count as a FINDING_SUPPRESSED record
+    "$VSFSCK" b.img --max-per-inode=1 --format=binary >bin
+    binary_codes bin >codes
+    [ "$(grep -c '^255$' codes)" -eq 1 ] || fail "expected one suppressed record"
+    "$VSFSCK" b.img --format=binary >bin
+    binary_codes bin >codes
+    expect_not codes "^255$"
+}
+
+test_fix() {
+    fixture bad b.img
+    "$VSFSCK" b.img --fix >fix
+    expect fix "Fixing"
+    "$VSFSCK" b.img --format=json >json
+    for code in block_not_referenced inode_not_marked inode_not_valid duplicate_block bad_block \
+                orphan_inode; do
+        expect_not json "\"code\":\"$code\""
+    done
+}
+
+test_clone_dups() {
+    fixture bad b.img
+    "$VSFSCK" b.img --fix --clone-dups >fix
+    expect fix "Fixing: Cloning block 9 for inode 2"
+    "$VSFSCK" b.img --format=json >json
+    expect_not json '"code":"duplicate_block"'
+    expect json '"duplicate_blocks":true'
+}
+
+test_orphan_repair() {
+    fixture orphans o.img
+    "$VSFSCK" o.img --fix >fix
+    expect fix "Created /lost+found"
+    expect fix "Post-fix file system status: CONSISTENT"
+    "$VSFSCK" o.img >out
+    expect out "Overall file system status: CONSISTENT"
+}
+
+test_directory_growth() {
+    # lost+found does not fit in the root's only block, so the root gets a
+    # single indirect block; blocks_count counts data blocks only
+    fixture fullroot r.img
+    "$VSFSCK" r.img --fix >fix
+    expect fix "Created /lost+found"
+    expect fix "Post-fix file system status: CONSISTENT"
+    "$VSFSCK" r.img --format=json >json
+    expect_not json '"code":"inode_block_count"'
+    expect json '"directory_tree":true'
+    "$VSFSCK" r.img --owner=10 >owner
+    expect owner "indirect block of inode 0"
+}
+
+test_quick() {
+    fixture clean c.img
+    "$VSFSCK" c.img --quick --seed=1 >out || fail "exit status $? on a clean sample"
+    expect out "NO ERRORS IN SAMPLE"
+    # Errors in the sample show in the exit status
+    fixture bad b.img
+    if "$VSFSCK" b.img --quick=1 --seed=1 --format=json >json; then
+        fail "exit status 0 with errors in the sample"
+    fi
+    expect json '"type":"quick_sample","seed":1,"population":4,"screened":4,"sampled":4'
+    expect json '"code":"bad_block"'
+}
+
+test_checkpoint() {
+    fixture bad b.img
+    "$VSFSCK" b.img --format=json >full
+    "$VSFSCK" b.img --budget=0.000000001 --checkpoint=b.ck >first
+    expect first "Progress saved to b.ck"
+    [ -f b.ck ] || fail "checkpoint not written"
+    [ ! -f b.ck.tmp ] || fail "temporary checkpoint left behind"
+    "$VSFSCK" b.img --budget=100 --checkpoint=b.ck >second
+    expect second "Resuming from b.ck"
+    expect second "Overall file system status: ERRORS DETECTED"
+    [ ! -f b.ck ] || fail "checkpoint left behind after the run finished"
+    # A checkpoint belongs to its image
+    "$VSFSCK" b.img --budget=0.000000001 --checkpoint=b.ck >/dev/null
+    fixture clean c.img
+    "$VSFSCK" c.img --checkpoint=b.ck >other 2>&1
+    expect other "was taken on a different image"
+}
+
+test_library_exports() {
+    # The library exports exactly the functions declared in vsfsck.h
+    sed -n 's/^[A-Za-z].*[ *]\(vsfsck_[a-z_]*\)(.*/\1/p' "$HEADER" | sort >api
+    nm -D --defined-only "$LIBVSFSCK" | awk '$2 ~ /^[TDBRVWi]$/ { print $3 }' | sort >exports
+    [ -s api ] || fail "no declarations in $HEADER"
+    cmp -s api exports || { diff api exports; fail "exported symbols differ from vsfsck.h"; }
+}
+
+test_batch() {
+    mkdir images
+    fixture clean images/c1.img
+    fixture clean images/c2.img
+    fixture bad images/b.img
+    printf 'not an image' >images/junk.img
+    "$VSFSCK" --batch=images --workers=3 --format=json >json
+    expect json '"images":4,"consistent":2,"errors":1,"fixed":0,"failed":1'
+    "$VSFSCK" --batch=images --workers=2 --fix >fix
+    expect fix "Images: 4"
+}
+
+# start_daemon ARG...: run vsfsck --daemon=$PWD/sock in the background as
+# $pid and wait until it listens
+start_daemon() {
+    "$VSFSCK" --daemon="$PWD/sock" "$@" 2>daemon.log &
+    pid=$!
+    tries=0
+    while ! grep -q "listening on" daemon.log && [ $tries -lt 50 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+}
+
+test_daemon() {
+    fixture clean c.img
+    fixture bad b.img
+    start_daemon --workers=2
+    # Only the owner may connect
+    listing=$(ls -l sock)
+    case $listing in
+        srw-------*) ;;
+        *) kill "$pid"; fail "socket is not private: $listing" ;;
+    esac
+    "$FIXTURE" send sock "CHECK $PWD/c.img" "CHECK 5 $PWD/b.img" "CHECK " "BOGUS" "FIX $PWD/b.img" >replies
+    "$FIXTURE" send sock "STATS" >stats
+    kill "$pid"
+    wait "$pid"
+    expect replies '"status":"consistent"'
+    expect replies '"status":"errors"'
+    expect replies '"type":"finding"'
+    expect replies '"message":"missing image path"'
+    expect replies '"message":"unknown request"'
+    expect replies '"message":"repairs are disabled; start the daemon with --allow-fix"'
+    expect stats '"completed":2'
+}
+
+test_daemon_fix() {
+    fixture bad b.img
+    start_daemon --workers=1 --allow-fix --clone-dups
+    "$FIXTURE" send sock "FIX $PWD/b.img" >replies
+    kill "$pid"
+    wait "$pid"
+    expect replies '"status":"fixed"'
+    "$VSFSCK" b.img >after
+    expect_not after "bad_block"
+}
+
+test_daemon_idle_client() {
+    # A client that never sends anything does not keep the daemon alive
+    start_daemon --workers=1
+    "$FIXTURE" hold sock >held &
+    client=$!
+    sleep 0.2
+    kill "$pid"
+    tries=0
+    while kill -0 "$pid" 2>/dev/null && [ $tries -lt 50 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+    if kill "$pid" 2>/dev/null; then
+        kill -9 "$pid" "$client"
+        fail "daemon did not stop with an idle client connected"
+    fi
+    wait "$client"
+}
+
+test_daemon_socket_path() {
+    # A file that is not a socket is never replaced
+    echo keep >sock
+    "$VSFSCK" --daemon="$PWD/sock" --workers=1 2>err &
+    pid=$!
+    sleep 0.5
+    if kill "$pid" 2>/dev/null; then
+        wait "$pid"
+        fail "daemon started over a regular file"
+    fi
+    expect err "is not a socket"
+    expect sock "keep"
+}
+
+test_index() {
+    fixture clean c.img
+    "$VSFSCK" c.img --index=c.idx >/dev/null
+    [ -f c.idx ] || fail "index not saved"
+    [ ! -e c.idx.tmp ] || fail "temporary index left behind"
+    : >empty.log
+    "$VSFSCK" c.img --index=c.idx --changes=empty.log >out 2>&1
+    expect out "Incremental scope: 0 changed blocks"
+    "$VSFSCK" c.img --index=c.idx --owner=11 >owner
+    expect owner "Block 11: indirect block of inode 2"
+    # A damaged index is ignored and rebuilt
+    "$FIXTURE" poke c.idx 16 0xdeadbeef
+    "$VSFSCK" c.img --index=c.idx --changes=empty.log >out 2>&1
+    expect out "is corrupt; running a full check"
+    expect out "Overall file system status: CONSISTENT"
+    # So is an index naming fewer changes than the image has seen
+    "$VSFSCK" c.img --index=c.idx >/dev/null
+    "$FIXTURE" poke c.img $((3 * 4096 + 212 + 24)) 1700000001
+    "$VSFSCK" c.img --index=c.idx --changes=empty.log >out 2>&1
+    expect out "names only some of the blocks"
+    # A run that finds errors drops the index
+    fixture bad b.img
+    cp c.idx b.idx
+    "$VSFSCK" b.img --index=b.idx >/dev/null
+    [ ! -e b.idx ] || fail "index kept for an image with errors"
+}
+
+test_manifest() {
+    fixture clean c.img
+    "$VSFSCK" c.img --manifest=c.man >/dev/null
+    [ -f c.man ] || fail "manifest not saved"
+    "$FIXTURE" poke c.img $((11 * 4096 + 4)) 13
+    "$VSFSCK" c.img --manifest=c.man --format=json >json
+    expect json '"code":"checksum_mismatch","severity":"error","inode":-1,"block":11'
+}
+
+test_checksums() {
+    fixture clean c.img
+    "$VSFSCK" c.img --enable-checksums >out
+    expect out "Checksum table stamped at clean generation 1"
+    # Unused inodes are not stamped, so empty inode table blocks stay empty
+    "$FIXTURE" zero c.img 7 || fail "inode table block 7 was written"
+    "$VSFSCK" c.img >out
+    expect out "9 of 9 metadata blocks unchanged"
+    # The verification pool is sized by the work, not by --jobs
+    "$VSFSCK" c.img --jobs=100000000 >out || fail "exit status $?"
+    expect out "9 of 9 metadata blocks unchanged"
+    "$FIXTURE" poke c.img $((3 * 4096 + 212 + 24)) 1700000001
+    "$VSFSCK" c.img --format=json >json
+    expect json '"code":"checksum_mismatch"'
+}
+
+test_checksum_table_owner() {
+    fixture clean c.img
+    "$VSFSCK" c.img --enable-checksums >/dev/null
+    # Re-signing without changes keeps the table valid
+    "$FIXTURE" csum-owner c.img 3 3
+    "$VSFSCK" c.img >out
+    expect out "9 of 9 metadata blocks unchanged"
+    # Block 11 is slot 3; an owner beyond the inode table is rejected
+    "$FIXTURE" csum-owner c.img 3 65535
+    "$VSFSCK" c.img >out
+    expect out "checksum table in the superblock is corrupt"
+    expect out "Overall file system status: CONSISTENT"
+}
+
+# file_hash INODE: the --hash-data digest of an inode in the report "out"
+file_hash() {
+    sed -n "s/^Inode $1: \([0-9a-f]*\) .*/\1/p" out
+}
+
+test_hash_holes() {
+    # Holes hash as zeros and the tail stops at the file size, so a sparse
+    # file matches a dense one with the same bytes
+    fixture holes h.img
+    "$VSFSCK" h.img --hash-data --jobs=2 >out
+    [ -n "$(file_hash 1)" ] || fail "no digest for inode 1"
+    [ "$(file_hash 1)" = "$(file_hash 2)" ] || fail "sparse and dense digests differ"
+    expect out "Inode 1: .* (1 blocks, 8292 bytes)"
+    # Moving the data block in front of a hole changes the content
+    "$FIXTURE" poke h.img $((9 * 4096)) 10
+    "$FIXTURE" poke h.img $((9 * 4096 + 4)) 0
+    "$VSFSCK" h.img --hash-data >out
+    [ "$(file_hash 1)" != "$(file_hash 2)" ] || fail "digest ignores the position of a hole"
+}
+
+test_dedup_report() {
+    fixture copies d.img
+    "$VSFSCK" d.img --dedup-report --jobs=3 >out
+    expect out "Identical data in block 9 (inode 1), block 10 (inode 2)"
+    expect out "1 duplicate blocks in 1 groups"
+    expect out "1 all-zero data blocks could be holes"
+    # More jobs than shards and blocks to split
+    "$VSFSCK" d.img --dedup-report --jobs=1000 --format=json >json
+    expect json '"type":"dedup_group","blocks":\[9,10\],"inodes":\[1,2\]'
+    expect json '"type":"dedup_summary","blocks":5,"duplicates":1,"groups":1'
+}
+
+test_diff() {
+    fixture clean c.img
+    cp c.img n.img
+    "$VSFSCK" c.img --diff=c.img >out
+    expect out "0 changes in 0 of 64 blocks"
+    # Block 13 is bit 5 of the data bitmap, inode 64 the first bit of its second word
+    "$FIXTURE" poke n.img $((2 * 4096)) 0x3f
+    "$FIXTURE" poke n.img $((1 * 4096 + 8)) 1
+    "$FIXTURE" poke n.img $((3 * 4096 + 212 + 24)) 1700000001
+    "$VSFSCK" c.img --diff=n.img >out
+    expect out "Data bitmap: block 13 allocated"
+    expect out "Inode bitmap: inode 64 allocated"
+    expect out "Inode 1: mtime 1700000000 -> 1700000001"
+    expect out "3 changes in 3 of 64 blocks"
+    "$VSFSCK" n.img --diff=c.img --format=json >json
+    expect json '"area":"data_bitmap","block":13,"old":1,"new":0'
+}
+
+test_export_metadata() {
+    fixture clean c.img
+    "$VSFSCK" c.img --export-metadata=e.img >out || fail "exit status $?"
+    # Blocks 0-7, the root directory block 8 and the indirect block 11
+    expect out "Exported 10 of 64 blocks to e.img"
+    [ "$(wc -c <e.img)" -eq $((64 * 4096)) ] || fail "export is not a full-size image"
+    "$FIXTURE" zero e.img 9 || fail "file data was exported"
+    "$FIXTURE" zero e.img 11 && fail "indirect block was not exported"
+    "$VSFSCK" e.img >out
+    expect out "Overall file system status: CONSISTENT"
+    # A failed write is reported and fails the run
+    if "$VSFSCK" c.img --export-metadata=missing/e.img >out 2>&1; then
+        fail "export into a missing directory succeeded"
+    fi
+    expect out "Error writing metadata export"
+}
+
+test_sparse_inode_table() {
+    # Inode 70 is the only one in inode table block 6; empty blocks 4, 5
+    # and 7 are skipped but it is still seen
+    fixture clean c.img
+    "$FIXTURE" poke c.img $((3 * 4096 + 70 * 212)) 0100644
+    "$FIXTURE" poke c.img $((3 * 4096 + 70 * 212 + 32)) 1
+    "$VSFSCK" c.img --format=json >json
+    expect json '"code":"inode_not_marked","severity":"error","inode":70'
+    expect json '"code":"orphan_inode","severity":"error","inode":70'
+}
+
+for t in clean shipped_image missing_root findings binary_report directory_tree rate_limit fix clone_dups \
+         orphan_repair directory_growth \
+         quick checkpoint library_exports batch daemon daemon_fix daemon_idle_client \
+         daemon_socket_path index manifest checksums checksum_table_owner \
+         hash_holes dedup_report diff export_metadata \
+         sparse_inode_table; do
+    run_test "$t"
+done
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
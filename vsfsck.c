@@ -1,9 +1,22 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vsfsck.h"
 
 /*
  * Constants based on VSFS file system layout
@@ -60,14 +73,210 @@ typedef struct {
 } inode_t;
 
 /*
- * Global variables
+ * Directory entry structure
+ *
+ * Directory inodes (S_IFDIR mode) store an array of fixed-size entries in
+ * their data blocks. An entry is free when its name is empty. Every
+ * directory holds "." and ".." entries; the root's ".." points to itself.
+ */
+#define ROOT_INODE_NUM 0
+#define DIR_NAME_LEN 28
+
+typedef struct {
+    uint32_t inode;               // Inode number of the entry
+    char name[DIR_NAME_LEN];      // NUL-terminated name, empty if unused
+} dirent_t;
+
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(dirent_t))
+
+/*
+ * Structure-of-arrays shadow of the inode table
+ *
+ * inode_t is mostly reserved space, so walking inode_table to read a few
+ * fields drags whole inodes through the cache. build_inode_soa() transposes
+ * the fields the checkers need into dense per-field columns once per pass;
+ * the checkers read only these columns. Repairs that change an inode must
+ * go through the setters below so the shadow and the image stay in sync.
+ *
+ * Inode table blocks that are entirely zero hold no inode worth reading,
+ * so scan_inode_table() finds them first and only inodes overlapping a
+ * populated block are transposed; the rest keep zeroed columns.
+ */
+enum { PTR_DIRECT = 0, PTR_SINGLE, PTR_DOUBLE, PTR_TRIPLE, PTR_COUNT };
+
+#define INODE_MASK_WORDS ((INODE_COUNT + 63) / 64)
+
+typedef struct {
+    uint64_t *live_mask;           // Packed is_inode_valid() bits, one per inode
+    uint32_t *ptr[PTR_COUNT];      // direct, single, double, triple pointers
+    uint32_t *size;
+    uint32_t *blocks_count;
+    uint32_t *mode;
+    uint32_t *atime;
+    uint32_t *ctime;
+    uint32_t *mtime;
+} inode_soa_t;
+
+#define INODE_SOA_COLUMNS (PTR_COUNT + 6)
+
+// Mask of the meaningful bits in the last live_mask word
+#define INODE_MASK_TAIL (INODE_COUNT % 64 ? (UINT64_C(1) << (INODE_COUNT % 64)) - 1 : ~UINT64_C(0))
+
+#define REPORT_BUFFER_SIZE (1 << 20)
+#define REPORT_MESSAGE_LEN 512
+#define DEFAULT_MAX_FINDINGS_PER_INODE 10
+
+/*
+ * Rate limiting: consecutive findings of one check against the same inode
+ * (or against no inode, for the bitmap checks) are emitted up to
+ * max_findings_per_inode times; the rest are counted and reported as a
+ * single "N further findings suppressed" line (a FINDING_SUPPRESSED
+ * record in binary reports). 0 disables the limit.
+ */
+typedef struct {
+    int check;              // Check of the current run (-1 = none)
+    int inode;              // Inode of the current run
+    unsigned emitted;       // Findings printed in the current run
+    unsigned long suppressed; // Findings dropped in the current run
+    bool last_suppressed;   // Whether follow-up lines should be dropped too
+} report_rate_t;
+
+
+/*
+ * Checker context
+ *
+ * Everything a check of one image touches lives in a vsfsck_t, so several
+ * images can be checked concurrently in one process. The checkers reach the
+ * context they work on through ctx, which the library entry points (and the
+ * directory walk workers) set for the calling thread.
  */
-uint8_t *fs_image = NULL;        // File system image in memory
-superblock_t *superblock = NULL; // Pointer to superblock in memory
-uint8_t *inode_bitmap = NULL;    // Pointer to inode bitmap
-uint8_t *data_bitmap = NULL;     // Pointer to data bitmap
-inode_t *inode_table = NULL;     // Pointer to inode table
-bool *block_ref_count = NULL;    // Track block references for duplicate detection
+typedef struct {
+    int leaves;          // Power of two >= DATA_BLOCKS_COUNT
+    uint32_t *prefix;    // Free run starting at the node's left edge
+    uint32_t *suffix;    // Free run ending at the node's right edge
+    uint32_t *best;      // Longest free run inside the node
+    bool valid;
+} extent_tree_t;
+
+typedef struct {
+    uint32_t src;        // Shared block
+    int ino;             // Later claimant
+    int ptr_index;       // Inode pointer to repoint, or -1 when entry is set
+    uint32_t *entry;     // Indirect block entry to repoint
+} clone_job_t;
+
+typedef struct {
+    clone_job_t *jobs;
+    int len, cap;
+} clone_queue_t;
+
+typedef struct {
+    uint32_t phase;                                 // check_id_t to continue with
+    int32_t next_inode;                             // First inode of that phase not yet scanned
+    uint8_t results[CHECK_MAX];                     // Verdicts so far (partial for phase)
+    uint64_t histogram[CHECK_MAX][FINDING_MAX];     // Findings counted so far
+    uint8_t reachable[(DATA_BLOCKS_COUNT + 7) / 8]; // Data blocks reached so far
+    int32_t owner[TOTAL_BLOCKS];                    // First claimant per block (-1 = none)
+} checkpoint_t;
+
+typedef struct {
+    struct timespec deadline;
+    bool limited;        // A budget is in force
+    bool resumed;        // ckpt was loaded from checkpoint_path
+    bool stopped;        // The budget ran out; ckpt holds the stop point
+    bool progressed;     // At least one unit of work was allowed this run
+    checkpoint_t ckpt;
+} budget_state_t;
+
+typedef struct {
+    int32_t inode;       // Owning inode, -1 when no live inode reaches the block
+    uint8_t level;       // 0 = referenced by the inode, 1-3 = by an indirect block at that depth
+    uint8_t height;      // Indirection levels below the block (0 = data block)
+    uint16_t slot;       // Pointer index in the inode, or entry index in the parent block
+} block_owner_t;
+
+typedef struct {
+    bool verified;                         // The fields below describe the current image
+    bool enabled;                          // The superblock carries a valid checksum table
+    bool corrupt;                          // It carries one that fails its own checksum
+    uint64_t generation;                   // Clean generation the table was stamped at
+    bool block_ok[DATA_BLOCK_START_NUM];   // Metadata block matches the table
+    bool tree_ok[DATA_BLOCKS_COUNT];       // Indirect block matches (or is not one)
+    uint64_t changed[INODE_MASK_WORDS];    // Inodes whose own checksum differs
+    uint64_t dirty[INODE_MASK_WORDS];      // Inodes that need deep checks
+} csum_state_t;
+
+typedef struct {
+    uint64_t generation;                               // Bumped every time the index is saved
+    uint64_t block_sum[DATA_BLOCK_START_NUM];          // FNV-1a of each metadata block
+    uint64_t tree_sum;                                 // FNV-1a of the indirect and directory blocks
+} index_header_t;
+
+typedef struct {
+    index_header_t header;
+    block_owner_t owner[TOTAL_BLOCKS];
+    uint64_t inode_hash[INODE_COUNT];                  // FNV-1a of each inode record
+    uint64_t name_hash[INODE_COUNT];                   // FNV-1a of mode, links_count and dtime
+    uint8_t inode_bitmap[(INODE_COUNT + 7) / 8];       // Bitmaps when the index was taken
+    uint8_t data_bitmap[(DATA_BLOCKS_COUNT + 7) / 8];
+} block_index_t;
+
+struct vsfsck {
+    vsfsck_backend_t backend;
+    
+    // Image
+    uint8_t *fs_image;             // File system image in memory
+    superblock_t *superblock;      // Pointer to superblock in memory
+    uint8_t *inode_bitmap;         // Pointer to inode bitmap
+    uint8_t *data_bitmap;          // Pointer to data bitmap
+    inode_t *inode_table;          // Pointer to inode table
+    bool *block_ref_count;         // Track block references for duplicate detection
+    inode_soa_t inode_soa;
+    extent_tree_t free_extents;
+    clone_queue_t clone_queue;
+    bool shadow_stale;             // A repair pass ran; rebuild inode_soa before the next check
+    uint64_t *inode_scope;         // Inodes the checkers visit (NULL = all), see check_incremental()
+    const block_index_t *index;    // Owners of the blocks of inodes outside inode_scope
+    const struct checksum_manifest *manifest;  // Expected metadata checksums (NULL = none)
+    csum_state_t csum;             // On-disk checksum table, see verify_checksum_table()
+    
+    // Options
+    int check_jobs;
+    bool clone_duplicates;
+    double quick_fraction;
+    uint32_t quick_max_samples;
+    uint64_t quick_seed;           // 0 = derive from the clock
+    uint64_t quick_rng;
+    double check_budget;           // Seconds, 0 = unlimited
+    const char *checkpoint_path;
+    budget_state_t budget;
+    
+    // Reporting
+    FILE *out;
+    output_format_t output_format;
+    unsigned max_findings_per_inode;
+    vsfsck_finding_fn on_finding;
+    void *user;
+    unsigned long finding_histogram[CHECK_MAX][FINDING_MAX];
+    report_rate_t rate;
+};
+
+static _Thread_local vsfsck_t *ctx = NULL;  // Context of the calling thread
+
+static const char *check_names[CHECK_MAX] = {
+    "superblock", "data_bitmap", "inode_bitmap", "duplicate_blocks", "bad_blocks",
+    "inode_sanity", "directory_tree", "checksums"
+};
+
+static const char *finding_names[FINDING_MAX] = {
+    "sb_field", "block_not_marked", "block_not_referenced", "inode_not_marked",
+    "inode_not_valid", "duplicate_block", "bad_block", "inode_size", "inode_time_future",
+    "inode_time_order", "inode_mode", "inode_block_count",
+    "root_not_dir", "dangling_entry", "orphan_inode", "link_count", "checksum_mismatch"
+};
+
+static const char *severity_names[] = { "info", "warning", "error" };
+static const char *action_names[] = { "none", "fixed", "unfixable" };
 
 /*
  * Helper functions
@@ -78,7 +287,7 @@ void *get_block(int block_num) {
     if (block_num < 0 || block_num >= TOTAL_BLOCKS) {
         return NULL;
     }
-    return fs_image + (block_num * BLOCK_SIZE);
+    return ctx->fs_image + (block_num * BLOCK_SIZE);
 }
 
 // Check if a bit is set in a bitmap
@@ -107,644 +316,5521 @@ bool is_inode_valid(inode_t *inode) {
     return inode->links_count > 0 && inode->dtime == 0;
 }
 
-// Convert time to string for display
-char *time_to_str(uint32_t timestamp) {
-    time_t t = (time_t)timestamp;
-    static char buffer[64];
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", localtime(&t));
-    return buffer;
+// Next bit after prev (-1 to start) that is set in both mask and filter
+// (NULL for no filter) among the first nbits, or -1 when there is none.
+// Clear bits are skipped a whole word at a time with count-trailing-zeros,
+// so a walk costs the number of set bits plus nbits / 64.
+static inline int next_set_bit(const uint64_t *mask, const uint64_t *filter, int nbits, int prev) {
+    int i = prev + 1;
+    if (i >= nbits) {
+        return -1;
+    }
+    int w = i / 64;
+    uint64_t bits = mask[w] & (filter ? filter[w] : ~UINT64_C(0)) & (~UINT64_C(0) << (i % 64));
+    while (bits == 0) {
+        if (++w >= (nbits + 63) / 64) {
+            return -1;
+        }
+        bits = mask[w] & (filter ? filter[w] : ~UINT64_C(0));
+    }
+    int n = w * 64 + __builtin_ctzll(bits);
+    return n < nbits ? n : -1;
 }
 
-/*
- * Consistency Checker Components
- */
+// Reload one inode's shadow entry after it was rewritten in inode_table
+void refresh_inode_soa(int i) {
+    inode_t *inode = &ctx->inode_table[i];
+    uint64_t bit = UINT64_C(1) << (i % 64);
+    if (is_inode_valid(inode)) {
+        ctx->inode_soa.live_mask[i / 64] |= bit;
+    } else {
+        ctx->inode_soa.live_mask[i / 64] &= ~bit;
+    }
+    ctx->inode_soa.ptr[PTR_DIRECT][i] = inode->direct_block;
+    ctx->inode_soa.ptr[PTR_SINGLE][i] = inode->single_indirect;
+    ctx->inode_soa.ptr[PTR_DOUBLE][i] = inode->double_indirect;
+    ctx->inode_soa.ptr[PTR_TRIPLE][i] = inode->triple_indirect;
+    ctx->inode_soa.size[i] = inode->size;
+    ctx->inode_soa.blocks_count[i] = inode->blocks_count;
+    ctx->inode_soa.mode[i] = inode->mode;
+    ctx->inode_soa.atime[i] = inode->atime;
+    ctx->inode_soa.ctime[i] = inode->ctime;
+    ctx->inode_soa.mtime[i] = inode->mtime;
+}
 
-// 1. Superblock Validator //22101328
-bool validate_superblock(bool fix) {
-    bool isValid = true;
-    printf("\n=== Superblock Validation ===\n");
-    
-    // Check magic number
-    if (superblock->magic != MAGIC_BYTES) {
-        printf("Error: Invalid magic number (0x%04X). Expected 0x%04X\n", 
-               superblock->magic, MAGIC_BYTES);
-        if (fix) {
-            printf("Fixing: Setting correct magic number\n");
-            superblock->magic = MAGIC_BYTES;
+// Range of inodes whose records overlap inode table block blk
+static void inode_table_block_range(int blk, int *first, int *last) {
+    size_t offset = (size_t)(blk - INODE_TABLE_START_BLOCK_NUM) * BLOCK_SIZE;
+    *first = (int)(offset / sizeof(inode_t));
+    *last = (int)((offset + BLOCK_SIZE - 1) / sizeof(inode_t));
+    if (*last >= INODE_COUNT) {
+        *last = INODE_COUNT - 1;
+    }
+}
+
+// Whether a block is all zero, tested a cache line of words at a time
+static bool block_is_zero(const void *block) {
+    const uint64_t *words = block;
+    for (size_t w = 0; w < BLOCK_SIZE / sizeof(uint64_t); w += 8) {
+        if ((words[w] | words[w + 1] | words[w + 2] | words[w + 3] |
+             words[w + 4] | words[w + 5] | words[w + 6] | words[w + 7]) != 0) {
+            return false;
         }
-        isValid = false;
-    } else {
-        printf("Magic number is valid (0x%04X)\n", superblock->magic);
     }
-    
-    // Check block size
-    if (superblock->block_size != BLOCK_SIZE) {
-        printf("Error: Invalid block size (%u). Expected %u\n", 
-               superblock->block_size, BLOCK_SIZE);
-        if (fix) {
-            printf("Fixing: Setting correct block size\n");
-            superblock->block_size = BLOCK_SIZE;
+    return true;
+}
+
+// Set the bits of the inodes overlapping an inode table block that is not
+// all zero; every other inode is known to be zero
+static void scan_inode_table(uint64_t populated[INODE_MASK_WORDS]) {
+    memset(populated, 0, INODE_MASK_WORDS * sizeof(uint64_t));
+    for (int b = INODE_TABLE_START_BLOCK_NUM; b < INODE_TABLE_START_BLOCK_NUM + INODE_TABLE_BLOCKS; b++) {
+        if (!block_is_zero(get_block(b))) {
+            int first, last;
+            inode_table_block_range(b, &first, &last);
+            for (int i = first; i <= last; i++) {
+                populated[i / 64] |= UINT64_C(1) << (i % 64);
+            }
         }
-        isValid = false;
-    } else {
-        printf("Block size is valid (%u)\n", superblock->block_size);
     }
-    
-    // Check total number of blocks
-    if (superblock->total_blocks != TOTAL_BLOCKS) {
-        printf("Error: Invalid total blocks (%u). Expected %u\n", 
-               superblock->total_blocks, TOTAL_BLOCKS);
-        if (fix) {
-            printf("Fixing: Setting correct total blocks\n");
-            superblock->total_blocks = TOTAL_BLOCKS;
+}
+
+// Fill the inode shadow from inode_table, allocating it on first use
+bool build_inode_soa(void) {
+    if (!ctx->inode_soa.live_mask) {
+        uint32_t *columns = malloc((size_t)INODE_COUNT * INODE_SOA_COLUMNS * sizeof(uint32_t));
+        uint64_t *live_mask = malloc(INODE_MASK_WORDS * sizeof(uint64_t));
+        if (!columns || !live_mask) {
+            free(columns);
+            free(live_mask);
+            return false;
         }
-        isValid = false;
-    } else {
-        printf("Total blocks is valid (%u)\n", superblock->total_blocks);
+        for (int p = 0; p < PTR_COUNT; p++) {
+            ctx->inode_soa.ptr[p] = columns + (size_t)p * INODE_COUNT;
+        }
+        ctx->inode_soa.size = columns + (size_t)(PTR_COUNT + 0) * INODE_COUNT;
+        ctx->inode_soa.blocks_count = columns + (size_t)(PTR_COUNT + 1) * INODE_COUNT;
+        ctx->inode_soa.mode = columns + (size_t)(PTR_COUNT + 2) * INODE_COUNT;
+        ctx->inode_soa.atime = columns + (size_t)(PTR_COUNT + 3) * INODE_COUNT;
+        ctx->inode_soa.ctime = columns + (size_t)(PTR_COUNT + 4) * INODE_COUNT;
+        ctx->inode_soa.mtime = columns + (size_t)(PTR_COUNT + 5) * INODE_COUNT;
+        ctx->inode_soa.live_mask = live_mask;
     }
     
-    // Check inode bitmap block
-    if (superblock->inode_bitmap_block != INODE_BITMAP_BLOCK_NUM) {
-        printf("Error: Invalid inode bitmap block (%u). Expected %u\n", 
-               superblock->inode_bitmap_block, INODE_BITMAP_BLOCK_NUM);
-        if (fix) {
-            printf("Fixing: Setting correct inode bitmap block\n");
-            superblock->inode_bitmap_block = INODE_BITMAP_BLOCK_NUM;
-        }
-        isValid = false;
+    memset(ctx->inode_soa.ptr[0], 0, (size_t)INODE_COUNT * INODE_SOA_COLUMNS * sizeof(uint32_t));
+    memset(ctx->inode_soa.live_mask, 0, INODE_MASK_WORDS * sizeof(uint64_t));
+    uint64_t populated[INODE_MASK_WORDS];
+    scan_inode_table(populated);
+    for (int i = next_set_bit(populated, NULL, INODE_COUNT, -1); i >= 0;
+         i = next_set_bit(populated, NULL, INODE_COUNT, i)) {
+        refresh_inode_soa(i);
+    }
+    return true;
+}
+
+void free_inode_soa(void) {
+    free(ctx->inode_soa.ptr[0]);
+    free(ctx->inode_soa.live_mask);
+    memset(&ctx->inode_soa, 0, sizeof(ctx->inode_soa));
+}
+
+// Whether inode ino is live according to the shadow
+static inline bool inode_is_live(int ino) {
+    return (ctx->inode_soa.live_mask[ino / 64] >> (ino % 64)) & 1;
+}
+
+// Word w of the inode scope mask; every inode is in scope without one
+static inline uint64_t scope_word(int w) {
+    return ctx->inode_scope ? ctx->inode_scope[w] : ~UINT64_C(0);
+}
+
+// Whether inode ino is in the inode scope
+static inline bool inode_in_scope(int ino) {
+    return (scope_word(ino / 64) >> (ino % 64)) & 1;
+}
+
+// Next live, in-scope inode after prev (-1 to start), or -1 when there is
+// none
+int next_live_inode(int prev) {
+    return next_set_bit(ctx->inode_soa.live_mask, ctx->inode_scope, INODE_COUNT, prev);
+}
+
+// Load 64 bits of an on-disk (LSB-first) bitmap as a word
+static inline uint64_t load_bitmap_word(const uint8_t *bitmap, int w) {
+    uint64_t word;
+    memcpy(&word, bitmap + (size_t)w * sizeof(word), sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Update one block pointer of an inode in both the image and the shadow
+void set_inode_pointer(int ino, int which, uint32_t blk) {
+    inode_t *inode = &ctx->inode_table[ino];
+    switch (which) {
+    case PTR_DIRECT: inode->direct_block = blk; break;
+    case PTR_SINGLE: inode->single_indirect = blk; break;
+    case PTR_DOUBLE: inode->double_indirect = blk; break;
+    case PTR_TRIPLE: inode->triple_indirect = blk; break;
+    }
+    ctx->inode_soa.ptr[which][ino] = blk;
+}
+
+// Update blocks_count of an inode in both the image and the shadow
+void set_inode_blocks_count(int ino, uint32_t count) {
+    ctx->inode_table[ino].blocks_count = count;
+    ctx->inode_soa.blocks_count[ino] = count;
+}
+
+// Update links_count of an inode in both the image and the shadow, whose
+// live mask follows it
+void set_inode_links_count(int ino, uint32_t count) {
+    ctx->inode_table[ino].links_count = count;
+    uint64_t bit = UINT64_C(1) << (ino % 64);
+    if (is_inode_valid(&ctx->inode_table[ino])) {
+        ctx->inode_soa.live_mask[ino / 64] |= bit;
     } else {
-        printf("Inode bitmap block is valid (%u)\n", superblock->inode_bitmap_block);
+        ctx->inode_soa.live_mask[ino / 64] &= ~bit;
     }
-    
-    // Check data bitmap block
-    if (superblock->data_bitmap_block != DATA_BITMAP_BLOCK_NUM) {
-        printf("Error: Invalid data bitmap block (%u). Expected %u\n", 
-               superblock->data_bitmap_block, DATA_BITMAP_BLOCK_NUM);
-        if (fix) {
-            printf("Fixing: Setting correct data bitmap block\n");
-            superblock->data_bitmap_block = DATA_BITMAP_BLOCK_NUM;
+}
+
+// logical is the block's index within the file, holes included
+typedef void (*block_visitor_t)(uint32_t blk, uint32_t logical, void *arg);
+
+// Visit the data blocks below a pointer at the given indirection depth;
+// the tree covers span logical blocks starting at logical
+static void walk_tree_blocks(uint32_t blk, int depth, uint32_t logical, uint32_t span,
+                             block_visitor_t visit, void *arg) {
+    if (blk < DATA_BLOCK_START_NUM || blk >= TOTAL_BLOCKS) {
+        return;
+    }
+    if (depth == 0) {
+        visit(blk, logical, arg);
+        return;
+    }
+    uint32_t *entries = (uint32_t *)get_block(blk);
+    uint32_t entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t stride = span / entries_per_block;
+    for (uint32_t j = 0; j < entries_per_block; j++) {
+        if (entries[j] != 0) {
+            walk_tree_blocks(entries[j], depth - 1, logical + j * stride, stride, visit, arg);
         }
-        isValid = false;
-    } else {
-        printf("Data bitmap block is valid (%u)\n", superblock->data_bitmap_block);
     }
-    
-    // Check inode table start block
-    if (superblock->inode_table_start != INODE_TABLE_START_BLOCK_NUM) {
-        printf("Error: Invalid inode table start block (%u). Expected %u\n", 
-               superblock->inode_table_start, INODE_TABLE_START_BLOCK_NUM);
-        if (fix) {
-            printf("Fixing: Setting correct inode table start block\n");
-            superblock->inode_table_start = INODE_TABLE_START_BLOCK_NUM;
+}
+
+// Visit every in-range data block of an inode in logical order
+void for_each_file_block(int ino, block_visitor_t visit, void *arg) {
+    uint32_t entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t logical = 0, span = 1;
+    for (int p = 0; p < PTR_COUNT; p++) {
+        walk_tree_blocks(ctx->inode_soa.ptr[p][ino], p, logical, span, visit, arg);
+        logical += span;
+        span *= entries_per_block;
+    }
+}
+
+// Whether an inode is a directory according to its mode
+static inline bool inode_is_dir(int ino) {
+    return S_ISDIR(ctx->inode_soa.mode[ino]);
+}
+
+/*
+ * Allocation for repairs
+ */
+
+// Find a free inode (dead and clear in the inode bitmap) and mark it used
+int alloc_inode(void) {
+    for (int w = 0; w < INODE_MASK_WORDS; w++) {
+        uint64_t free_bits = ~(ctx->inode_soa.live_mask[w] | load_bitmap_word(ctx->inode_bitmap, w));
+        if (w == ROOT_INODE_NUM / 64) {
+            free_bits &= ~(UINT64_C(1) << (ROOT_INODE_NUM % 64));
+        }
+        if (w == INODE_MASK_WORDS - 1) {
+            free_bits &= INODE_MASK_TAIL;
+        }
+        if (free_bits != 0) {
+            int i = w * 64 + __builtin_ctzll(free_bits);
+            set_bit(ctx->inode_bitmap, i);
+            return i;
         }
-        isValid = false;
-    } else {
-        printf("Inode table start block is valid (%u)\n", superblock->inode_table_start);
     }
-    
-    // Check first data block
-    if (superblock->first_data_block != DATA_BLOCK_START_NUM) {
-        printf("Error: Invalid first data block (%u). Expected %u\n", 
-               superblock->first_data_block, DATA_BLOCK_START_NUM);
-        if (fix) {
-            printf("Fixing: Setting correct first data block\n");
-            superblock->first_data_block = DATA_BLOCK_START_NUM;
+    return -1;
+}
+
+/*
+ * Free-extent tree
+ *
+ * A segment tree over the data blocks where every node stores the length of
+ * the free run at its left edge, at its right edge, and the longest free run
+ * inside it. Finding the first free extent of a given length and marking
+ * blocks used or free are O(log n). The tree is built from the data bitmap
+ * (after the bitmap check has reconciled it) the first time a repair needs
+ * a block, scanning the bitmap a word at a time so fully used words cost one
+ * comparison. Changes to data_bitmap made outside the allocator must call
+ * invalidate_free_extents().
+ */
+#define DATA_MASK_WORDS ((DATA_BLOCKS_COUNT + 63) / 64)
+
+
+static void extent_pull(int node, uint32_t half) {
+    int l = 2 * node, r = l + 1;
+    ctx->free_extents.prefix[node] = ctx->free_extents.prefix[l] == half ? half + ctx->free_extents.prefix[r]
+                                                               : ctx->free_extents.prefix[l];
+    ctx->free_extents.suffix[node] = ctx->free_extents.suffix[r] == half ? half + ctx->free_extents.suffix[l]
+                                                               : ctx->free_extents.suffix[r];
+    uint32_t best = ctx->free_extents.suffix[l] + ctx->free_extents.prefix[r];
+    if (ctx->free_extents.best[l] > best) best = ctx->free_extents.best[l];
+    if (ctx->free_extents.best[r] > best) best = ctx->free_extents.best[r];
+    ctx->free_extents.best[node] = best;
+}
+
+// Set one data block (0-based index) free or used in the tree
+static void extent_set(int idx, bool is_free) {
+    int node = ctx->free_extents.leaves + idx;
+    ctx->free_extents.prefix[node] = ctx->free_extents.suffix[node] = ctx->free_extents.best[node] = is_free;
+    uint32_t half = 1;
+    for (node /= 2; node >= 1; node /= 2, half *= 2) {
+        extent_pull(node, half);
+    }
+}
+
+void invalidate_free_extents(void) {
+    ctx->free_extents.valid = false;
+}
+
+void free_free_extents(void) {
+    free(ctx->free_extents.prefix);
+    memset(&ctx->free_extents, 0, sizeof(ctx->free_extents));
+}
+
+// (Re)build the tree from data_bitmap
+bool build_free_extents(void) {
+    if (!ctx->free_extents.prefix) {
+        int leaves = 1;
+        while (leaves < DATA_BLOCKS_COUNT) {
+            leaves *= 2;
         }
-        isValid = false;
-    } else {
-        printf("First data block is valid (%u)\n", superblock->first_data_block);
+        uint32_t *mem = malloc((size_t)6 * leaves * sizeof(uint32_t));
+        if (!mem) {
+            return false;
+        }
+        ctx->free_extents.leaves = leaves;
+        ctx->free_extents.prefix = mem;
+        ctx->free_extents.suffix = mem + 2 * leaves;
+        ctx->free_extents.best = mem + 4 * leaves;
     }
     
-    // Check inode size
-    if (superblock->inode_size != INODE_SIZE) {
-        printf("Error: Invalid inode size (%u). Expected %u\n", 
-               superblock->inode_size, INODE_SIZE);
-        if (fix) {
-            printf("Fixing: Setting correct inode size\n");
-            superblock->inode_size = INODE_SIZE;
+    int leaves = ctx->free_extents.leaves;
+    memset(ctx->free_extents.prefix, 0, (size_t)6 * leaves * sizeof(uint32_t));
+    
+    // Only the zero bits of each bitmap word become free leaves
+    for (int w = 0; w < DATA_MASK_WORDS; w++) {
+        uint64_t free_bits = ~load_bitmap_word(ctx->data_bitmap, w);
+        if (w == DATA_MASK_WORDS - 1 && DATA_BLOCKS_COUNT % 64) {
+            free_bits &= (UINT64_C(1) << (DATA_BLOCKS_COUNT % 64)) - 1;
+        }
+        for (; free_bits != 0; free_bits &= free_bits - 1) {
+            int node = leaves + w * 64 + __builtin_ctzll(free_bits);
+            ctx->free_extents.prefix[node] = ctx->free_extents.suffix[node] = ctx->free_extents.best[node] = 1;
         }
-        isValid = false;
-    } else {
-        printf("Inode size is valid (%u)\n", superblock->inode_size);
     }
     
-    // Check inode count
-    if (superblock->inode_count != INODE_COUNT) {
-        printf("Error: Invalid inode count (%u). Expected %u\n", 
-               superblock->inode_count, INODE_COUNT);
-        if (fix) {
-            printf("Fixing: Setting correct inode count\n");
-            superblock->inode_count = INODE_COUNT;
+    uint32_t half = 1;
+    for (int level_start = leaves / 2; level_start >= 1; level_start /= 2, half *= 2) {
+        for (int node = level_start; node < 2 * level_start; node++) {
+            extent_pull(node, half);
         }
-        isValid = false;
-    } else {
-        printf("Inode count is valid (%u)\n", superblock->inode_count);
     }
-    
-    return isValid;
+    ctx->free_extents.valid = true;
+    return true;
 }
 
-// 2. Data Bitmap Consistency Checker //22101328
-bool validate_data_bitmap(bool fix) {
-    printf("\n=== Data Bitmap Validation ===\n");
-    
-    bool isValid = true;
-    bool *block_used = calloc(DATA_BLOCKS_COUNT, sizeof(bool));
-    
-    if (!block_used) {
-        printf("Memory allocation failed\n");
-        return false;
+// First data block index starting a free run of at least len blocks, or -1
+static int extent_find(uint32_t len) {
+    if (len == 0 || ctx->free_extents.best[1] < len) {
+        return -1;
     }
-    
-    // First pass: Check all inodes and mark which data blocks they reference
-    printf("Checking blocks referenced by inodes...\n");
-    for (int i = 0; i < INODE_COUNT; i++) {
-        inode_t *inode = &inode_table[i];
-        
-        // Skip invalid inodes
-        if (!is_inode_valid(inode)) {
-            continue;
+    int node = 1;
+    int start = 0;
+    uint32_t half = ctx->free_extents.leaves / 2;
+    while (node < ctx->free_extents.leaves) {
+        int l = 2 * node, r = l + 1;
+        if (ctx->free_extents.best[l] >= len) {
+            node = l;
+        } else if (ctx->free_extents.suffix[l] + ctx->free_extents.prefix[r] >= len) {
+            return start + (int)(half - ctx->free_extents.suffix[l]);
+        } else {
+            node = r;
+            start += half;
         }
-        
-        // Check direct block pointer
-        if (inode->direct_block != 0) {
-            int block_idx = inode->direct_block - DATA_BLOCK_START_NUM;
-            if (block_idx >= 0 && block_idx < DATA_BLOCKS_COUNT) {
-                block_used[block_idx] = true;
-            }
+        half /= 2;
+    }
+    return start;
+}
+
+// Allocate len contiguous data blocks; returns the first block number or 0
+uint32_t alloc_extent(uint32_t len) {
+    if (!ctx->free_extents.valid && !build_free_extents()) {
+        return 0;
+    }
+    int idx = extent_find(len);
+    if (idx < 0) {
+        return 0;
+    }
+    for (uint32_t k = 0; k < len; k++) {
+        set_bit(ctx->data_bitmap, idx + k);
+        extent_set(idx + k, false);
+    }
+    return (uint32_t)idx + DATA_BLOCK_START_NUM;
+}
+
+// Allocate up to count data blocks, as few extents as possible, and mark them
+// used in data_bitmap. Returns how many block numbers were stored in out.
+int alloc_data_blocks(int count, uint32_t *out) {
+    if (!ctx->free_extents.valid && !build_free_extents()) {
+        return 0;
+    }
+    int n = 0;
+    while (n < count && ctx->free_extents.best[1] > 0) {
+        uint32_t len = (uint32_t)(count - n);
+        if (len > ctx->free_extents.best[1]) {
+            len = ctx->free_extents.best[1];
         }
-        
-        // Check indirect block pointers
-        
-        if (inode->single_indirect != 0) {
-            int block_idx = inode->single_indirect - DATA_BLOCK_START_NUM;
-            if (block_idx >= 0 && block_idx < DATA_BLOCKS_COUNT) {
-                block_used[block_idx] = true;
-            }
+        uint32_t first = alloc_extent(len);
+        for (uint32_t k = 0; k < len; k++) {
+            out[n++] = first + k;
         }
-        
-        if (inode->double_indirect != 0) {
-            int block_idx = inode->double_indirect - DATA_BLOCK_START_NUM;
-            if (block_idx >= 0 && block_idx < DATA_BLOCKS_COUNT) {
-                block_used[block_idx] = true;
-            }
+    }
+    return n;
+}
+
+// Return data blocks to the free pool
+void free_data_blocks(const uint32_t *blocks, int count) {
+    for (int b = 0; b < count; b++) {
+        int idx = blocks[b] - DATA_BLOCK_START_NUM;
+        clear_bit(ctx->data_bitmap, idx);
+        if (ctx->free_extents.valid) {
+            extent_set(idx, true);
         }
-        
-        if (inode->triple_indirect != 0) {
-            int block_idx = inode->triple_indirect - DATA_BLOCK_START_NUM;
-            if (block_idx >= 0 && block_idx < DATA_BLOCKS_COUNT) {
-                block_used[block_idx] = true;
-            }
+    }
+}
+
+typedef struct {
+    uint32_t *blocks;
+    int len, cap;
+    bool out_of_memory;
+} block_list_t;
+
+static void collect_block(uint32_t blk, uint32_t logical, void *arg) {
+    block_list_t *list = arg;
+    (void)logical;
+    if (list->len == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 16;
+        uint32_t *p = realloc(list->blocks, (size_t)cap * sizeof(uint32_t));
+        if (!p) {
+            list->out_of_memory = true;
+            return;
         }
+        list->blocks = p;
+        list->cap = cap;
     }
+    list->blocks[list->len++] = blk;
+}
+
+// Build a directory entry
+dirent_t make_dirent(uint32_t ino, const char *name) {
+    dirent_t e;
+    memset(&e, 0, sizeof(e));
+    e.inode = ino;
+    memcpy(e.name, name, strnlen(name, DIR_NAME_LEN - 1));
+    return e;
+}
+
+/*
+ * Append count entries to a directory. Free slots in the existing blocks are
+ * filled first; the rest go into freshly allocated blocks that are claimed
+ * from the data bitmap in one go, attached behind the direct pointer and the
+ * single indirect block, and filled completely before moving on. Returns
+ * how many entries were placed (fewer when space or free blocks run out).
+ */
+int append_dir_entries(int dir, const dirent_t *entries, int count) {
+    int done = 0;
+    int per_block = (int)DIRENTS_PER_BLOCK;
+    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
     
-    // Second pass: Check if data bitmap matches actual block usage
-    printf("Validating data bitmap against block references...\n");
-    for (int i = 0; i < DATA_BLOCKS_COUNT; i++) {
-        bool bitmap_used = is_bit_set(data_bitmap, i);
-        
-        // Case 1: Block is referenced by an inode but not marked as used in bitmap
-        if (block_used[i] && !bitmap_used) {
-            printf("Error: Block %d is referenced by inode(s) but not marked used in data bitmap\n", 
-                   i + DATA_BLOCK_START_NUM);
-            if (fix) {
-                printf("Fixing: Marking block %d as used in data bitmap\n", 
-                       i + DATA_BLOCK_START_NUM);
-                set_bit(data_bitmap, i);
-            }
-            isValid = false;
-        }
-        
-        // Case 2: Block is marked as used in bitmap but not referenced by any inode
-        if (!block_used[i] && bitmap_used) {
-            printf("Error: Block %d is marked used in data bitmap but not referenced by any inode\n", 
-                   i + DATA_BLOCK_START_NUM);
-            if (fix) {
-                printf("Fixing: Clearing block %d in data bitmap\n", 
-                       i + DATA_BLOCK_START_NUM);
-                clear_bit(data_bitmap, i);
+    block_list_t list = {0};
+    for_each_file_block(dir, collect_block, &list);
+    for (int b = 0; b < list.len && done < count; b++) {
+        dirent_t *slots = (dirent_t *)get_block(list.blocks[b]);
+        for (int slot = 0; slot < per_block && done < count; slot++) {
+            if (slots[slot].name[0] == '\0') {
+                slots[slot] = entries[done++];
             }
-            isValid = false;
         }
     }
+    int existing_blocks = list.len;
+    free(list.blocks);
+    if (done == count) {
+        return done;
+    }
     
-    free(block_used);
-    return isValid;
-}
-
-// 3. Inode Bitmap Consistency Checker //22101305
-bool validate_inode_bitmap(bool fix) {
-    printf("\n=== Inode Bitmap Validation ===\n");
+    // Work out how many new blocks fit behind the direct and single indirect pointers
+    int needed = (count - done + per_block - 1) / per_block;
+    bool use_direct = ctx->inode_soa.ptr[PTR_DIRECT][dir] == 0;
+    uint32_t single = ctx->inode_soa.ptr[PTR_SINGLE][dir];
+    int free_slots = 0;
+    if (single == 0) {
+        free_slots = entries_per_block;
+    } else if (single >= DATA_BLOCK_START_NUM && single < TOTAL_BLOCKS) {
+        uint32_t *indirect = (uint32_t *)get_block(single);
+        for (int j = 0; j < entries_per_block; j++) {
+            free_slots += indirect[j] == 0;
+        }
+    }
+    if (needed > (int)use_direct + free_slots) {
+        needed = (int)use_direct + free_slots;
+    }
     
-    bool isValid = true;
+    // A new single indirect block is claimed first so the data blocks follow it
+    uint32_t new_indirect = 0;
+    if (needed > (int)use_direct && single == 0) {
+        if (alloc_data_blocks(1, &new_indirect) != 1) {
+            needed = use_direct;
+        }
+    }
+    uint32_t *new_blocks = malloc((size_t)(needed ? needed : 1) * sizeof(uint32_t));
+    if (!new_blocks) {
+        if (new_indirect) {
+            free_data_blocks(&new_indirect, 1);
+        }
+        return done;
+    }
+    int got = alloc_data_blocks(needed, new_blocks);
+    if (new_indirect && got <= (int)use_direct) {
+        free_data_blocks(&new_indirect, 1);
+        new_indirect = 0;
+    }
     
-    // Check each inode
-    for (int i = 0; i < INODE_COUNT; i++) {
-        inode_t *inode = &inode_table[i];
-        bool is_valid = is_inode_valid(inode);
-        bool bitmap_used = is_bit_set(inode_bitmap, i);
-        
-        // Case 1: Valid inode but not marked in bitmap
-        if (is_valid && !bitmap_used) {
-            printf("Error: Inode %d is valid but not marked used in inode bitmap\n", i);
-            if (fix) {
-                printf("Fixing: Marking inode %d as used in inode bitmap\n", i);
-                set_bit(inode_bitmap, i);
-            }
-            isValid = false;
+    // Attach and fill the new blocks
+    int b = 0;
+    if (use_direct && got > 0) {
+        set_inode_pointer(dir, PTR_DIRECT, new_blocks[b++]);
+    }
+    if (b < got) {
+        if (new_indirect) {
+            memset(get_block(new_indirect), 0, BLOCK_SIZE);
+            set_inode_pointer(dir, PTR_SINGLE, new_indirect);
         }
-        
-        // Case 2: Invalid inode but marked in bitmap
-        if (!is_valid && bitmap_used) {
-            printf("Error: Inode %d is invalid but marked used in inode bitmap\n", i);
-            if (fix) {
-                printf("Fixing: Clearing inode %d in inode bitmap\n", i);
-                clear_bit(inode_bitmap, i);
+        uint32_t *indirect = (uint32_t *)get_block(ctx->inode_soa.ptr[PTR_SINGLE][dir]);
+        for (int j = 0; j < entries_per_block && b < got; j++) {
+            if (indirect[j] == 0) {
+                indirect[j] = new_blocks[b++];
             }
-            isValid = false;
         }
     }
+    for (int k = 0; k < got; k++) {
+        dirent_t *slots = (dirent_t *)get_block(new_blocks[k]);
+        memset(slots, 0, BLOCK_SIZE);
+        for (int slot = 0; slot < per_block && done < count; slot++) {
+            slots[slot] = entries[done++];
+        }
+    }
+    free(new_blocks);
     
-    return isValid;
+    inode_t *inode = &ctx->inode_table[dir];
+    inode->blocks_count += got;
+    if (inode->size < (uint32_t)(existing_blocks + got) * BLOCK_SIZE) {
+        inode->size = (uint32_t)(existing_blocks + got) * BLOCK_SIZE;
+    }
+    refresh_inode_soa(dir);
+    return done;
 }
 
-// 4. Duplicate Block Checker //22101305
+/*
+ * Timestamp formatting
+ *
+ * Timestamps are rendered as "YYYY-MM-DD HH:MM:SS" in local time without
+ * going through localtime/strftime: the UTC offset is resolved once by
+ * time_format_init() and the calendar conversion is done arithmetically,
+ * so formatting is reentrant and cheap enough for bulk inode dumps. The
+ * cached offset is the one in effect at startup (DST changes are ignored).
+ */
+#define TIME_STR_LEN 20  // "YYYY-MM-DD HH:MM:SS" + NUL
 
-bool check_data_block_for_duplicates(uint32_t blk, int ino, bool do_fix, int *inode_refs) {
-    bool valid = true;
-    if (blk >= DATA_BLOCK_START_NUM && blk < TOTAL_BLOCKS) {
-        if (block_ref_count[blk]) {
-            valid = false;
-            printf("Error: Block %u is referenced by inode %d and inode %d\n", blk, inode_refs[blk], ino);
-            
-            
-            
-            if (do_fix) {
-                printf("Note: Duplicate in indirect block - requires file system recovery tools\n");
+static long tz_offset_seconds = 0;
+static pthread_once_t time_format_once = PTHREAD_ONCE_INIT;
+
+// Resolve the local UTC offset; vsfsck_open() runs this once per process
+void time_format_init(void) {
+    time_t now = time(NULL);
+    struct tm local;
+    if (localtime_r(&now, &local)) {
+        tz_offset_seconds = local.tm_gmtoff;
+    }
+}
+
+static char *put_digits(char *p, unsigned value, int width) {
+    for (int d = width - 1; d >= 0; d--) {
+        p[d] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    return p + width;
+}
+
+// Format a timestamp into buf (at least TIME_STR_LEN bytes); returns buf
+char *format_time(uint32_t timestamp, char *buf) {
+    int64_t t = (int64_t)timestamp + tz_offset_seconds;
+    int64_t days = t / 86400;
+    int64_t secs = t % 86400;
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+    
+    // Civil date from days since 1970-01-01 (proleptic Gregorian calendar)
+    int64_t z = days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    unsigned day = doy - (153 * mp + 2) / 5 + 1;
+    unsigned month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = (int64_t)yoe + era * 400 + (month <= 2);
+    
+    char *p = buf;
+    p = put_digits(p, (unsigned)year, 4);
+    *p++ = '-';
+    p = put_digits(p, month, 2);
+    *p++ = '-';
+    p = put_digits(p, day, 2);
+    *p++ = ' ';
+    p = put_digits(p, (unsigned)(secs / 3600), 2);
+    *p++ = ':';
+    p = put_digits(p, (unsigned)(secs / 60 % 60), 2);
+    *p++ = ':';
+    p = put_digits(p, (unsigned)(secs % 60), 2);
+    *p = '\0';
+    return buf;
+}
+
+// Convert time to string for display (per-thread buffer)
+char *time_to_str(uint32_t timestamp) {
+    static _Thread_local char buffer[TIME_STR_LEN];
+    return format_time(timestamp, buffer);
+}
+
+/*
+ * Report output
+ */
+
+// Build a finding with the common fields filled in
+finding_t new_finding(check_id_t check, finding_code_t code, int inode, uint32_t block, bool fix) {
+    finding_t f = {0};
+    f.check = check;
+    f.code = code;
+    f.severity = SEVERITY_ERROR;
+    f.action = fix ? ACTION_FIXED : ACTION_NONE;
+    f.slot = -1;
+    f.inode = inode;
+    f.block = block;
+    return f;
+}
+
+// Print the "further findings suppressed" notice for the current run
+void report_flush_suppressed(void) {
+    FILE *out = ctx->out;
+    if (ctx->rate.suppressed > 0 && out) {
+        if (ctx->output_format == OUTPUT_TEXT) {
+            if (ctx->rate.inode >= 0) {
+                fprintf(out, "Note: %lu further %s findings for inode %d suppressed\n",
+                        ctx->rate.suppressed, check_names[ctx->rate.check], ctx->rate.inode);
+            } else {
+                fprintf(out, "Note: %lu further %s findings suppressed\n",
+                        ctx->rate.suppressed, check_names[ctx->rate.check]);
             }
+        } else if (ctx->output_format == OUTPUT_JSON) {
+            fprintf(out, "{\"type\":\"suppressed\",\"check\":\"%s\",\"inode\":%d,\"count\":%lu}\n",
+                    check_names[ctx->rate.check], ctx->rate.inode, ctx->rate.suppressed);
         } else {
-            block_ref_count[blk] = true;
-            inode_refs[blk] = ino;
+            finding_t f = new_finding(ctx->rate.check, FINDING_SUPPRESSED, ctx->rate.inode, 0, false);
+            f.severity = SEVERITY_INFO;
+            f.aux = ctx->rate.suppressed > UINT32_MAX ? UINT32_MAX : (uint32_t)ctx->rate.suppressed;
+            fwrite(&f, sizeof(f), 1, out);
         }
     }
-    return valid;
+    ctx->rate.check = -1;
+    ctx->rate.inode = -1;
+    ctx->rate.emitted = 0;
+    ctx->rate.suppressed = 0;
+    ctx->rate.last_suppressed = false;
 }
-bool check_duplicate_blocks(bool fix) {
-    printf("\n=== Duplicate Block Check ===\n");
-    
-    bool isValid = true;
+
+// Write the binary header
+void report_begin(void) {
+    if (ctx->out && ctx->output_format == OUTPUT_BINARY) {
+        uint32_t version = REPORT_BINARY_VERSION;
+        fwrite(REPORT_BINARY_MAGIC, 1, 4, ctx->out);
+        fwrite(&version, sizeof(version), 1, ctx->out);
+    }
+}
+
+// Print a human-readable line; dropped for the structured formats
+void report_info(const char *fmt, ...) {
+    if (ctx->output_format != OUTPUT_TEXT || !ctx->out) {
+        return;
+    }
+    report_flush_suppressed();
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(ctx->out, fmt, ap);
+    va_end(ap);
+}
+
+// Print a line belonging to the previous finding (e.g. "Fixing: ...").
+// Dropped together with that finding when it was rate limited.
+void report_followup(const char *fmt, ...) {
+    if (ctx->output_format != OUTPUT_TEXT || !ctx->out || ctx->rate.last_suppressed) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(ctx->out, fmt, ap);
+    va_end(ap);
+}
+
+// Emit one finding. The message is only formatted when the text report or
+// the finding callback consumes it.
+void report_finding(const finding_t *f, const char *fmt, ...) {
+    ctx->finding_histogram[f->check][f->code]++;
     
+    bool want_text = ctx->out && ctx->output_format == OUTPUT_TEXT;
+    char message[REPORT_MESSAGE_LEN];
+    if (want_text || ctx->on_finding) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(message, sizeof(message), fmt, ap);
+        va_end(ap);
+    }
+    if (ctx->on_finding) {
+        ctx->on_finding(ctx->user, f, message);
+    }
     
-    memset(block_ref_count, 0, TOTAL_BLOCKS * sizeof(bool));
+    if (ctx->rate.check != f->check || ctx->rate.inode != f->inode) {
+        report_flush_suppressed();
+        ctx->rate.check = f->check;
+        ctx->rate.inode = f->inode;
+    }
+    if (ctx->max_findings_per_inode > 0 && ctx->rate.emitted >= ctx->max_findings_per_inode) {
+        ctx->rate.suppressed++;
+        ctx->rate.last_suppressed = true;
+        return;
+    }
+    ctx->rate.emitted++;
+    ctx->rate.last_suppressed = false;
     
+    FILE *out = ctx->out;
+    if (!out) {
+        return;
+    }
+    switch (ctx->output_format) {
+    case OUTPUT_TEXT:
+        fprintf(out, "%s%s\n", f->severity == SEVERITY_ERROR ? "Error: " : "Warning: ", message);
+        break;
+    case OUTPUT_JSON:
+        fprintf(out, "{\"type\":\"finding\",\"check\":\"%s\",\"code\":\"%s\",\"severity\":\"%s\","
+                "\"inode\":%d,\"block\":%u,\"level\":%u,\"slot\":%d,\"aux\":%u,\"action\":\"%s\"}\n",
+                check_names[f->check], finding_names[f->code], severity_names[f->severity],
+                f->inode, f->block, f->level, f->slot, f->aux, action_names[f->action]);
+        break;
+    case OUTPUT_BINARY:
+        fwrite(f, sizeof(*f), 1, out);
+        break;
+    }
+}
+
+// Emit the per-check verdicts as a final JSON record
+void report_summary(const char *label, const bool results[CHECK_MAX]) {
+    report_flush_suppressed();
+    FILE *out = ctx->out;
+    if (ctx->output_format != OUTPUT_JSON || !out) {
+        return;
+    }
+    fprintf(out, "{\"type\":\"%s\"", label);
+    for (int c = 0; c < CHECK_MAX; c++) {
+        fprintf(out, ",\"%s\":%s", check_names[c], results[c] ? "true" : "false");
+    }
+    fprintf(out, "}\n");
+}
+
+// Print how many findings of each kind a histogram holds
+void print_histogram(FILE *out, output_format_t format, unsigned long histogram[CHECK_MAX][FINDING_MAX]) {
+    unsigned long total = 0;
+    for (int c = 0; c < CHECK_MAX; c++) {
+        for (int k = 0; k < FINDING_MAX; k++) {
+            total += histogram[c][k];
+        }
+    }
     
-    int *inode_refs = calloc(TOTAL_BLOCKS, sizeof(int));
-    if (!inode_refs) {
-        printf("Memory allocation failed\n");
+    if (out && total > 0 && format == OUTPUT_TEXT) {
+        fprintf(out, "\n=== Findings Histogram ===\n");
+        for (int c = 0; c < CHECK_MAX; c++) {
+            for (int k = 0; k < FINDING_MAX; k++) {
+                if (histogram[c][k] > 0) {
+                    fprintf(out, "%-18s %-22s %lu\n", check_names[c], finding_names[k], histogram[c][k]);
+                }
+            }
+        }
+        fprintf(out, "%-41s %lu\n", "total", total);
+    } else if (out && format == OUTPUT_JSON) {
+        fprintf(out, "{\"type\":\"histogram\",\"total\":%lu", total);
+        for (int c = 0; c < CHECK_MAX; c++) {
+            for (int k = 0; k < FINDING_MAX; k++) {
+                if (histogram[c][k] > 0) {
+                    fprintf(out, ",\"%s.%s\":%lu", check_names[c], finding_names[k], histogram[c][k]);
+                }
+            }
+        }
+        fprintf(out, "}\n");
+    }
+}
+
+// Print how many findings of each kind were seen (including suppressed
+// ones) and reset the counters for the next pass
+void report_histogram(void) {
+    report_flush_suppressed();
+    print_histogram(ctx->out, ctx->output_format, ctx->finding_histogram);
+    memset(ctx->finding_histogram, 0, sizeof(ctx->finding_histogram));
+}
+
+/*
+ * Time budget and checkpoints
+ *
+ * With --budget=SECONDS the checker stops once the budget is spent and
+ * saves its progress to the --checkpoint file: the phase it stopped in,
+ * the first inode that phase has not scanned, the verdicts and finding
+ * counts so far, and the partial reachable bitmap (data bitmap phase) and
+ * owner map (duplicate phase). Run again with the same checkpoint file to
+ * continue from there. The final summary and histogram match an
+ * uninterrupted run; findings printed by earlier runs are not repeated.
+ *
+ * The checkpoint is tied to the image by a hash of its contents and is
+ * removed once a run completes.
+ */
+#define CHECKPOINT_MAGIC "VSCP"
+#define CHECKPOINT_VERSION 2
+
+
+
+// FNV-1a over a byte range
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+#define FNV_OFFSET UINT64_C(0xCBF29CE484222325)
+
+// Start the budget clock
+void budget_start(void) {
+    if (ctx->check_budget <= 0.0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ctx->budget.deadline);
+    long long ns = (long long)(ctx->check_budget * 1e9) + ctx->budget.deadline.tv_nsec;
+    ctx->budget.deadline.tv_sec += ns / 1000000000LL;
+    ctx->budget.deadline.tv_nsec = ns % 1000000000LL;
+    ctx->budget.limited = true;
+}
+
+// Whether the phase must stop before scanning next_inode. The first call
+// after the deadline records the stop point. The first unit of work of a
+// run is always allowed, so every run makes progress.
+bool budget_stop(check_id_t phase, int next_inode) {
+    if (!ctx->budget.limited) {
         return false;
     }
+    if (!ctx->budget.progressed) {
+        ctx->budget.progressed = true;
+        return false;
+    }
+    if (!ctx->budget.stopped) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < ctx->budget.deadline.tv_sec ||
+            (now.tv_sec == ctx->budget.deadline.tv_sec && now.tv_nsec < ctx->budget.deadline.tv_nsec)) {
+            return false;
+        }
+        ctx->budget.stopped = true;
+        ctx->budget.ckpt.phase = phase;
+        ctx->budget.ckpt.next_inode = next_inode;
+    }
+    return true;
+}
+
+// First inode a phase has to scan: 0, or the stop point of a resumed phase
+int resume_inode(check_id_t phase) {
+    if (ctx->budget.resumed && ctx->budget.ckpt.phase == (uint32_t)phase) {
+        return ctx->budget.ckpt.next_inode;
+    }
+    return 0;
+}
+
+// Read checkpoint_path into budget.ckpt. Returns 1 when resuming, 0 when
+// there is no checkpoint yet and -1 when it is unusable for this image.
+int load_checkpoint(void) {
+    FILE *f = fopen(ctx->checkpoint_path, "rb");
+    if (!f) {
+        return 0;
+    }
+    char magic[4];
+    uint32_t version = 0, size = 0;
+    uint64_t image_hash = 0, sum = 0;
+    bool ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, CHECKPOINT_MAGIC, 4) == 0 &&
+              fread(&version, sizeof(version), 1, f) == 1 && version == CHECKPOINT_VERSION &&
+              fread(&image_hash, sizeof(image_hash), 1, f) == 1 &&
+              fread(&size, sizeof(size), 1, f) == 1 && size == sizeof(checkpoint_t) &&
+              fread(&ctx->budget.ckpt, sizeof(checkpoint_t), 1, f) == 1 &&
+              fread(&sum, sizeof(sum), 1, f) == 1;
+    fclose(f);
     
+    if (!ok || sum != fnv1a(FNV_OFFSET, &ctx->budget.ckpt, sizeof(checkpoint_t)) ||
+        ctx->budget.ckpt.phase >= CHECK_MAX || ctx->budget.ckpt.next_inode < 0 ||
+        ctx->budget.ckpt.next_inode > INODE_COUNT) {
+        fprintf(stderr, "Error: Checkpoint %s is corrupt\n", ctx->checkpoint_path);
+        return -1;
+    }
+    if (image_hash != fnv1a(FNV_OFFSET, ctx->fs_image, TOTAL_BLOCKS * BLOCK_SIZE)) {
+        fprintf(stderr, "Error: Checkpoint %s was taken on a different image\n", ctx->checkpoint_path);
+        return -1;
+    }
     
+    for (int c = 0; c < CHECK_MAX; c++) {
+        for (int k = 0; k < FINDING_MAX; k++) {
+            ctx->finding_histogram[c][k] += ctx->budget.ckpt.histogram[c][k];
+        }
+    }
+    ctx->budget.resumed = true;
+    return 1;
+}
+
+// Writes the contents of a file; returns whether every write succeeded
+typedef bool (*file_writer_t)(FILE *f, void *arg);
+
+// Write a file through writer into path.tmp and rename it over path, so the
+// old file stays intact until the new one is complete
+bool write_file_atomic(const char *path, file_writer_t writer, void *arg) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        return false;
+    }
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = writer(f, arg);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+static bool write_checkpoint(FILE *f, void *arg) {
+    const checkpoint_t *ckpt = arg;
+    uint32_t version = CHECKPOINT_VERSION, size = sizeof(checkpoint_t);
+    uint64_t image_hash = fnv1a(FNV_OFFSET, ctx->fs_image, TOTAL_BLOCKS * BLOCK_SIZE);
+    uint64_t sum = fnv1a(FNV_OFFSET, ckpt, sizeof(checkpoint_t));
+    return fwrite(CHECKPOINT_MAGIC, 1, 4, f) == 4 &&
+           fwrite(&version, sizeof(version), 1, f) == 1 &&
+           fwrite(&image_hash, sizeof(image_hash), 1, f) == 1 &&
+           fwrite(&size, sizeof(size), 1, f) == 1 &&
+           fwrite(ckpt, sizeof(checkpoint_t), 1, f) == 1 &&
+           fwrite(&sum, sizeof(sum), 1, f) == 1;
+}
+
+// Write budget.ckpt with the given verdicts, replacing the file atomically
+bool save_checkpoint(const bool results[CHECK_MAX]) {
+    for (int c = 0; c < CHECK_MAX; c++) {
+        ctx->budget.ckpt.results[c] = results[c];
+        for (int k = 0; k < FINDING_MAX; k++) {
+            ctx->budget.ckpt.histogram[c][k] = ctx->finding_histogram[c][k];
+        }
+    }
+    return write_file_atomic(ctx->checkpoint_path, write_checkpoint, &ctx->budget.ckpt);
+}
+
+/*
+ * Reverse block index and incremental checks
+ *
+ * The index records, for every data block, the live inode whose tree
+ * reaches it and where the pointer to it sits, together with a hash of
+ * every inode record and copies of both bitmaps. It is written with
+ * --index=FILE after a run that finds the image consistent. Its header
+ * carries a generation, bumped on every save, and checksums of each
+ * metadata block and of the indirect and directory blocks. VSFS has no
+ * generation of its own, so the checksums decide whether the index still
+ * describes the image: --owner=BLOCK answers from the index when they
+ * match and rebuilds it otherwise, and a change log that leaves out a
+ * block whose checksum moved is rejected.
+ *
+ * With --changes=LOG, only the blocks listed in LOG are assumed to have
+ * been written since then. They are mapped to the inodes that need a
+ * recheck: inodes whose record in a changed inode table block hashes
+ * differently, inodes whose bit in a changed inode bitmap flipped, and the
+ * owners of changed indirect blocks. The checkers then run with
+ * inode_scope limited to those inodes and take the blocks of all other
+ * inodes from the index. The directory tree is only walked again when a
+ * directory, or a field the namespace depends on, was touched.
+ */
+#define INDEX_MAGIC "VSRI"
+#define INDEX_VERSION 2
+
+typedef struct {
+    int changed_blocks;   // Blocks named by the change log
+    int inodes;           // Inodes in the scope
+    bool directory_tree;  // Whether the directory tree had to be walked
+} incremental_stats_t;
+
+// Hash of the inode fields the directory tree check depends on
+static uint64_t inode_record_name_hash(const inode_t *inode) {
+    uint64_t hash = fnv1a(FNV_OFFSET, &inode->mode, sizeof(inode->mode));
+    hash = fnv1a(hash, &inode->links_count, sizeof(inode->links_count));
+    return fnv1a(hash, &inode->dtime, sizeof(inode->dtime));
+}
+
+static uint64_t inode_name_hash(int ino) {
+    return inode_record_name_hash(&ctx->inode_table[ino]);
+}
+
+// Record the blocks below a pointer; the first claimant of a block wins
+static void index_tree(block_index_t *index, uint32_t blk, int height, int level, int slot, int ino) {
+    if (blk < DATA_BLOCK_START_NUM || blk >= TOTAL_BLOCKS || index->owner[blk].inode >= 0) {
+        return;
+    }
+    index->owner[blk] = (block_owner_t){ ino, (uint8_t)level, (uint8_t)height, (uint16_t)slot };
+    if (height == 0) {
+        return;
+    }
+    uint32_t *entries = (uint32_t *)get_block(blk);
+    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    for (int j = 0; j < entries_per_block; j++) {
+        if (entries[j] != 0) {
+            index_tree(index, entries[j], height - 1, level + 1, j, ino);
+        }
+    }
+}
+
+static void index_inode(block_index_t *index, int ino) {
+    for (int p = 0; p < PTR_COUNT; p++) {
+        index_tree(index, ctx->inode_soa.ptr[p][ino], p, 0, p, ino);
+    }
+    index->inode_hash[ino] = fnv1a(FNV_OFFSET, &ctx->inode_table[ino], sizeof(inode_t));
+    index->name_hash[ino] = inode_name_hash(ino);
+}
+
+// Copy both bitmaps into the index
+static void index_bitmaps(block_index_t *index) {
+    memcpy(index->inode_bitmap, ctx->inode_bitmap, sizeof(index->inode_bitmap));
+    memcpy(index->data_bitmap, ctx->data_bitmap, sizeof(index->data_bitmap));
+}
+
+// Build the index of the whole image
+void build_block_index(block_index_t *index) {
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        index->owner[b] = (block_owner_t){ .inode = -1 };
+    }
+    // Inodes in all-zero table blocks are zero and share their hashes
+    static const inode_t zero_inode;
+    uint64_t zero_hash = fnv1a(FNV_OFFSET, &zero_inode, sizeof(inode_t));
+    uint64_t zero_name_hash = inode_record_name_hash(&zero_inode);
+    uint64_t populated[INODE_MASK_WORDS];
+    scan_inode_table(populated);
     for (int i = 0; i < INODE_COUNT; i++) {
-        inode_t *inode = &inode_table[i];
-        
-        
-        if (!is_inode_valid(inode)) {
+        index->inode_hash[i] = zero_hash;
+        index->name_hash[i] = zero_name_hash;
+    }
+    for (int i = next_set_bit(populated, NULL, INODE_COUNT, -1); i >= 0;
+         i = next_set_bit(populated, NULL, INODE_COUNT, i)) {
+        index->inode_hash[i] = fnv1a(FNV_OFFSET, &ctx->inode_table[i], sizeof(inode_t));
+        index->name_hash[i] = inode_name_hash(i);
+    }
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        index_inode(index, i);
+    }
+    index_bitmaps(index);
+}
+
+// Whether the index lists blk as part of an inode's tree structure, i.e.
+// an indirect block or a directory data block
+static bool is_tree_block(const block_index_t *index, int blk) {
+    const block_owner_t *o = &index->owner[blk];
+    return o->inode >= 0 && (o->height > 0 || S_ISDIR(ctx->inode_table[o->inode].mode));
+}
+
+// Checksum the metadata blocks and, unless skip says otherwise, the tree
+// blocks of the current image. Returns false when a skipped tree block
+// made tree_sum meaningless.
+static bool index_sums(const block_index_t *index, const bool *skip, index_header_t *sums) {
+    for (int b = 0; b < DATA_BLOCK_START_NUM; b++) {
+        sums->block_sum[b] = fnv1a(FNV_OFFSET, get_block(b), BLOCK_SIZE);
+    }
+    sums->tree_sum = FNV_OFFSET;
+    for (int b = DATA_BLOCK_START_NUM; b < TOTAL_BLOCKS; b++) {
+        if (is_tree_block(index, b)) {
+            if (skip && skip[b]) {
+                return false;
+            }
+            sums->tree_sum = fnv1a(sums->tree_sum, get_block(b), BLOCK_SIZE);
+        }
+    }
+    return true;
+}
+
+// Whether the image is unchanged since the index was saved
+bool index_is_current(const block_index_t *index) {
+    index_header_t sums;
+    index_sums(index, NULL, &sums);
+    return memcmp(sums.block_sum, index->header.block_sum, sizeof(sums.block_sum)) == 0 &&
+           sums.tree_sum == index->header.tree_sum;
+}
+
+// Whether every metadata or tree block that differs from the index is named
+// in the change log
+bool index_covers_changes(const block_index_t *index, const bool changed[TOTAL_BLOCKS]) {
+    index_header_t sums;
+    bool tree_comparable = index_sums(index, changed, &sums);
+    for (int b = 0; b < DATA_BLOCK_START_NUM; b++) {
+        if (!changed[b] && sums.block_sum[b] != index->header.block_sum[b]) {
+            return false;
+        }
+    }
+    return !tree_comparable || sums.tree_sum == index->header.tree_sum;
+}
+
+// Read an index file. Returns 1 when loaded, 0 when there is none and -1
+// when it is unusable.
+int load_block_index(const char *path, block_index_t *index) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    char magic[4];
+    uint32_t version = 0, size = 0;
+    uint64_t sum = 0;
+    bool ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, INDEX_MAGIC, 4) == 0 &&
+              fread(&version, sizeof(version), 1, f) == 1 && version == INDEX_VERSION &&
+              fread(&size, sizeof(size), 1, f) == 1 && size == sizeof(block_index_t) &&
+              fread(index, sizeof(block_index_t), 1, f) == 1 &&
+              fread(&sum, sizeof(sum), 1, f) == 1;
+    fclose(f);
+    if (!ok || sum != fnv1a(FNV_OFFSET, index, sizeof(block_index_t))) {
+        return -1;
+    }
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        if (index->owner[b].inode >= INODE_COUNT || index->owner[b].height >= PTR_COUNT) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static bool write_block_index(FILE *f, void *arg) {
+    const block_index_t *index = arg;
+    uint32_t version = INDEX_VERSION, size = sizeof(block_index_t);
+    uint64_t sum = fnv1a(FNV_OFFSET, index, sizeof(block_index_t));
+    return fwrite(INDEX_MAGIC, 1, 4, f) == 4 &&
+           fwrite(&version, sizeof(version), 1, f) == 1 &&
+           fwrite(&size, sizeof(size), 1, f) == 1 &&
+           fwrite(index, sizeof(block_index_t), 1, f) == 1 &&
+           fwrite(&sum, sizeof(sum), 1, f) == 1;
+}
+
+// Write an index file, replacing it atomically. The header is filled in
+// from the current image.
+bool save_block_index(const char *path, block_index_t *index) {
+    index->header.generation++;
+    index_sums(index, NULL, &index->header);
+    return write_file_atomic(path, write_block_index, index);
+}
+
+// Read a change log: block numbers separated by whitespace, '#' starts a
+// comment. Returns the number of distinct blocks, or -1 on error.
+int load_change_log(const char *path, bool changed[TOTAL_BLOCKS]) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Error opening change log");
+        return -1;
+    }
+    memset(changed, 0, TOTAL_BLOCKS * sizeof(bool));
+    int count = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#")] = '\0';
+        for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            char *end;
+            unsigned long blk = strtoul(tok, &end, 10);
+            if (*end != '\0' || blk >= TOTAL_BLOCKS) {
+                fprintf(stderr, "Error: Invalid block number '%s' in change log %s\n", tok, path);
+                fclose(f);
+                return -1;
+            }
+            count += !changed[blk];
+            changed[blk] = true;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+// Answer "which inode owns blk" from the index
+void print_block_owner(const block_index_t *index, int blk, bool rebuilt) {
+    static const char *const pointer_names[PTR_COUNT] = {
+        "direct block", "single indirect block", "double indirect block", "triple indirect block"
+    };
+    static const char *const kind_names[PTR_COUNT] = {
+        "data block", "indirect block", "double indirect block", "triple indirect block"
+    };
+    const block_owner_t *o = &index->owner[blk];
+    FILE *out = ctx->out;
+    if (ctx->output_format == OUTPUT_JSON) {
+        fprintf(out, "{\"type\":\"owner\",\"block\":%d,\"inode\":%d", blk, o->inode);
+        if (o->inode >= 0) {
+            fprintf(out, ",\"level\":%u,\"slot\":%u,\"height\":%u", o->level, o->slot, o->height);
+        }
+        fprintf(out, ",\"generation\":%llu,\"rebuilt\":%s}\n",
+                (unsigned long long)index->header.generation, rebuilt ? "true" : "false");
+        return;
+    }
+    
+    if (blk < DATA_BLOCK_START_NUM) {
+        fprintf(out, "Block %d: metadata block\n", blk);
+    } else if (o->inode < 0) {
+        fprintf(out, "Block %d: not reachable from any live inode\n", blk);
+    } else if (o->level == 0) {
+        fprintf(out, "Block %d: %s of inode %d, referenced as its %s\n",
+                blk, kind_names[o->height], o->inode, pointer_names[o->slot]);
+    } else {
+        fprintf(out, "Block %d: %s of inode %d, entry %u of a level %u indirect block\n",
+                blk, kind_names[o->height], o->inode, o->slot, o->level);
+    }
+    if (rebuilt) {
+        fprintf(out, "(index rebuilt from the image)\n");
+    } else {
+        fprintf(out, "(from index generation %llu)\n", (unsigned long long)index->header.generation);
+    }
+}
+
+// Check only what the changed blocks can have affected. When the image is
+// still consistent the index is brought up to date for the next run.
+bool check_incremental(block_index_t *index, const bool changed[TOTAL_BLOCKS],
+                       bool results[CHECK_MAX], incremental_stats_t *stats) {
+    uint64_t scope[INODE_MASK_WORDS] = {0};
+    bool walk_tree = false;
+    memset(stats, 0, sizeof(*stats));
+    
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        if (!changed[b]) {
             continue;
         }
-        
-        
-        if (inode->direct_block != 0) {
-            if (inode->direct_block >= DATA_BLOCK_START_NUM && 
-                inode->direct_block < TOTAL_BLOCKS) {
-                if (block_ref_count[inode->direct_block]) {
-                    
-                    isValid = false;
-                    printf("Error: Block %u is referenced by inode %d and inode %d\n", inode->direct_block, inode_refs[inode->direct_block], i);
-                    if (fix) {
-                        
-                        
-                        printf("Fixing: Zeroing out duplicate reference in inode %d\n", i);
-                        inode->direct_block = 0;
-                    }
-                } else {
-                    block_ref_count[inode->direct_block] = true;
-                    inode_refs[inode->direct_block] = i;
+        stats->changed_blocks++;
+        if (b == INODE_BITMAP_BLOCK_NUM) {
+            for (int i = 0; i < INODE_COUNT; i++) {
+                if (is_bit_set(ctx->inode_bitmap, i) != is_bit_set(index->inode_bitmap, i)) {
+                    scope[i / 64] |= UINT64_C(1) << (i % 64);
                 }
             }
-        }
-        
-        // Helper function for checking blocks in indirect blocks
-        bool is_valid = true;
-        
-        
-        if (inode->single_indirect != 0) {
-            if (inode->single_indirect >= DATA_BLOCK_START_NUM && inode->single_indirect < TOTAL_BLOCKS) {
-                if (block_ref_count[inode->single_indirect]) {
-                    
-                    isValid = false;
-                    printf("Error: Block %u (single indirect) is referenced by inode %d and inode %d\n", inode->single_indirect, inode_refs[inode->single_indirect], i);
-                    if (fix) {
-                        printf("Fixing: Zeroing out duplicate reference in inode %d\n", i);
-                        inode->single_indirect = 0;
-                    }
-                } else {
-                    block_ref_count[inode->single_indirect] = true;
-                    inode_refs[inode->single_indirect] = i;
-                    
-                    uint32_t *indirect_block = (uint32_t *)get_block(inode->single_indirect);
-                    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
-                    for (int j = 0; j < entries_per_block; j++) {
-                        uint32_t data_block_num = indirect_block[j];
-                        if (data_block_num != 0) {
-                            if (!check_data_block_for_duplicates(data_block_num, i, fix, inode_refs)) {
-                                isValid = false;
-                                if (fix) {
-                                    
-                                    indirect_block[j] = 0;
-                                }
-                            }
-                        }
-                    }
+        } else if (b >= INODE_TABLE_START_BLOCK_NUM && b < INODE_TABLE_START_BLOCK_NUM + INODE_TABLE_BLOCKS) {
+            int first, last;
+            inode_table_block_range(b, &first, &last);
+            for (int i = first; i <= last; i++) {
+                if (fnv1a(FNV_OFFSET, &ctx->inode_table[i], sizeof(inode_t)) != index->inode_hash[i]) {
+                    scope[i / 64] |= UINT64_C(1) << (i % 64);
+                    walk_tree = walk_tree || inode_name_hash(i) != index->name_hash[i] || inode_is_dir(i);
                 }
             }
+        } else if (b >= DATA_BLOCK_START_NUM && index->owner[b].inode >= 0) {
+            // A rewritten indirect block changes its owner's tree; a
+            // rewritten directory block changes the namespace
+            int owner = index->owner[b].inode;
+            if (index->owner[b].height > 0) {
+                scope[owner / 64] |= UINT64_C(1) << (owner % 64);
+            }
+            walk_tree = walk_tree || inode_is_dir(owner);
         }
-        
-        // Check double indirect block pointer
-        if (inode->double_indirect != 0) {
-            if (inode->double_indirect >= DATA_BLOCK_START_NUM && inode->double_indirect < TOTAL_BLOCKS) {
-                if (block_ref_count[inode->double_indirect]) {
-                    isValid = false;
-                    printf("Error: Block %u (double indirect) is referenced by inode %d and inode %d\n", inode->double_indirect, inode_refs[inode->double_indirect], i);
-                    if (fix) {
-                        printf("Fixing: Zeroing out duplicate reference in inode %d\n", i);
-                        inode->double_indirect = 0;
-                    }
-                } else {
-                    block_ref_count[inode->double_indirect] = true;
-                    inode_refs[inode->double_indirect] = i;
-                   
-                    uint32_t *double_indirect_block = (uint32_t *)get_block(inode->double_indirect);
-                    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
-                    for (int j = 0; j < entries_per_block; j++) {
-                        uint32_t indirect_block_num = double_indirect_block[j];
-                        if (indirect_block_num != 0) {
-                            if (!check_data_block_for_duplicates(indirect_block_num, i, fix, inode_refs)) {
-                                isValid = false;
-                                if (fix) {
-                                    double_indirect_block[j] = 0;
-                                }
-                            }
-                            uint32_t *indirect_block = (uint32_t *)get_block(indirect_block_num);
-                            if (indirect_block) {
-                                int entries_per_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
-                                for (int k = 0; k < entries_per_indirect_block; k++) {
-                                    uint32_t data_block_num = indirect_block[k];
-                                    if (data_block_num != 0)
-                                        if (!check_data_block_for_duplicates(data_block_num, i, fix, inode_refs)) {
-                                            isValid = false;
-                                            if (fix) {
-                                                indirect_block[k] = 0;
-                                            }
-                                        }
-                                }
-                            }
-                        }
-                    }
+    }
+    for (int w = 0; w < INODE_MASK_WORDS; w++) {
+        stats->inodes += __builtin_popcountll(scope[w]);
+    }
+    stats->directory_tree = walk_tree;
+    
+    ctx->inode_scope = scope;
+    ctx->index = index;
+    bool all_ok = true;
+    for (int c = 0; c < CHECK_MAX; c++) {
+        if (c == CHECK_DIRECTORY_TREE) {
+            ctx->inode_scope = NULL;
+            if (!walk_tree) {
+                results[c] = true;
+                continue;
+            }
+        }
+        results[c] = vsfsck_check(ctx, c, false);
+        all_ok = all_ok && results[c];
+    }
+    ctx->inode_scope = NULL;
+    ctx->index = NULL;
+    
+    if (all_ok) {
+        for (int b = 0; b < TOTAL_BLOCKS; b++) {
+            int owner = index->owner[b].inode;
+            if (owner >= 0 && ((scope[owner / 64] >> (owner % 64)) & 1)) {
+                index->owner[b] = (block_owner_t){ .inode = -1 };
+            }
+        }
+        for (int i = next_set_bit(scope, NULL, INODE_COUNT, -1); i >= 0;
+             i = next_set_bit(scope, NULL, INODE_COUNT, i)) {
+            if (inode_is_live(i)) {
+                index_inode(index, i);
+            } else {
+                index->inode_hash[i] = fnv1a(FNV_OFFSET, &ctx->inode_table[i], sizeof(inode_t));
+                index->name_hash[i] = inode_name_hash(i);
+            }
+        }
+        // Records that changed without affecting anything still need their
+        // new hashes
+        for (int b = INODE_TABLE_START_BLOCK_NUM; b < INODE_TABLE_START_BLOCK_NUM + INODE_TABLE_BLOCKS; b++) {
+            if (changed[b]) {
+                int first, last;
+                inode_table_block_range(b, &first, &last);
+                for (int i = first; i <= last; i++) {
+                    index->inode_hash[i] = fnv1a(FNV_OFFSET, &ctx->inode_table[i], sizeof(inode_t));
+                    index->name_hash[i] = inode_name_hash(i);
                 }
             }
         }
-        
-        // Check triple indirect block pointer
-        if (inode->triple_indirect != 0) {
-            if (inode->triple_indirect >= DATA_BLOCK_START_NUM && inode->triple_indirect < TOTAL_BLOCKS) {
-                if (block_ref_count[inode->triple_indirect]) {
+        index_bitmaps(index);
+    }
+    return all_ok;
+}
+
+/*
+ * Consistency Checker Components
+ */
+
+// 1. Superblock Validator //22101328
+bool validate_superblock(bool fix) {
+    bool isValid = true;
+    report_info("\n=== Superblock Validation ===\n");
+    
+    // Check magic number
+    if (ctx->superblock->magic != MAGIC_BYTES) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 0;
+        f.aux = ctx->superblock->magic;
+        report_finding(&f, "Invalid magic number (0x%04X). Expected 0x%04X", 
+               ctx->superblock->magic, MAGIC_BYTES);
+        if (fix) {
+            report_followup("Fixing: Setting correct magic number\n");
+            ctx->superblock->magic = MAGIC_BYTES;
+        }
+        isValid = false;
+    } else {
+        report_info("Magic number is valid (0x%04X)\n", ctx->superblock->magic);
+    }
+    
+    // Check block size
+    if (ctx->superblock->block_size != BLOCK_SIZE) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 1;
+        f.aux = ctx->superblock->block_size;
+        report_finding(&f, "Invalid block size (%u). Expected %u", 
+               ctx->superblock->block_size, BLOCK_SIZE);
+        if (fix) {
+            report_followup("Fixing: Setting correct block size\n");
+            ctx->superblock->block_size = BLOCK_SIZE;
+        }
+        isValid = false;
+    } else {
+        report_info("Block size is valid (%u)\n", ctx->superblock->block_size);
+    }
+    
+    // Check total number of blocks
+    if (ctx->superblock->total_blocks != TOTAL_BLOCKS) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 2;
+        f.aux = ctx->superblock->total_blocks;
+        report_finding(&f, "Invalid total blocks (%u). Expected %u", 
+               ctx->superblock->total_blocks, TOTAL_BLOCKS);
+        if (fix) {
+            report_followup("Fixing: Setting correct total blocks\n");
+            ctx->superblock->total_blocks = TOTAL_BLOCKS;
+        }
+        isValid = false;
+    } else {
+        report_info("Total blocks is valid (%u)\n", ctx->superblock->total_blocks);
+    }
+    
+    // Check inode bitmap block
+    if (ctx->superblock->inode_bitmap_block != INODE_BITMAP_BLOCK_NUM) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 3;
+        f.aux = ctx->superblock->inode_bitmap_block;
+        report_finding(&f, "Invalid inode bitmap block (%u). Expected %u", 
+               ctx->superblock->inode_bitmap_block, INODE_BITMAP_BLOCK_NUM);
+        if (fix) {
+            report_followup("Fixing: Setting correct inode bitmap block\n");
+            ctx->superblock->inode_bitmap_block = INODE_BITMAP_BLOCK_NUM;
+        }
+        isValid = false;
+    } else {
+        report_info("Inode bitmap block is valid (%u)\n", ctx->superblock->inode_bitmap_block);
+    }
+    
+    // Check data bitmap block
+    if (ctx->superblock->data_bitmap_block != DATA_BITMAP_BLOCK_NUM) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 4;
+        f.aux = ctx->superblock->data_bitmap_block;
+        report_finding(&f, "Invalid data bitmap block (%u). Expected %u", 
+               ctx->superblock->data_bitmap_block, DATA_BITMAP_BLOCK_NUM);
+        if (fix) {
+            report_followup("Fixing: Setting correct data bitmap block\n");
+            ctx->superblock->data_bitmap_block = DATA_BITMAP_BLOCK_NUM;
+        }
+        isValid = false;
+    } else {
+        report_info("Data bitmap block is valid (%u)\n", ctx->superblock->data_bitmap_block);
+    }
+    
+    // Check inode table start block
+    if (ctx->superblock->inode_table_start != INODE_TABLE_START_BLOCK_NUM) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 5;
+        f.aux = ctx->superblock->inode_table_start;
+        report_finding(&f, "Invalid inode table start block (%u). Expected %u", 
+               ctx->superblock->inode_table_start, INODE_TABLE_START_BLOCK_NUM);
+        if (fix) {
+            report_followup("Fixing: Setting correct inode table start block\n");
+            ctx->superblock->inode_table_start = INODE_TABLE_START_BLOCK_NUM;
+        }
+        isValid = false;
+    } else {
+        report_info("Inode table start block is valid (%u)\n", ctx->superblock->inode_table_start);
+    }
+    
+    // Check first data block
+    if (ctx->superblock->first_data_block != DATA_BLOCK_START_NUM) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 6;
+        f.aux = ctx->superblock->first_data_block;
+        report_finding(&f, "Invalid first data block (%u). Expected %u", 
+               ctx->superblock->first_data_block, DATA_BLOCK_START_NUM);
+        if (fix) {
+            report_followup("Fixing: Setting correct first data block\n");
+            ctx->superblock->first_data_block = DATA_BLOCK_START_NUM;
+        }
+        isValid = false;
+    } else {
+        report_info("First data block is valid (%u)\n", ctx->superblock->first_data_block);
+    }
+    
+    // Check inode size
+    if (ctx->superblock->inode_size != INODE_SIZE) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 7;
+        f.aux = ctx->superblock->inode_size;
+        report_finding(&f, "Invalid inode size (%u). Expected %u", 
+               ctx->superblock->inode_size, INODE_SIZE);
+        if (fix) {
+            report_followup("Fixing: Setting correct inode size\n");
+            ctx->superblock->inode_size = INODE_SIZE;
+        }
+        isValid = false;
+    } else {
+        report_info("Inode size is valid (%u)\n", ctx->superblock->inode_size);
+    }
+    
+    // Check inode count
+    if (ctx->superblock->inode_count != INODE_COUNT) {
+        finding_t f = new_finding(CHECK_SUPERBLOCK, FINDING_SB_FIELD, -1, SUPERBLOCK_NUM, fix);
+        f.slot = 8;
+        f.aux = ctx->superblock->inode_count;
+        report_finding(&f, "Invalid inode count (%u). Expected %u", 
+               ctx->superblock->inode_count, INODE_COUNT);
+        if (fix) {
+            report_followup("Fixing: Setting correct inode count\n");
+            ctx->superblock->inode_count = INODE_COUNT;
+        }
+        isValid = false;
+    } else {
+        report_info("Inode count is valid (%u)\n", ctx->superblock->inode_count);
+    }
+    
+    return isValid;
+}
+
+// 2. Data Bitmap Consistency Checker //22101328
+
+// Mark a block and, for indirect blocks, every block below it as used
+static void mark_tree_used(uint32_t blk, int depth, bool *block_used) {
+    if (blk < DATA_BLOCK_START_NUM || blk >= TOTAL_BLOCKS) {
+        return;
+    }
+    block_used[blk - DATA_BLOCK_START_NUM] = true;
+    if (depth == 0) {
+        return;
+    }
+    uint32_t *entries = (uint32_t *)get_block(blk);
+    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    for (int j = 0; j < entries_per_block; j++) {
+        if (entries[j] != 0) {
+            mark_tree_used(entries[j], depth - 1, block_used);
+        }
+    }
+}
+bool validate_data_bitmap(bool fix) {
+    report_info("\n=== Data Bitmap Validation ===\n");
+    
+    bool isValid = true;
+    bool *block_used = calloc(DATA_BLOCKS_COUNT, sizeof(bool));
+    
+    if (!block_used) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    
+    // First pass: Check all inodes and mark which data blocks they reference,
+    // including the indirect blocks and everything reachable below them
+    report_info("Checking blocks referenced by inodes...\n");
+    int start = resume_inode(CHECK_DATA_BITMAP);
+    for (int i = 0; start > 0 && i < DATA_BLOCKS_COUNT; i++) {
+        block_used[i] = (ctx->budget.ckpt.reachable[i / 8] >> (i % 8)) & 1;
+    }
+    // Blocks of inodes outside the scope are taken from the index
+    for (int i = 0; ctx->inode_scope && i < DATA_BLOCKS_COUNT; i++) {
+        int owner = ctx->index->owner[i + DATA_BLOCK_START_NUM].inode;
+        block_used[i] = owner >= 0 && !inode_in_scope(owner);
+    }
+    for (int i = next_live_inode(start - 1); i >= 0; i = next_live_inode(i)) {
+        if (budget_stop(CHECK_DATA_BITMAP, i)) {
+            break;
+        }
+        // Check the direct and indirect block pointers
+        for (int p = 0; p < PTR_COUNT; p++) {
+            mark_tree_used(ctx->inode_soa.ptr[p][i], p, block_used);
+        }
+    }
+    
+    if (ctx->budget.stopped) {
+        memset(ctx->budget.ckpt.reachable, 0, sizeof(ctx->budget.ckpt.reachable));
+        for (int i = 0; i < DATA_BLOCKS_COUNT; i++) {
+            ctx->budget.ckpt.reachable[i / 8] |= (uint8_t)(block_used[i] << (i % 8));
+        }
+        free(block_used);
+        return isValid;
+    }
+    
+    // Second pass: Check if data bitmap matches actual block usage
+    report_info("Validating data bitmap against block references...\n");
+    for (int i = 0; i < DATA_BLOCKS_COUNT; i++) {
+        bool bitmap_used = is_bit_set(ctx->data_bitmap, i);
+        
+        // Case 1: Block is referenced by an inode but not marked as used in bitmap
+        if (block_used[i] && !bitmap_used) {
+            finding_t f = new_finding(CHECK_DATA_BITMAP, FINDING_BLOCK_NOT_MARKED, -1,
+                                      i + DATA_BLOCK_START_NUM, fix);
+            report_finding(&f, "Block %d is referenced by inode(s) but not marked used in data bitmap", 
+                   i + DATA_BLOCK_START_NUM);
+            if (fix) {
+                report_followup("Fixing: Marking block %d as used in data bitmap\n", 
+                       i + DATA_BLOCK_START_NUM);
+                set_bit(ctx->data_bitmap, i);
+            }
+            isValid = false;
+        }
+        
+        // Case 2: Block is marked as used in bitmap but not referenced by any inode
+        if (!block_used[i] && bitmap_used) {
+            finding_t f = new_finding(CHECK_DATA_BITMAP, FINDING_BLOCK_NOT_REFERENCED, -1,
+                                      i + DATA_BLOCK_START_NUM, fix);
+            report_finding(&f, "Block %d is marked used in data bitmap but not referenced by any inode", 
+                   i + DATA_BLOCK_START_NUM);
+            if (fix) {
+                report_followup("Fixing: Clearing block %d in data bitmap\n", 
+                       i + DATA_BLOCK_START_NUM);
+                clear_bit(ctx->data_bitmap, i);
+            }
+            isValid = false;
+        }
+    }
+    
+    free(block_used);
+    if (fix) {
+        invalidate_free_extents();
+    }
+    return isValid;
+}
+
+// 3. Inode Bitmap Consistency Checker //22101305
+bool validate_inode_bitmap(bool fix) {
+    report_info("\n=== Inode Bitmap Validation ===\n");
+    
+    bool isValid = true;
+    
+    // XOR the live mask against the bitmap a word at a time; only the
+    // inodes where the two disagree are visited
+    for (int w = 0; w < INODE_MASK_WORDS; w++) {
+        uint64_t live = ctx->inode_soa.live_mask[w];
+        uint64_t diff = (live ^ load_bitmap_word(ctx->inode_bitmap, w)) & scope_word(w);
+        if (w == INODE_MASK_WORDS - 1) {
+            diff &= INODE_MASK_TAIL;
+        }
+        
+        for (; diff != 0; diff &= diff - 1) {
+            int bit = __builtin_ctzll(diff);
+            int i = w * 64 + bit;
+            
+            if ((live >> bit) & 1) {
+                // Case 1: Valid inode but not marked in bitmap
+                finding_t f = new_finding(CHECK_INODE_BITMAP, FINDING_INODE_NOT_MARKED, i, INODE_BITMAP_BLOCK_NUM, fix);
+                report_finding(&f, "Inode %d is valid but not marked used in inode bitmap", i);
+                if (fix) {
+                    report_followup("Fixing: Marking inode %d as used in inode bitmap\n", i);
+                    set_bit(ctx->inode_bitmap, i);
+                }
+            } else {
+                // Case 2: Invalid inode but marked in bitmap
+                finding_t f = new_finding(CHECK_INODE_BITMAP, FINDING_INODE_NOT_VALID, i, INODE_BITMAP_BLOCK_NUM, fix);
+                report_finding(&f, "Inode %d is invalid but marked used in inode bitmap", i);
+                if (fix) {
+                    report_followup("Fixing: Clearing inode %d in inode bitmap\n", i);
+                    clear_bit(ctx->inode_bitmap, i);
+                }
+            }
+            isValid = false;
+        }
+    }
+    
+    return isValid;
+}
+
+// 4. Duplicate Block Checker //22101305
+
+/*
+ * With --clone-dups, a data block claimed by a second inode is not dropped
+ * from that inode: the claim is queued, and after the scan all queued
+ * blocks are copied into freshly allocated blocks and the later claimants
+ * repointed. Jobs are sorted by source block and the destinations are
+ * allocated as one batch, so the copies run as sequential reads and writes.
+ * Duplicated indirect blocks are still zeroed, since copying them would
+ * only duplicate everything below them.
+ */
+
+
+static void queue_clone(uint32_t src, int ino, int ptr_index, uint32_t *entry) {
+    if (ctx->clone_queue.len == ctx->clone_queue.cap) {
+        int cap = ctx->clone_queue.cap ? ctx->clone_queue.cap * 2 : 64;
+        clone_job_t *p = realloc(ctx->clone_queue.jobs, (size_t)cap * sizeof(clone_job_t));
+        if (!p) {
+            // Fall back to dropping the reference
+            if (entry) {
+                *entry = 0;
+            } else {
+                set_inode_pointer(ino, ptr_index, 0);
+            }
+            return;
+        }
+        ctx->clone_queue.jobs = p;
+        ctx->clone_queue.cap = cap;
+    }
+    ctx->clone_queue.jobs[ctx->clone_queue.len++] = (clone_job_t){ src, ino, ptr_index, entry };
+}
+
+static int compare_clone_jobs(const void *a, const void *b) {
+    const clone_job_t *x = a, *y = b;
+    if (x->src != y->src) return x->src < y->src ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+// Copy every queued block into a new block and repoint its claimant
+static void apply_clone_jobs(void) {
+    if (ctx->clone_queue.len == 0) {
+        return;
+    }
+    qsort(ctx->clone_queue.jobs, ctx->clone_queue.len, sizeof(clone_job_t), compare_clone_jobs);
+    
+    uint32_t *dst = malloc((size_t)ctx->clone_queue.len * sizeof(uint32_t));
+    int got = dst ? alloc_data_blocks(ctx->clone_queue.len, dst) : 0;
+    for (int j = 0; j < ctx->clone_queue.len; j++) {
+        clone_job_t *job = &ctx->clone_queue.jobs[j];
+        uint32_t target = 0;
+        if (j < got) {
+            memcpy(get_block(dst[j]), get_block(job->src), BLOCK_SIZE);
+            target = dst[j];
+        } else {
+            report_info("Note: No free block to clone block %u for inode %d; reference zeroed\n",
+                        job->src, job->ino);
+        }
+        if (job->entry) {
+            *job->entry = target;
+        } else {
+            set_inode_pointer(job->ino, job->ptr_index, target);
+        }
+    }
+    if (got > 0) {
+        report_info("Cloned %d duplicated block(s) into newly allocated blocks\n", got);
+    }
+    
+    free(dst);
+    free(ctx->clone_queue.jobs);
+    memset(&ctx->clone_queue, 0, sizeof(ctx->clone_queue));
+}
+
+// Check one pointer held in an indirect block; on a duplicate with do_fix
+// the entry is zeroed, or queued for cloning when it names a data block
+bool check_data_block_for_duplicates(uint32_t blk, int ino, bool do_fix, int *inode_refs,
+                                     int level, int slot, uint32_t *entry, bool is_data) {
+    bool valid = true;
+    if (blk >= DATA_BLOCK_START_NUM && blk < TOTAL_BLOCKS) {
+        if (ctx->block_ref_count[blk]) {
+            valid = false;
+            finding_t f = new_finding(CHECK_DUPLICATE_BLOCKS, FINDING_DUPLICATE_BLOCK, ino, blk, do_fix);
+            f.level = level;
+            f.slot = slot;
+            f.aux = inode_refs[blk];
+            report_finding(&f, "Block %u is referenced by inode %d and inode %d", blk, inode_refs[blk], ino);
+            
+            
+            
+            if (do_fix) {
+                if (is_data && ctx->clone_duplicates) {
+                    report_followup("Fixing: Cloning block %u for inode %d\n", blk, ino);
+                    queue_clone(blk, ino, -1, entry);
+                } else {
+                    report_followup("Note: Duplicate in indirect block - requires file system recovery tools\n");
+                    *entry = 0;
+                }
+            }
+        } else {
+            ctx->block_ref_count[blk] = true;
+            inode_refs[blk] = ino;
+        }
+    }
+    return valid;
+}
+bool check_duplicate_blocks(bool fix) {
+    report_info("\n=== Duplicate Block Check ===\n");
+    
+    bool isValid = true;
+    
+    
+    memset(ctx->block_ref_count, 0, TOTAL_BLOCKS * sizeof(bool));
+    
+    
+    int *inode_refs = calloc(TOTAL_BLOCKS, sizeof(int));
+    if (!inode_refs) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    
+    int start = resume_inode(CHECK_DUPLICATE_BLOCKS);
+    for (int b = 0; start > 0 && b < TOTAL_BLOCKS; b++) {
+        ctx->block_ref_count[b] = ctx->budget.ckpt.owner[b] >= 0;
+        inode_refs[b] = ctx->block_ref_count[b] ? ctx->budget.ckpt.owner[b] : 0;
+    }
+    for (int b = 0; ctx->inode_scope && b < TOTAL_BLOCKS; b++) {
+        int owner = ctx->index->owner[b].inode;
+        ctx->block_ref_count[b] = owner >= 0 && !inode_in_scope(owner);
+        inode_refs[b] = ctx->block_ref_count[b] ? owner : 0;
+    }
+    
+    for (int i = next_live_inode(start - 1); i >= 0; i = next_live_inode(i)) {
+        if (budget_stop(CHECK_DUPLICATE_BLOCKS, i)) {
+            for (int b = 0; b < TOTAL_BLOCKS; b++) {
+                ctx->budget.ckpt.owner[b] = ctx->block_ref_count[b] ? inode_refs[b] : -1;
+            }
+            break;
+        }
+        uint32_t direct_block = ctx->inode_soa.ptr[PTR_DIRECT][i];
+        uint32_t single_indirect = ctx->inode_soa.ptr[PTR_SINGLE][i];
+        uint32_t double_indirect = ctx->inode_soa.ptr[PTR_DOUBLE][i];
+        uint32_t triple_indirect = ctx->inode_soa.ptr[PTR_TRIPLE][i];
+        
+        
+        if (direct_block != 0) {
+            if (direct_block >= DATA_BLOCK_START_NUM && 
+                direct_block < TOTAL_BLOCKS) {
+                if (ctx->block_ref_count[direct_block]) {
+                    
                     isValid = false;
-                    printf("Error: Block %u (triple indirect) is referenced by inode %d and inode %d\n", inode->triple_indirect, inode_refs[inode->triple_indirect], i);
+                    finding_t f = new_finding(CHECK_DUPLICATE_BLOCKS, FINDING_DUPLICATE_BLOCK, i, direct_block, fix);
+                    f.slot = 0;
+                    f.aux = inode_refs[direct_block];
+                    report_finding(&f, "Block %u is referenced by inode %d and inode %d", direct_block, inode_refs[direct_block], i);
+                    if (fix && ctx->clone_duplicates) {
+                        report_followup("Fixing: Cloning block %u for inode %d\n", direct_block, i);
+                        queue_clone(direct_block, i, PTR_DIRECT, NULL);
+                    } else if (fix) {
+                        
+                        
+                        report_followup("Fixing: Zeroing out duplicate reference in inode %d\n", i);
+                        set_inode_pointer(i, PTR_DIRECT, 0);
+                    }
+                } else {
+                    ctx->block_ref_count[direct_block] = true;
+                    inode_refs[direct_block] = i;
+                }
+            }
+        }
+        
+        
+        if (single_indirect != 0) {
+            if (single_indirect >= DATA_BLOCK_START_NUM && single_indirect < TOTAL_BLOCKS) {
+                if (ctx->block_ref_count[single_indirect]) {
+                    
+                    isValid = false;
+                    finding_t f = new_finding(CHECK_DUPLICATE_BLOCKS, FINDING_DUPLICATE_BLOCK, i, single_indirect, fix);
+                    f.slot = 1;
+                    f.aux = inode_refs[single_indirect];
+                    report_finding(&f, "Block %u (single indirect) is referenced by inode %d and inode %d", single_indirect, inode_refs[single_indirect], i);
                     if (fix) {
-                        printf("Fixing: Zeroing out duplicate reference in inode %d\n", i);
-                        inode->triple_indirect = 0;
+                        report_followup("Fixing: Zeroing out duplicate reference in inode %d\n", i);
+                        set_inode_pointer(i, PTR_SINGLE, 0);
                     }
                 } else {
-                    block_ref_count[inode->triple_indirect] = true;
-                    inode_refs[inode->triple_indirect] = i;
-                    uint32_t *triple_indirect_block = (uint32_t *)get_block(inode->triple_indirect);
+                    ctx->block_ref_count[single_indirect] = true;
+                    inode_refs[single_indirect] = i;
+                    
+                    uint32_t *indirect_block = (uint32_t *)get_block(single_indirect);
                     int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
                     for (int j = 0; j < entries_per_block; j++) {
-                        uint32_t double_indirect_block_num = triple_indirect_block[j];
-                        if (double_indirect_block_num != 0) {
-                            if (!check_data_block_for_duplicates(double_indirect_block_num, i, fix, inode_refs)) {
+                        uint32_t data_block_num = indirect_block[j];
+                        if (data_block_num != 0) {
+                            if (!check_data_block_for_duplicates(data_block_num, i, fix, inode_refs, 1, j, &indirect_block[j], true)) {
                                 isValid = false;
-                                if (fix) {
-                                    triple_indirect_block[j] = 0;
-                                }
-                            }
-                            uint32_t *double_indirect_block = (uint32_t *)get_block(double_indirect_block_num);
-                            if (double_indirect_block) {
-                                int entries_per_double_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
-                                for (int k = 0; k < entries_per_double_indirect_block; k++) {
-                                    uint32_t single_indirect_block_num = double_indirect_block[k];
-                                    if (single_indirect_block_num != 0) {
-                                        if (!check_data_block_for_duplicates(single_indirect_block_num, i, fix,inode_refs)) {
-                                            isValid = false;
-                                            if (fix) {
-                                                double_indirect_block[k] = 0;
-                                            }
-                                        }
-                                        uint32_t *single_indirect_block = (uint32_t *)get_block(single_indirect_block_num);
-                                        if (single_indirect_block) {
-                                            int entries_per_single_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
-                                            for (int m = 0; m < entries_per_single_indirect_block; m++) {
-                                                uint32_t data_block_num = single_indirect_block[m];
-                                                if (data_block_num != 0)
-                                                    if (!check_data_block_for_duplicates(data_block_num, i, fix, inode_refs)) {
-                                                        isValid = false;
-                                                        if (fix) {
-                                                            single_indirect_block[m] = 0;
-                                                        }
-                                                    }
-                                            }
-                                        }
-                                    }
-                                }
                             }
                         }
                     }
                 }
             }
         }
+        
+        // Check double indirect block pointer
+        if (double_indirect != 0) {
+            if (double_indirect >= DATA_BLOCK_START_NUM && double_indirect < TOTAL_BLOCKS) {
+                if (ctx->block_ref_count[double_indirect]) {
+                    isValid = false;
+                    finding_t f = new_finding(CHECK_DUPLICATE_BLOCKS, FINDING_DUPLICATE_BLOCK, i, double_indirect, fix);
+                    f.slot = 2;
+                    f.aux = inode_refs[double_indirect];
+                    report_finding(&f, "Block %u (double indirect) is referenced by inode %d and inode %d", double_indirect, inode_refs[double_indirect], i);
+                    if (fix) {
+                        report_followup("Fixing: Zeroing out duplicate reference in inode %d\n", i);
+                        set_inode_pointer(i, PTR_DOUBLE, 0);
+                    }
+                } else {
+                    ctx->block_ref_count[double_indirect] = true;
+                    inode_refs[double_indirect] = i;
+                   
+                    uint32_t *double_indirect_block = (uint32_t *)get_block(double_indirect);
+                    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+                    for (int j = 0; j < entries_per_block; j++) {
+                        uint32_t indirect_block_num = double_indirect_block[j];
+                        if (indirect_block_num != 0) {
+                            if (!check_data_block_for_duplicates(indirect_block_num, i, fix, inode_refs, 1, j, &double_indirect_block[j], false)) {
+                                isValid = false;
+                            }
+                            uint32_t *indirect_block = (uint32_t *)get_block(indirect_block_num);
+                            if (indirect_block) {
+                                int entries_per_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
+                                for (int k = 0; k < entries_per_indirect_block; k++) {
+                                    uint32_t data_block_num = indirect_block[k];
+                                    if (data_block_num != 0)
+                                        if (!check_data_block_for_duplicates(data_block_num, i, fix, inode_refs, 2, k, &indirect_block[k], true)) {
+                                            isValid = false;
+                                        }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        
+        // Check triple indirect block pointer
+        if (triple_indirect != 0) {
+            if (triple_indirect >= DATA_BLOCK_START_NUM && triple_indirect < TOTAL_BLOCKS) {
+                if (ctx->block_ref_count[triple_indirect]) {
+                    isValid = false;
+                    finding_t f = new_finding(CHECK_DUPLICATE_BLOCKS, FINDING_DUPLICATE_BLOCK, i, triple_indirect, fix);
+                    f.slot = 3;
+                    f.aux = inode_refs[triple_indirect];
+                    report_finding(&f, "Block %u (triple indirect) is referenced by inode %d and inode %d", triple_indirect, inode_refs[triple_indirect], i);
+                    if (fix) {
+                        report_followup("Fixing: Zeroing out duplicate reference in inode %d\n", i);
+                        set_inode_pointer(i, PTR_TRIPLE, 0);
+                    }
+                } else {
+                    ctx->block_ref_count[triple_indirect] = true;
+                    inode_refs[triple_indirect] = i;
+                    uint32_t *triple_indirect_block = (uint32_t *)get_block(triple_indirect);
+                    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+                    for (int j = 0; j < entries_per_block; j++) {
+                        uint32_t double_indirect_block_num = triple_indirect_block[j];
+                        if (double_indirect_block_num != 0) {
+                            if (!check_data_block_for_duplicates(double_indirect_block_num, i, fix, inode_refs, 1, j, &triple_indirect_block[j], false)) {
+                                isValid = false;
+                            }
+                            uint32_t *double_indirect_block = (uint32_t *)get_block(double_indirect_block_num);
+                            if (double_indirect_block) {
+                                int entries_per_double_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
+                                for (int k = 0; k < entries_per_double_indirect_block; k++) {
+                                    uint32_t single_indirect_block_num = double_indirect_block[k];
+                                    if (single_indirect_block_num != 0) {
+                                        if (!check_data_block_for_duplicates(single_indirect_block_num, i, fix, inode_refs, 2, k, &double_indirect_block[k], false)) {
+                                            isValid = false;
+                                        }
+                                        uint32_t *single_indirect_block = (uint32_t *)get_block(single_indirect_block_num);
+                                        if (single_indirect_block) {
+                                            int entries_per_single_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
+                                            for (int m = 0; m < entries_per_single_indirect_block; m++) {
+                                                uint32_t data_block_num = single_indirect_block[m];
+                                                if (data_block_num != 0)
+                                                    if (!check_data_block_for_duplicates(data_block_num, i, fix, inode_refs, 3, m, &single_indirect_block[m], true)) {
+                                                        isValid = false;
+                                                    }
+                                            }
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    if (fix) {
+        apply_clone_jobs();
+    }
+    
+    free(inode_refs);
+    return isValid;
+}
+
+
+// 5. Bad Block Checker //22101328
+bool check_bad_blocks(bool fix) {
+    report_info("\n=== Bad Block Check ===\n");
+    
+    bool isValid = true;
+    
+    for (int i = next_live_inode(resume_inode(CHECK_BAD_BLOCKS) - 1); i >= 0; i = next_live_inode(i)) {
+        if (budget_stop(CHECK_BAD_BLOCKS, i)) {
+            break;
+        }
+        uint32_t direct_block = ctx->inode_soa.ptr[PTR_DIRECT][i];
+        uint32_t single_indirect = ctx->inode_soa.ptr[PTR_SINGLE][i];
+        uint32_t double_indirect = ctx->inode_soa.ptr[PTR_DOUBLE][i];
+        uint32_t triple_indirect = ctx->inode_soa.ptr[PTR_TRIPLE][i];
+        
+        // Check direct block
+        if (direct_block >= TOTAL_BLOCKS) {
+            finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, direct_block, fix);
+            f.slot = 0;
+            report_finding(&f, "Inode %d has bad direct block: %u", i, direct_block);
+            if (fix) {
+                report_followup("Fixing: Setting direct block of inode %d to 0\n", i);
+                set_inode_pointer(i, PTR_DIRECT, 0);
+            }
+            isValid = false;
+        }
+        
+        // Check single indirect block
+        if (single_indirect >= TOTAL_BLOCKS) {
+            finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, single_indirect, fix);
+            f.slot = 1;
+            report_finding(&f, "Inode %d has bad single indirect block: %u", i, single_indirect);
+            if (fix) {
+                report_followup("Fixing: Setting single indirect block of inode %d to 0\n", i);
+                set_inode_pointer(i, PTR_SINGLE, 0);
+            }
+            isValid = false;
+        } else if (single_indirect != 0) {
+            uint32_t *indirect_block = get_block(single_indirect);
+            if (indirect_block) {
+                int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+                for (int j = 0; j < entries_per_block; j++) {
+                    uint32_t data_block_num = indirect_block[j];
+                    if (data_block_num >= TOTAL_BLOCKS) {
+                        finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, data_block_num, fix);
+                        f.level = 1;
+                        f.slot = j;
+                        report_finding(&f, "Inode %d has bad data block %u in single indirect block", i, data_block_num);
+                        if (fix) {
+                            report_followup("Fixing: Setting invalid data block entry %d in single indirect block of inode %d to 0\n", j, i);
+                            indirect_block[j] = 0;
+                        }
+                        isValid = false;
+                    }
+                }
+            }
+        }
+        
+        // Check double indirect block
+        if (double_indirect >= TOTAL_BLOCKS) {
+            finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, double_indirect, fix);
+            f.slot = 2;
+            report_finding(&f, "Inode %d has bad double indirect block: %u", i, double_indirect);
+            if (fix) {
+                report_followup("Fixing: Setting double indirect block of inode %d to 0\n", i);
+                set_inode_pointer(i, PTR_DOUBLE, 0);
+            }
+            isValid = false;
+        } else if (double_indirect != 0) {
+            uint32_t *double_indirect_block = get_block(double_indirect);
+            if (double_indirect_block) {
+                int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+                for (int j = 0; j < entries_per_block; j++) {
+                    uint32_t indirect_block_num = double_indirect_block[j];
+                    if (indirect_block_num >= TOTAL_BLOCKS) {
+                        finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, indirect_block_num, fix);
+                        f.level = 1;
+                        f.slot = j;
+                        report_finding(&f, "Inode %d has bad indirect block %u in double indirect block", i, indirect_block_num);
+                        if (fix) {
+                            report_followup("Fixing: Setting invalid indirect block entry %d in double indirect block of inode %d to 0\n", j, i);
+                            double_indirect_block[j] = 0;
+                        }
+                        isValid = false;
+                    } else if (indirect_block_num != 0) {
+                        uint32_t *indirect_block = get_block(indirect_block_num);
+                        if (indirect_block) {
+                            int entries_per_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
+                            for (int k = 0; k < entries_per_indirect_block; k++) {
+                                uint32_t data_block_num = indirect_block[k];
+                                if (data_block_num >= TOTAL_BLOCKS) {
+                                    finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, data_block_num, fix);
+                                    f.level = 2;
+                                    f.slot = k;
+                                    report_finding(&f, "Inode %d has bad data block %u in double indirect block", i, data_block_num);
+                                    if (fix) {
+                                        report_followup("Fixing: Setting invalid data block entry %d in indirect block of inode %d to 0\n", k, i);
+                                        indirect_block[k] = 0;
+                                    }
+                                    isValid = false;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        
+        // Check triple indirect block
+        if (triple_indirect >= TOTAL_BLOCKS) {
+            finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, triple_indirect, fix);
+            f.slot = 3;
+            report_finding(&f, "Inode %d has bad triple indirect block: %u", i, triple_indirect);
+            if (fix) {
+                report_followup("Fixing: Setting triple indirect block of inode %d to 0\n", i);
+                set_inode_pointer(i, PTR_TRIPLE, 0);
+            }
+            isValid = false;
+        }  else if (triple_indirect != 0) {
+            uint32_t *triple_indirect_block = get_block(triple_indirect);
+            if (triple_indirect_block) {
+                int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+                for (int j = 0; j < entries_per_block; j++) {
+                    uint32_t double_indirect_block_num = triple_indirect_block[j];
+                    if (double_indirect_block_num >= TOTAL_BLOCKS) {
+                        finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, double_indirect_block_num, fix);
+                        f.level = 1;
+                        f.slot = j;
+                        report_finding(&f, "Inode %d has bad double indirect block %u in triple indirect block", i, double_indirect_block_num);
+                        if (fix) {
+                            report_followup("Fixing: Setting invalid double indirect block entry %d in triple indirect block of inode %d to 0\n", j, i);
+                            triple_indirect_block[j] = 0;
+                        }
+                        isValid = false;
+                    } else if (double_indirect_block_num != 0) {
+                        uint32_t *double_indirect_block = get_block(double_indirect_block_num);
+                        if (double_indirect_block) {
+                            int entries_per_double_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
+                            for (int k = 0; k < entries_per_double_indirect_block; k++) {
+                                uint32_t single_indirect_block_num = double_indirect_block[k];
+                                if (single_indirect_block_num >= TOTAL_BLOCKS) {
+                                    finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, single_indirect_block_num, fix);
+                                    f.level = 2;
+                                    f.slot = k;
+                                    report_finding(&f, "Inode %d has bad single indirect block %u in triple indirect block", i, single_indirect_block_num);
+                                    if (fix) {
+                                        report_followup("Fixing: Setting invalid single indirect block entry %d in double indirect block of inode %d to 0\n", k, i);
+                                        double_indirect_block[k] = 0;
+                                    }
+                                    isValid = false;
+                                } else if (single_indirect_block_num != 0) {
+                                    uint32_t *single_indirect_block = get_block(single_indirect_block_num);
+                                    if (single_indirect_block) {
+                                        int entries_per_single_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
+                                        for (int m = 0; m < entries_per_single_indirect_block; m++) {
+                                            uint32_t data_block_num = single_indirect_block[m];
+                                            if (data_block_num >= TOTAL_BLOCKS) {
+                                                finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, i, data_block_num, fix);
+                                                f.level = 3;
+                                                f.slot = m;
+                                                report_finding(&f, "Inode %d has bad data block %u in triple indirect block", i, data_block_num);
+                                                if (fix) {
+                                                    report_followup("Fixing: Setting invalid data block entry %d in single indirect block of inode %d to 0\n", m, i);
+                                                    single_indirect_block[m] = 0;
+                                                }
+                                                isValid = false;
+                                            }
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    return isValid;
+}
+
+// 6. Inode Metadata Sanity Checker
+/*
+ * The predicates are evaluated over the inode shadow columns in batches of
+ * SANITY_BATCH inodes with branch-free loops that the compiler can
+ * vectorize, producing one flag byte per inode. Only inodes with a non-zero
+ * flag byte are looked at again to report findings.
+ */
+#define SANITY_BATCH 64  // One live_mask word per batch
+#define SANITY_TIME_SLACK (24 * 60 * 60)  // Tolerated clock skew for "future" timestamps
+
+#define SANITY_SIZE        0x01
+#define SANITY_TIME_FUTURE 0x02
+#define SANITY_TIME_ORDER  0x04
+#define SANITY_MODE        0x08
+
+// Count data blocks reachable below a pointer at the given indirection depth
+uint32_t count_tree_blocks(uint32_t blk, int depth) {
+    if (blk < DATA_BLOCK_START_NUM || blk >= TOTAL_BLOCKS) {
+        return 0;
+    }
+    if (depth == 0) {
+        return 1;
+    }
+    uint32_t *entries = (uint32_t *)get_block(blk);
+    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint32_t count = 0;
+    for (int j = 0; j < entries_per_block; j++) {
+        if (entries[j] != 0) {
+            count += count_tree_blocks(entries[j], depth - 1);
+        }
+    }
+    return count;
+}
+
+// Count the data blocks an inode actually reaches through its pointers
+uint32_t count_reachable_blocks(int ino) {
+    uint32_t count = 0;
+    for (int p = 0; p < PTR_COUNT; p++) {
+        count += count_tree_blocks(ctx->inode_soa.ptr[p][ino], p);
+    }
+    return count;
+}
+
+// Whether the file type bits name a known type and no stray bits are set
+static bool mode_is_sane(uint32_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG: case S_IFDIR: case S_IFLNK: case S_IFCHR:
+    case S_IFBLK: case S_IFIFO: case S_IFSOCK:
+        return (mode & ~(uint32_t)(S_IFMT | 07777)) == 0;
+    default:
+        return false;
+    }
+}
+
+bool check_inode_sanity(bool fix) {
+    report_info("\n=== Inode Metadata Sanity Check ===\n");
+    
+    bool isValid = true;
+    uint32_t future = (uint32_t)time(NULL) + SANITY_TIME_SLACK;
+    
+    uint8_t flags[SANITY_BATCH];
+    int start = resume_inode(CHECK_INODE_SANITY);
+    
+    for (int base = start / SANITY_BATCH * SANITY_BATCH; base < INODE_COUNT; base += SANITY_BATCH) {
+        int n = INODE_COUNT - base < SANITY_BATCH ? INODE_COUNT - base : SANITY_BATCH;
+        uint64_t live = ctx->inode_soa.live_mask[base / 64] & scope_word(base / 64);
+        if (start > base) {
+            live &= ~UINT64_C(0) << (start - base);
+        }
+        const uint32_t *mode = ctx->inode_soa.mode + base;
+        const uint32_t *size = ctx->inode_soa.size + base;
+        const uint32_t *blocks = ctx->inode_soa.blocks_count + base;
+        const uint32_t *atime = ctx->inode_soa.atime + base;
+        const uint32_t *ctime = ctx->inode_soa.ctime + base;
+        const uint32_t *mtime = ctx->inode_soa.mtime + base;
+        
+        // Evaluate the predicates column-wise
+        for (int k = 0; k < n; k++) {
+            uint8_t bad_size = (uint64_t)size[k] > (uint64_t)blocks[k] * BLOCK_SIZE;
+            uint8_t bad_future = (atime[k] > future) | (ctime[k] > future) | (mtime[k] > future);
+            uint8_t bad_order = (atime[k] < ctime[k]) | (mtime[k] < ctime[k]);
+            uint8_t bad_mode = (mode[k] & S_IFMT) == 0;
+            flags[k] = (uint8_t)(bad_size * SANITY_SIZE | bad_future * SANITY_TIME_FUTURE |
+                                 bad_order * SANITY_TIME_ORDER | bad_mode * SANITY_MODE);
+        }
+        
+        // Only live inodes are reported on
+        for (; live != 0; live &= live - 1) {
+            int k = __builtin_ctzll(live);
+            int i = base + k;
+            if (budget_stop(CHECK_INODE_SANITY, i)) {
+                return isValid;
+            }
+            if (!mode_is_sane(mode[k])) {
+                flags[k] |= SANITY_MODE;
+            }
+            
+            // blocks_count needs a tree walk, so it is checked per live inode
+            uint32_t reachable = count_reachable_blocks(i);
+            uint32_t blocks_count = blocks[k];
+            if (reachable != blocks_count) {
+                finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_BLOCK_COUNT, i,
+                                          blocks_count, fix);
+                f.aux = reachable;
+                report_finding(&f, "Inode %d has blocks_count %u but reaches %u data blocks",
+                               i, blocks_count, reachable);
+                if (fix) {
+                    report_followup("Fixing: Setting blocks_count of inode %d to %u\n", i, reachable);
+                    set_inode_blocks_count(i, reachable);
+                }
+                isValid = false;
+            }
+            
+            if (flags[k] == 0) {
+                continue;
+            }
+            if (flags[k] & SANITY_SIZE) {
+                finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_SIZE, i, size[k], false);
+                f.aux = blocks_count;
+                if (fix) {
+                    f.action = ACTION_UNFIXABLE;
+                }
+                report_finding(&f, "Inode %d has size %u but only %u blocks",
+                               i, size[k], blocks_count);
+                isValid = false;
+            }
+            if (flags[k] & SANITY_TIME_FUTURE) {
+                uint32_t newest = atime[k];
+                if (ctime[k] > newest) newest = ctime[k];
+                if (mtime[k] > newest) newest = mtime[k];
+                finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_TIME_FUTURE, i, 0, false);
+                f.severity = SEVERITY_WARNING;
+                f.aux = newest;
+                report_finding(&f, "Inode %d has a timestamp in the future (%s)", i, time_to_str(newest));
+            }
+            if (flags[k] & SANITY_TIME_ORDER) {
+                finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_TIME_ORDER, i, 0, false);
+                f.severity = SEVERITY_WARNING;
+                f.aux = ctime[k];
+                report_finding(&f, "Inode %d was accessed or modified before it was created", i);
+            }
+            if (flags[k] & SANITY_MODE) {
+                finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_MODE, i, 0, false);
+                f.severity = SEVERITY_WARNING;
+                f.aux = mode[k];
+                report_finding(&f, "Inode %d has invalid mode 0%o", i, mode[k]);
+            }
+        }
+    }
+    
+    return isValid;
+}
+
+// 7. Directory Tree Checker
+/*
+ * Walks the namespace from the root, counting in a dense per-inode array
+ * how many directory entries name each inode. Those counts are then
+ * compared against links_count, and live inodes nobody names are orphans.
+ * Subdirectories of the root are handed out to check_jobs worker threads,
+ * each of which walks whole subtrees; a directory reachable through more
+ * than one path is only walked once thanks to the atomic visited flags.
+ */
+typedef struct {
+    uint32_t dir;       // Directory holding the entry
+    uint32_t block;     // Data block of the entry
+    uint32_t slot;      // Entry index within the block
+    uint32_t target;    // Inode number the entry names
+} dangling_t;
+
+typedef struct {
+    vsfsck_t *ctx;           // Context the workers check
+    uint32_t *refs;          // Entries naming each inode (shared, atomic)
+    uint8_t *named;          // Named by an entry other than "." or ".." (shared)
+    uint8_t *visited;        // Directories already walked (shared, atomic)
+    uint32_t *roots;         // Subtree roots handed out to workers
+    int root_count;
+    int next_root;           // Next subtree root to hand out (atomic)
+} dir_walk_t;
+
+typedef struct {
+    dir_walk_t *walk;
+    uint32_t *stack;         // Directories waiting to be read
+    int stack_len, stack_cap;
+    dangling_t *dangling;    // Dangling entries found by this worker
+    int dangling_len, dangling_cap;
+    uint32_t current_dir;
+    bool collect_subdirs;    // Push subdirectories to stack
+    bool out_of_memory;
+} dir_worker_t;
+
+static bool grow_array(void **array, int *cap, size_t elem_size) {
+    int new_cap = *cap ? *cap * 2 : 64;
+    void *p = realloc(*array, (size_t)new_cap * elem_size);
+    if (!p) {
+        return false;
+    }
+    *array = p;
+    *cap = new_cap;
+    return true;
+}
+
+static void push_dir(dir_worker_t *w, uint32_t ino) {
+    if (w->stack_len == w->stack_cap &&
+        !grow_array((void **)&w->stack, &w->stack_cap, sizeof(uint32_t))) {
+        w->out_of_memory = true;
+        return;
+    }
+    w->stack[w->stack_len++] = ino;
+}
+
+// Account for every entry in one directory data block
+static void scan_dir_block(uint32_t blk, uint32_t logical, void *arg) {
+    dir_worker_t *w = arg;
+    (void)logical;
+    dir_walk_t *walk = w->walk;
+    dirent_t *entries = (dirent_t *)get_block(blk);
+    
+    for (uint32_t slot = 0; slot < DIRENTS_PER_BLOCK; slot++) {
+        dirent_t *e = &entries[slot];
+        if (e->name[0] == '\0') {
+            continue;
+        }
+        if (e->inode >= INODE_COUNT || !inode_is_live(e->inode)) {
+            if (w->dangling_len == w->dangling_cap &&
+                !grow_array((void **)&w->dangling, &w->dangling_cap, sizeof(dangling_t))) {
+                w->out_of_memory = true;
+                return;
+            }
+            w->dangling[w->dangling_len++] = (dangling_t){ w->current_dir, blk, slot, e->inode };
+            continue;
+        }
+        
+        __atomic_fetch_add(&walk->refs[e->inode], 1, __ATOMIC_RELAXED);
+        
+        bool is_dot = strncmp(e->name, ".", DIR_NAME_LEN) == 0 || strncmp(e->name, "..", DIR_NAME_LEN) == 0;
+        if (!is_dot) {
+            __atomic_store_n(&walk->named[e->inode], 1, __ATOMIC_RELAXED);
+        }
+        if (!is_dot && w->collect_subdirs && inode_is_dir(e->inode) &&
+            !__atomic_exchange_n(&walk->visited[e->inode], 1, __ATOMIC_RELAXED)) {
+            push_dir(w, e->inode);
+        }
+    }
+}
+
+// Walk every directory on the worker's stack until it is empty
+static void drain_dir_stack(dir_worker_t *w) {
+    while (w->stack_len > 0 && !w->out_of_memory) {
+        w->current_dir = w->stack[--w->stack_len];
+        for_each_file_block(w->current_dir, scan_dir_block, w);
+    }
+}
+
+static void *dir_walk_worker(void *arg) {
+    dir_worker_t *w = arg;
+    dir_walk_t *walk = w->walk;
+    ctx = walk->ctx;
+    int r;
+    while ((r = __atomic_fetch_add(&walk->next_root, 1, __ATOMIC_RELAXED)) < walk->root_count) {
+        push_dir(w, walk->roots[r]);
+        drain_dir_stack(w);
+    }
+    return NULL;
+}
+
+// Find the inode a directory names by the given entry name, or -1
+static int lookup_entry(int dir, const char *name) {
+    block_list_t list = {0};
+    for_each_file_block(dir, collect_block, &list);
+    int found = -1;
+    for (int b = 0; b < list.len && found < 0; b++) {
+        dirent_t *slots = (dirent_t *)get_block(list.blocks[b]);
+        for (int slot = 0; slot < (int)DIRENTS_PER_BLOCK; slot++) {
+            if (slots[slot].name[0] != '\0' && strncmp(slots[slot].name, name, DIR_NAME_LEN) == 0) {
+                found = slots[slot].inode;
+                break;
+            }
+        }
+    }
+    free(list.blocks);
+    return found;
+}
+
+// Point the ".." entry of a directory at a new parent; returns the old one or -1
+static int set_dotdot(int dir, uint32_t parent) {
+    block_list_t list = {0};
+    for_each_file_block(dir, collect_block, &list);
+    int old = -1;
+    for (int b = 0; b < list.len && old < 0; b++) {
+        dirent_t *slots = (dirent_t *)get_block(list.blocks[b]);
+        for (int slot = 0; slot < (int)DIRENTS_PER_BLOCK; slot++) {
+            if (strncmp(slots[slot].name, "..", DIR_NAME_LEN) == 0) {
+                old = slots[slot].inode;
+                slots[slot].inode = parent;
+                break;
+            }
+        }
+    }
+    free(list.blocks);
+    return old;
+}
+
+// Create /lost+found with "." and ".." entries; returns its inode or -1
+static int create_lost_found(uint32_t *refs) {
+    int lf = alloc_inode();
+    if (lf < 0) {
+        return -1;
+    }
+    uint32_t blk;
+    if (alloc_data_blocks(1, &blk) != 1) {
+        clear_bit(ctx->inode_bitmap, lf);
+        return -1;
+    }
+    
+    dirent_t *slots = (dirent_t *)get_block(blk);
+    memset(slots, 0, BLOCK_SIZE);
+    slots[0] = make_dirent(lf, ".");
+    slots[1] = make_dirent(ROOT_INODE_NUM, "..");
+    
+    inode_t *inode = &ctx->inode_table[lf];
+    uint32_t now = (uint32_t)time(NULL);
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = S_IFDIR | 0700;
+    inode->links_count = 2;
+    inode->size = BLOCK_SIZE;
+    inode->blocks_count = 1;
+    inode->direct_block = blk;
+    inode->atime = inode->ctime = inode->mtime = now;
+    refresh_inode_soa(lf);
+    
+    dirent_t entry = make_dirent(lf, "lost+found");
+    if (append_dir_entries(ROOT_INODE_NUM, &entry, 1) != 1) {
+        memset(inode, 0, sizeof(*inode));
+        refresh_inode_soa(lf);
+        clear_bit(ctx->inode_bitmap, lf);
+        free_data_blocks(&blk, 1);
+        return -1;
+    }
+    refs[lf] += 2;
+    refs[ROOT_INODE_NUM]++;
+    set_inode_links_count(ROOT_INODE_NUM, ctx->inode_table[ROOT_INODE_NUM].links_count + 1);
+    return lf;
+}
+
+/*
+ * Reconnect orphaned inodes under /lost+found as "#<inode>". All entries are
+ * appended in one batch so new directory blocks are allocated together and
+ * filled completely. Orphaned directories get their ".." repointed. Returns
+ * how many orphans (from the front of the list) were reconnected.
+ */
+static int reconnect_orphans(const uint32_t *orphans, int count, uint32_t *refs) {
+    int lf = lookup_entry(ROOT_INODE_NUM, "lost+found");
+    if (lf < 0 || lf >= INODE_COUNT || !inode_is_live(lf) || !inode_is_dir(lf)) {
+        lf = create_lost_found(refs);
+        if (lf < 0) {
+            report_info("Note: Could not create /lost+found (no free inode or block)\n");
+            return 0;
+        }
+        report_info("Created /lost+found as inode %d\n", lf);
+    }
+    
+    dirent_t *entries = malloc((size_t)count * sizeof(dirent_t));
+    if (!entries) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 0;
+    }
+    for (int o = 0; o < count; o++) {
+        char name[DIR_NAME_LEN];
+        snprintf(name, sizeof(name), "#%u", orphans[o]);
+        entries[o] = make_dirent(orphans[o], name);
+    }
+    int placed = append_dir_entries(lf, entries, count);
+    free(entries);
+    
+    for (int o = 0; o < placed; o++) {
+        uint32_t ino = orphans[o];
+        refs[ino]++;
+        if (inode_is_dir(ino)) {
+            int old_parent = set_dotdot(ino, lf);
+            if (old_parent >= 0 && old_parent < INODE_COUNT && refs[old_parent] > 0) {
+                refs[old_parent]--;
+            }
+            refs[lf]++;
+            set_inode_links_count(lf, ctx->inode_table[lf].links_count + 1);
+        }
+    }
+    return placed;
+}
+
+static int compare_dangling(const void *a, const void *b) {
+    const dangling_t *x = a, *y = b;
+    if (x->dir != y->dir) return x->dir < y->dir ? -1 : 1;
+    if (x->block != y->block) return x->block < y->block ? -1 : 1;
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+bool check_directory_tree(bool fix) {
+    report_info("\n=== Directory Tree Check ===\n");
+    
+    if (!inode_is_live(ROOT_INODE_NUM) || !inode_is_dir(ROOT_INODE_NUM)) {
+        // Images made before directories existed have no namespace at all;
+        // only an image that has directories needs a root
+        bool has_dirs = false;
+        for (int i = next_live_inode(-1); i >= 0 && !has_dirs; i = next_live_inode(i)) {
+            has_dirs = inode_is_dir(i);
+        }
+        if (!has_dirs) {
+            report_info("No directories on this image; skipping directory walk\n");
+            return true;
+        }
+        finding_t f = new_finding(CHECK_DIRECTORY_TREE, FINDING_ROOT_NOT_DIR, ROOT_INODE_NUM, 0, false);
+        if (fix) {
+            f.action = ACTION_UNFIXABLE;
+        }
+        report_finding(&f, "Root inode %d is not a live directory; skipping directory walk", ROOT_INODE_NUM);
+        return false;
+    }
+    
+    bool isValid = true;
+    int jobs = ctx->check_jobs > 0 ? ctx->check_jobs : 1;
+    dir_walk_t walk = { .ctx = ctx };
+    dir_worker_t *workers = calloc(jobs, sizeof(dir_worker_t));
+    walk.refs = calloc(INODE_COUNT, sizeof(uint32_t));
+    walk.visited = calloc(INODE_COUNT, sizeof(uint8_t));
+    walk.named = calloc(INODE_COUNT, sizeof(uint8_t));
+    if (!workers || !walk.refs || !walk.visited || !walk.named) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(workers);
+        free(walk.refs);
+        free(walk.visited);
+        free(walk.named);
+        return false;
+    }
+    
+    // Read the root on this thread; its subdirectories become the work items
+    dir_worker_t *main_worker = &workers[0];
+    main_worker->walk = &walk;
+    walk.visited[ROOT_INODE_NUM] = 1;
+    main_worker->current_dir = ROOT_INODE_NUM;
+    main_worker->collect_subdirs = true;
+    for_each_file_block(ROOT_INODE_NUM, scan_dir_block, main_worker);
+    walk.roots = main_worker->stack;
+    walk.root_count = main_worker->stack_len;
+    main_worker->stack = NULL;
+    main_worker->stack_len = main_worker->stack_cap = 0;
+    
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    int started = 0;
+    for (int t = 1; t < jobs && threads; t++) {
+        workers[t].walk = &walk;
+        workers[t].collect_subdirs = true;
+        if (pthread_create(&threads[t], NULL, dir_walk_worker, &workers[t]) != 0) {
+            break;
+        }
+        started = t;
+    }
+    dir_walk_worker(main_worker);
+    for (int t = 1; t <= started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    
+    // Also walk directories the root cannot reach, so that the contents of
+    // an orphaned directory are attributed to it rather than reported as
+    // orphans themselves
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        if (inode_is_dir(i) && !walk.visited[i]) {
+            walk.visited[i] = 1;
+            push_dir(main_worker, i);
+            drain_dir_stack(main_worker);
+        }
+    }
+    
+    // Merge and report dangling entries in a deterministic order
+    int dangling_total = 0;
+    bool out_of_memory = false;
+    for (int t = 0; t < jobs; t++) {
+        dangling_total += workers[t].dangling_len;
+        out_of_memory |= workers[t].out_of_memory;
+    }
+    dangling_t *dangling = malloc((size_t)(dangling_total ? dangling_total : 1) * sizeof(dangling_t));
+    if (out_of_memory || !dangling) {
+        fprintf(stderr, "Memory allocation failed\n");
+        isValid = false;
+    } else {
+        int n = 0;
+        for (int t = 0; t < jobs; t++) {
+            if (workers[t].dangling_len > 0) {
+                memcpy(dangling + n, workers[t].dangling, (size_t)workers[t].dangling_len * sizeof(dangling_t));
+                n += workers[t].dangling_len;
+            }
+        }
+        qsort(dangling, n, sizeof(dangling_t), compare_dangling);
+        
+        for (int d = 0; d < n; d++) {
+            dirent_t *e = &((dirent_t *)get_block(dangling[d].block))[dangling[d].slot];
+            finding_t f = new_finding(CHECK_DIRECTORY_TREE, FINDING_DANGLING_ENTRY, dangling[d].dir,
+                                      dangling[d].block, fix);
+            f.slot = dangling[d].slot;
+            f.aux = dangling[d].target;
+            report_finding(&f, "Directory inode %u has entry '%.*s' naming unused inode %u",
+                           dangling[d].dir, DIR_NAME_LEN, e->name, dangling[d].target);
+            if (fix) {
+                report_followup("Fixing: Removing entry %u from block %u\n", dangling[d].slot, dangling[d].block);
+                e->name[0] = '\0';
+            }
+            isValid = false;
+        }
+        
+        // Orphans are live inodes no entry names (besides their own "." / "..")
+        int orphan_count = 0, reconnected = 0;
+        uint32_t *orphans = malloc(INODE_COUNT * sizeof(uint32_t));
+        uint8_t *is_orphan = calloc(INODE_COUNT, sizeof(uint8_t));
+        if (!orphans || !is_orphan) {
+            fprintf(stderr, "Memory allocation failed\n");
+            free(orphans);
+            free(is_orphan);
+            orphans = NULL;
+            is_orphan = NULL;
+            isValid = false;
+        } else {
+            for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+                if (i != ROOT_INODE_NUM && !walk.named[i]) {
+                    orphans[orphan_count++] = i;
+                    is_orphan[i] = 1;
+                }
+            }
+            if (fix && orphan_count > 0) {
+                reconnected = reconnect_orphans(orphans, orphan_count, walk.refs);
+            }
+            for (int o = 0; o < orphan_count; o++) {
+                int i = orphans[o];
+                bool fixed = o < reconnected;
+                finding_t f = new_finding(CHECK_DIRECTORY_TREE, FINDING_ORPHAN_INODE, i, 0, fixed);
+                if (fix && !fixed) {
+                    f.action = ACTION_UNFIXABLE;
+                }
+                report_finding(&f, "Inode %d is live but not reachable from the root directory", i);
+                if (fixed) {
+                    report_followup("Fixing: Reconnected inode %d as /lost+found/#%d\n", i, i);
+                }
+                isValid = false;
+            }
+        }
+        
+        // Compare the reference counts against the inodes
+        for (int i = next_live_inode(-1); i >= 0 && is_orphan; i = next_live_inode(i)) {
+            uint32_t refs = walk.refs[i];
+            uint32_t links = ctx->inode_table[i].links_count;
+            if (is_orphan[i] && refs == 0) {
+                continue;
+            } else if (refs != links) {
+                finding_t f = new_finding(CHECK_DIRECTORY_TREE, FINDING_LINK_COUNT, i, 0, fix);
+                f.aux = refs;
+                report_finding(&f, "Inode %d has links_count %u but %u directory entries", i, links, refs);
+                if (fix) {
+                    report_followup("Fixing: Setting links_count of inode %d to %u\n", i, refs);
+                    set_inode_links_count(i, refs);
+                }
+                isValid = false;
+            }
+        }
+        free(orphans);
+        free(is_orphan);
+    }
+    
+    for (int t = 0; t < jobs; t++) {
+        free(workers[t].stack);
+        free(workers[t].dangling);
+    }
+    free(workers);
+    free(dangling);
+    free(walk.roots);
+    free(walk.refs);
+    free(walk.visited);
+    free(walk.named);
+    return isValid;
+}
+
+// 8. Quick Sampled Check
+/*
+ * --quick validates the superblock and the inode bitmap in full but verifies
+ * only a sample of the live inodes. The sample is stratified by the deepest
+ * pointer an inode uses (direct, single, double, triple), so the few files
+ * with deep indirect trees are not crowded out by small ones. Stratum sizes
+ * are not known without looking at every inode, so the sample is drawn in
+ * two phases: up to QUICK_SCREEN_FACTOR times the sample size of live
+ * inodes are drawn uniformly from the live mask by rank and classified,
+ * and each stratum's share of the sample is then drawn from its screened
+ * members. Inside a sampled tree every entry of a visited indirect block
+ * is range checked, but only a fraction of its child indirect blocks (at
+ * most QUICK_MAX_CHILDREN) is descended into. Together with the cap of
+ * quick_max_samples inodes this bounds the work by the sample and the
+ * size of the live mask, regardless of how many inodes are in use.
+ *
+ * The data bitmap is checked from the sampled side only: blocks reached by
+ * a sampled inode must be marked. Leaked blocks need a full walk to find.
+ *
+ * If all n sampled inodes are clean, the zero-failure binomial bound
+ * -ln(1 - confidence) / n (the "rule of three") is reported as the largest
+ * fraction of inconsistent inodes still compatible with the sample.
+ */
+#define QUICK_DEFAULT_FRACTION 0.05
+#define QUICK_DEFAULT_MAX_SAMPLES 1024
+#define QUICK_MAX_CHILDREN 8
+#define QUICK_SCREEN_FACTOR 8        // Screened inodes per sampled inode
+#define QUICK_CONFIDENCE 95          // Percent
+#define QUICK_NEG_LOG_ALPHA 2.9957   // -ln(1 - 0.95)
+
+static const char *stratum_names[PTR_COUNT] = { "direct", "single", "double", "triple" };
+
+typedef struct {
+    uint32_t live;                   // Live inodes
+    uint32_t screened;               // Live inodes classified into strata
+    uint32_t population[PTR_COUNT];  // Live inodes per stratum, estimated
+                                     // from the screen when screened < live
+    uint32_t sampled[PTR_COUNT];     // Verified inodes per stratum
+    uint32_t failed;                 // Sampled inodes with at least one error
+    uint64_t seed;                   // Seed actually used
+} quick_stats_t;
+
+typedef struct {
+    int ino;
+    int *owner;           // First sampled inode seen per block (-1 = none)
+    bool ok;
+} quick_inode_t;
+
+// xorshift64*: small, fast and reproducible from the reported seed
+static uint64_t quick_rand(void) {
+    uint64_t x = ctx->quick_rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    ctx->quick_rng = x;
+    return x * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+// Uniform value in [0, n) without a division
+static uint32_t quick_rand_below(uint32_t n) {
+    return (uint32_t)(((quick_rand() >> 32) * n) >> 32);
+}
+
+// Stratum of an inode: index of its deepest non-zero pointer
+static int inode_stratum(int ino) {
+    int depth = PTR_DIRECT;
+    for (int p = PTR_SINGLE; p < PTR_COUNT; p++) {
+        if (ctx->inode_soa.ptr[p][ino] != 0) {
+            depth = p;
+        }
+    }
+    return depth;
+}
+
+// Live inode of the given rank (0-based, in inode order); prefix[w] is the
+// number of live inodes in the mask words before w
+static int live_inode_by_rank(const uint32_t *prefix, uint32_t rank) {
+    int lo = 0, hi = INODE_MASK_WORDS - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (prefix[mid] <= rank) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    uint64_t bits = ctx->inode_soa.live_mask[lo];
+    for (uint32_t k = rank - prefix[lo]; k > 0; k--) {
+        bits &= bits - 1;
+    }
+    return lo * 64 + __builtin_ctzll(bits);
+}
+
+// Mark count distinct live inodes, drawn uniformly at random, in chosen
+// (shaped like live_mask) with Floyd's algorithm
+static void quick_draw_live(const uint32_t *prefix, uint32_t live, uint32_t count, uint64_t *chosen) {
+    for (uint32_t j = live - count; j < live; j++) {
+        int ino = live_inode_by_rank(prefix, quick_rand_below(j + 1));
+        if ((chosen[ino / 64] >> (ino % 64)) & 1) {
+            ino = live_inode_by_rank(prefix, j);
+        }
+        chosen[ino / 64] |= UINT64_C(1) << (ino % 64);
+    }
+}
+
+// Check one in-range block reached by a sampled inode and, for indirect
+// blocks, its entries and a random subset of its child indirect blocks
+static void quick_verify_tree(quick_inode_t *q, uint32_t blk, int depth, int level) {
+    if (blk < DATA_BLOCK_START_NUM) {
+        return;
+    }
+    if (!is_bit_set(ctx->data_bitmap, blk - DATA_BLOCK_START_NUM)) {
+        finding_t f = new_finding(CHECK_DATA_BITMAP, FINDING_BLOCK_NOT_MARKED, q->ino, blk, false);
+        report_finding(&f, "Block %u is referenced by inode %d but not marked used in data bitmap",
+                       blk, q->ino);
+        q->ok = false;
+    }
+    if (q->owner[blk] >= 0) {
+        finding_t f = new_finding(CHECK_DUPLICATE_BLOCKS, FINDING_DUPLICATE_BLOCK, q->ino, blk, false);
+        f.aux = q->owner[blk];
+        report_finding(&f, "Block %u is referenced by inode %d and inode %d", blk, q->owner[blk], q->ino);
+        q->ok = false;
+        return;
+    }
+    q->owner[blk] = q->ino;
+    if (depth == 0) {
+        return;
+    }
+    
+    uint32_t *entries = (uint32_t *)get_block(blk);
+    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    uint16_t children[BLOCK_SIZE / sizeof(uint32_t)];
+    int child_count = 0;
+    for (int j = 0; j < entries_per_block; j++) {
+        uint32_t entry = entries[j];
+        if (entry == 0) {
+            continue;
+        }
+        if (entry >= TOTAL_BLOCKS) {
+            finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, q->ino, entry, false);
+            f.level = (uint8_t)(level + 1);
+            f.slot = j;
+            report_finding(&f, "Inode %d has bad block %u in a depth %d indirect block", q->ino, entry, depth);
+            q->ok = false;
+        } else if (depth == 1) {
+            quick_verify_tree(q, entry, 0, level + 1);
+        } else {
+            children[child_count++] = (uint16_t)j;
+        }
+    }
+    
+    // Descend into a partial Fisher-Yates shuffle of the child indirect blocks
+    int want = (int)(ctx->quick_fraction * child_count + 0.999);
+    if (want > QUICK_MAX_CHILDREN) want = QUICK_MAX_CHILDREN;
+    if (want < 1) want = 1;
+    for (int k = 0; k < want && k < child_count; k++) {
+        int pick = k + (int)quick_rand_below((uint32_t)(child_count - k));
+        uint16_t tmp = children[k];
+        children[k] = children[pick];
+        children[pick] = tmp;
+        quick_verify_tree(q, entries[children[k]], depth - 1, level + 1);
+    }
+}
+
+// Run the inode-local metadata predicates of check_inode_sanity() on one inode
+static void quick_verify_metadata(quick_inode_t *q, uint32_t future) {
+    int i = q->ino;
+    uint32_t atime = ctx->inode_soa.atime[i], ctime = ctx->inode_soa.ctime[i], mtime = ctx->inode_soa.mtime[i];
+    uint32_t size = ctx->inode_soa.size[i], blocks_count = ctx->inode_soa.blocks_count[i];
+    
+    if ((uint64_t)size > (uint64_t)blocks_count * BLOCK_SIZE) {
+        finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_SIZE, i, size, false);
+        f.aux = blocks_count;
+        report_finding(&f, "Inode %d has size %u but only %u blocks", i, size, blocks_count);
+        q->ok = false;
+    }
+    if (atime > future || ctime > future || mtime > future) {
+        uint32_t newest = atime;
+        if (ctime > newest) newest = ctime;
+        if (mtime > newest) newest = mtime;
+        finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_TIME_FUTURE, i, 0, false);
+        f.severity = SEVERITY_WARNING;
+        f.aux = newest;
+        report_finding(&f, "Inode %d has a timestamp in the future (%s)", i, time_to_str(newest));
+    }
+    if (atime < ctime || mtime < ctime) {
+        finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_TIME_ORDER, i, 0, false);
+        f.severity = SEVERITY_WARNING;
+        f.aux = ctime;
+        report_finding(&f, "Inode %d was accessed or modified before it was created", i);
+    }
+    if (!mode_is_sane(ctx->inode_soa.mode[i])) {
+        finding_t f = new_finding(CHECK_INODE_SANITY, FINDING_INODE_MODE, i, 0, false);
+        f.severity = SEVERITY_WARNING;
+        f.aux = ctx->inode_soa.mode[i];
+        report_finding(&f, "Inode %d has invalid mode 0%o", i, ctx->inode_soa.mode[i]);
+    }
+}
+
+bool check_inodes_sampled(quick_stats_t *stats) {
+    report_info("\n=== Sampled Inode Verification ===\n");
+    
+    memset(stats, 0, sizeof(*stats));
+    stats->seed = ctx->quick_seed ? ctx->quick_seed : (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    ctx->quick_rng = stats->seed ? stats->seed : UINT64_C(0x9E3779B97F4A7C15);
+    
+    // Live inodes per mask word, without touching the inodes
+    uint32_t prefix[INODE_MASK_WORDS];
+    uint32_t live = 0;
+    for (int w = 0; w < INODE_MASK_WORDS; w++) {
+        prefix[w] = live;
+        live += (uint32_t)__builtin_popcountll(ctx->inode_soa.live_mask[w]);
+    }
+    stats->live = live;
+    if (live == 0) {
+        return true;
+    }
+    
+    uint32_t total = (uint32_t)(ctx->quick_fraction * live + 0.999);
+    if (total > ctx->quick_max_samples) total = ctx->quick_max_samples;
+    if (total < 1) total = 1;
+    
+    // First phase: screen a uniform sample of the live inodes for their strata
+    uint64_t screen_size = (uint64_t)total * QUICK_SCREEN_FACTOR;
+    uint32_t screened = screen_size < live ? (uint32_t)screen_size : live;
+    uint64_t chosen[INODE_MASK_WORDS];
+    memset(chosen, 0, sizeof(chosen));
+    quick_draw_live(prefix, live, screened, chosen);
+    stats->screened = screened;
+    
+    int *members = malloc((size_t)screened * sizeof(int));
+    int *owner = malloc(TOTAL_BLOCKS * sizeof(int));
+    if (!members || !owner) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(members);
+        free(owner);
+        return false;
+    }
+    uint32_t count[PTR_COUNT] = {0}, first[PTR_COUNT], placed[PTR_COUNT];
+    for (int i = next_set_bit(chosen, NULL, INODE_COUNT, -1); i >= 0;
+         i = next_set_bit(chosen, NULL, INODE_COUNT, i)) {
+        count[inode_stratum(i)]++;
+    }
+    for (int s = 0, at = 0; s < PTR_COUNT; at += count[s], s++) {
+        first[s] = placed[s] = at;
+    }
+    for (int i = next_set_bit(chosen, NULL, INODE_COUNT, -1); i >= 0;
+         i = next_set_bit(chosen, NULL, INODE_COUNT, i)) {
+        members[placed[inode_stratum(i)]++] = i;
+    }
+    
+    // Second phase: proportional allocation with at least one sample per
+    // screened stratum, drawn by a partial Fisher-Yates shuffle
+    uint32_t want[PTR_COUNT] = {0};
+    for (int s = 0; s < PTR_COUNT; s++) {
+        stats->population[s] = screened == live ? count[s] :
+            (uint32_t)(((uint64_t)count[s] * live + screened / 2) / screened);
+        if (count[s] == 0) {
+            continue;
+        }
+        want[s] = (uint32_t)(((uint64_t)total * count[s] + screened - 1) / screened);
+        if (want[s] > count[s]) want[s] = count[s];
+        int *pool = members + first[s];
+        for (uint32_t k = 0; k < want[s]; k++) {
+            uint32_t pick = k + quick_rand_below(count[s] - k);
+            int tmp = pool[k];
+            pool[k] = pool[pick];
+            pool[pick] = tmp;
+        }
+    }
+    
+    // Verify the sample
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        owner[b] = -1;
+    }
+    uint32_t future = (uint32_t)time(NULL) + SANITY_TIME_SLACK;
+    for (int s = 0; s < PTR_COUNT; s++) {
+        for (uint32_t k = 0; k < want[s]; k++) {
+            quick_inode_t q = { members[first[s] + k], owner, true };
+            for (int p = 0; p < PTR_COUNT; p++) {
+                uint32_t blk = ctx->inode_soa.ptr[p][q.ino];
+                if (blk >= TOTAL_BLOCKS) {
+                    finding_t f = new_finding(CHECK_BAD_BLOCKS, FINDING_BAD_BLOCK, q.ino, blk, false);
+                    f.slot = p;
+                    report_finding(&f, "Inode %d has bad %s block: %u", q.ino, stratum_names[p], blk);
+                    q.ok = false;
+                } else if (blk != 0) {
+                    quick_verify_tree(&q, blk, p, 0);
+                }
+            }
+            quick_verify_metadata(&q, future);
+            stats->sampled[s]++;
+            if (!q.ok) {
+                stats->failed++;
+            }
+        }
+    }
+    free(members);
+    free(owner);
+    
+    return stats->failed == 0;
+}
+
+// Print the sample breakdown and the confidence bound of a quick check
+void report_quick_stats(const quick_stats_t *stats) {
+    uint32_t population = stats->live, sampled = 0;
+    for (int s = 0; s < PTR_COUNT; s++) {
+        sampled += stats->sampled[s];
+    }
+    bool estimated = stats->screened < stats->live;
+    
+    // Zero-failure upper bound on the inconsistent fraction; exact when
+    // every live inode was sampled
+    double bound = 0.0;
+    if (sampled < population) {
+        bound = QUICK_NEG_LOG_ALPHA / sampled;
+        if (bound > 1.0) bound = 1.0;
+    }
+    
+    FILE *out = ctx->out;
+    if (ctx->output_format == OUTPUT_JSON) {
+        report_flush_suppressed();
+        if (!out) {
+            return;
+        }
+        fprintf(out, "{\"type\":\"quick_sample\",\"seed\":%llu,\"population\":%u,\"screened\":%u,\"sampled\":%u,"
+                "\"failed\":%u", (unsigned long long)stats->seed, population, stats->screened, sampled,
+                stats->failed);
+        for (int s = 0; s < PTR_COUNT; s++) {
+            fprintf(out, ",\"%s\":[%u,%u]", stratum_names[s], stats->sampled[s], stats->population[s]);
+        }
+        if (stats->failed == 0) {
+            fprintf(out, ",\"confidence\":%d,\"max_bad_fraction\":%.4f", QUICK_CONFIDENCE, bound);
+        }
+        fprintf(out, "}\n");
+        return;
+    }
+    
+    report_info("Sampled inodes: %u of %u live (seed %llu)\n", sampled, population,
+                (unsigned long long)stats->seed);
+    for (int s = 0; s < PTR_COUNT; s++) {
+        if (stats->population[s] > 0) {
+            report_info("  %-7s %u of %s%u\n", stratum_names[s], stats->sampled[s], estimated ? "~" : "",
+                        stats->population[s]);
+        }
+    }
+    if (stats->failed > 0) {
+        report_info("Sampled inodes with errors: %u (run a full check)\n", stats->failed);
+    } else if (population > 0) {
+        report_info("Confidence: %d%% that at most %.1f%% of live inodes are inconsistent\n",
+                    QUICK_CONFIDENCE, bound * 100.0);
+    }
+}
+
+// 9. Metadata Checksum Verifier
+/*
+ * VSFS stores no checksums, so --manifest=FILE keeps them in a sidecar
+ * file: a CRC32C of the superblock, both bitmaps, every inode table block
+ * and every indirect block reachable from a live inode. When the manifest
+ * exists the blocks it lists are verified against it; a mismatch means the
+ * block changed behind the checker's back. After a run that finds the image
+ * consistent the manifest is rewritten from the current image.
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction when the CPU has it (eight bytes
+ * per instruction, several GB/s on a 4 KiB block) and a slicing-by-8 table
+ * otherwise.
+ */
+#define MANIFEST_MAGIC "VSCM"
+#define MANIFEST_VERSION 1
+
+typedef struct {
+    uint32_t block;
+    uint32_t crc;
+} manifest_entry_t;
+
+typedef struct checksum_manifest {
+    manifest_entry_t *entries;
+    uint32_t count;
+} checksum_manifest_t;
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; len > 0; p++, len--) {
+        crc = crc32c_table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; len > 0; p++, len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][n] = crc32c_table[0][crc32c_table[t - 1][n] & 0xFF] ^ (crc32c_table[t - 1][n] >> 8);
+        }
+    }
+    crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_sse42;
+    }
+#endif
+}
+
+// CRC32C (Castagnoli) of a byte range
+uint32_t crc32c(const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~UINT32_C(0), data, len);
+}
+
+// Name of the kind of metadata a block holds, for messages
+static const char *metadata_block_kind(uint32_t blk) {
+    if (blk == SUPERBLOCK_NUM) return "superblock";
+    if (blk == INODE_BITMAP_BLOCK_NUM) return "inode bitmap";
+    if (blk == DATA_BITMAP_BLOCK_NUM) return "data bitmap";
+    if (blk < DATA_BLOCK_START_NUM) return "inode table";
+    return "indirect block";
+}
+
+static void mark_indirect_blocks(uint32_t blk, int depth, bool *indirect) {
+    if (blk < DATA_BLOCK_START_NUM || blk >= TOTAL_BLOCKS || depth == 0 || indirect[blk]) {
+        return;
+    }
+    indirect[blk] = true;
+    uint32_t *entries = (uint32_t *)get_block(blk);
+    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    for (int j = 0; j < entries_per_block; j++) {
+        if (entries[j] != 0) {
+            mark_indirect_blocks(entries[j], depth - 1, indirect);
+        }
+    }
+}
+
+void free_manifest(checksum_manifest_t *m) {
+    if (m) {
+        free(m->entries);
+        free(m);
+    }
+}
+
+// Read a manifest. Returns it, or NULL with *missing set when the file does
+// not exist and clear when it is unusable.
+checksum_manifest_t *load_manifest(const char *path, bool *missing) {
+    FILE *f = fopen(path, "rb");
+    *missing = f == NULL;
+    if (!f) {
+        return NULL;
+    }
+    checksum_manifest_t *m = calloc(1, sizeof(checksum_manifest_t));
+    char magic[4];
+    uint32_t version = 0, sum = 0;
+    bool ok = m && fread(magic, 1, 4, f) == 4 && memcmp(magic, MANIFEST_MAGIC, 4) == 0 &&
+              fread(&version, sizeof(version), 1, f) == 1 && version == MANIFEST_VERSION &&
+              fread(&m->count, sizeof(m->count), 1, f) == 1 && m->count <= TOTAL_BLOCKS;
+    if (ok) {
+        m->entries = calloc(m->count ? m->count : 1, sizeof(manifest_entry_t));
+        ok = m->entries && fread(m->entries, sizeof(manifest_entry_t), m->count, f) == m->count &&
+             fread(&sum, sizeof(sum), 1, f) == 1 &&
+             sum == crc32c(m->entries, m->count * sizeof(manifest_entry_t));
+    }
+    for (uint32_t e = 0; ok && e < m->count; e++) {
+        ok = m->entries[e].block < TOTAL_BLOCKS;
+    }
+    fclose(f);
+    if (!ok) {
+        free_manifest(m);
+        return NULL;
+    }
+    return m;
+}
+
+static bool write_manifest(FILE *f, void *arg) {
+    const checksum_manifest_t *m = arg;
+    uint32_t version = MANIFEST_VERSION;
+    uint32_t sum = crc32c(m->entries, m->count * sizeof(manifest_entry_t));
+    return fwrite(MANIFEST_MAGIC, 1, 4, f) == 4 &&
+           fwrite(&version, sizeof(version), 1, f) == 1 &&
+           fwrite(&m->count, sizeof(m->count), 1, f) == 1 &&
+           fwrite(m->entries, sizeof(manifest_entry_t), m->count, f) == m->count &&
+           fwrite(&sum, sizeof(sum), 1, f) == 1;
+}
+
+// Write the checksums of the current image's metadata, replacing the file
+// atomically
+bool save_manifest(const char *path) {
+    bool indirect[TOTAL_BLOCKS] = {false};
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        for (int p = PTR_SINGLE; p < PTR_COUNT; p++) {
+            mark_indirect_blocks(ctx->inode_soa.ptr[p][i], p, indirect);
+        }
+    }
+    manifest_entry_t entries[TOTAL_BLOCKS];
+    uint32_t count = 0;
+    for (uint32_t b = 0; b < TOTAL_BLOCKS; b++) {
+        if (b < DATA_BLOCK_START_NUM || indirect[b]) {
+            entries[count++] = (manifest_entry_t){ b, crc32c(get_block(b), BLOCK_SIZE) };
+        }
+    }
+    checksum_manifest_t m = { entries, count };
+    return write_file_atomic(path, write_manifest, &m);
+}
+
+/*
+ * Worker pool
+ *
+ * run_workers() splits the items [0, count) of a job into contiguous
+ * ranges of whole grains, one per worker, and runs each range on its own
+ * thread with the caller's context. There are never more workers than
+ * grains, ranges that come out empty are skipped, and the calling thread
+ * runs the first range and any range whose thread could not be started.
+ */
+typedef void (*range_worker_t)(void *arg, int first, int last);
+
+typedef struct {
+    vsfsck_t *ctx;
+    range_worker_t fn;
+    void *arg;
+    int first, last;
+} worker_range_t;
+
+static void *run_worker_range(void *arg) {
+    worker_range_t *r = arg;
+    ctx = r->ctx;
+    r->fn(r->arg, r->first, r->last);
+    return NULL;
+}
+
+// Run fn over the items [0, count) on up to check_jobs threads, splitting
+// only between multiples of grain. Returns the number of workers used.
+int run_workers(int count, int grain, range_worker_t fn, void *arg) {
+    int grains = (count + grain - 1) / grain;
+    int jobs = ctx->check_jobs > 0 ? ctx->check_jobs : 1;
+    if (jobs > grains) {
+        jobs = grains;
+    }
+    if (jobs == 0) {
+        return 0;
+    }
+    int per_job = (grains + jobs - 1) / jobs * grain;
+    worker_range_t ranges[jobs];
+    pthread_t threads[jobs];
+    bool threaded[jobs];
+    for (int t = 0; t < jobs; t++) {
+        int first = t * per_job, last = first + per_job;
+        ranges[t] = (worker_range_t){ ctx, fn, arg, first < count ? first : count, last < count ? last : count };
+        threaded[t] = t > 0 && ranges[t].first < ranges[t].last &&
+                      pthread_create(&threads[t], NULL, run_worker_range, &ranges[t]) == 0;
+    }
+    for (int t = 0; t < jobs; t++) {
+        if (threaded[t]) {
+            pthread_join(threads[t], NULL);
+        } else if (ranges[t].first < ranges[t].last) {
+            run_worker_range(&ranges[t]);
+        }
+    }
+    return jobs;
+}
+
+/*
+ * On-disk checksum table
+ *
+ * An opt-in format extension (--enable-checksums) keeps checksums inside
+ * the image: a csum_table_t at the start of the superblock's reserved
+ * area, holding a CRC32C of the superblock fields, of both bitmaps, of
+ * every inode table block and of every indirect block (with its owner),
+ * and a CRC32C of each inode in the first bytes of the inode's own
+ * reserved area. Unused all-zero inodes get no checksum and count as
+ * matching, so empty inode table blocks stay empty. The table is stamped
+ * only after a run that ends with a consistent image, and carries a
+ * generation counting those stamps.
+ *
+ * Before the structural checks the table is verified (split over
+ * check_jobs threads). An inode whose record and indirect blocks still
+ * match is unchanged since a generation known to be clean, so the bad
+ * block and inode sanity checks skip it, as does the inode bitmap check
+ * when the bitmap block matches too. The cross-inode checks (data bitmap,
+ * duplicates, directory tree) always run in full. A mismatch is reported
+ * as a warning: it means the block changed since the stamp, which the
+ * structural checks then judge.
+ */
+#define CSUM_TABLE_MAGIC 0x4D555343  // "CSUM"
+#define CSUM_TABLE_VERSION 1
+#define INODE_CSUM_OFFSET offsetof(inode_t, reserved)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    uint32_t table_crc;                        // CRC32C of the table with this field zero
+    uint32_t block_crc[DATA_BLOCK_START_NUM];  // Superblock fields, bitmaps, inode table blocks
+    uint32_t tree_crc[DATA_BLOCKS_COUNT];      // Indirect blocks
+    uint16_t tree_owner[DATA_BLOCKS_COUNT];    // Owner + 1 of each indirect block, 0 = not indirect
+} csum_table_t;
+
+_Static_assert(sizeof(csum_table_t) <= sizeof(((superblock_t *)0)->reserved),
+               "checksum table must fit in the superblock reserved area");
+
+// CRC32C of an inode record with its checksum field taken as zero
+static uint32_t inode_crc(const inode_t *inode) {
+    inode_t copy = *inode;
+    memset((uint8_t *)&copy + INODE_CSUM_OFFSET, 0, sizeof(uint32_t));
+    return crc32c(&copy, sizeof(copy));
+}
+
+// Whether an inode record is all zero apart from its checksum field
+static bool inode_is_blank(const inode_t *inode) {
+    static const inode_t zero_inode;
+    return memcmp(inode, &zero_inode, INODE_CSUM_OFFSET) == 0 &&
+           memcmp((const uint8_t *)inode + INODE_CSUM_OFFSET + sizeof(uint32_t),
+                  (const uint8_t *)&zero_inode + INODE_CSUM_OFFSET + sizeof(uint32_t),
+                  sizeof(inode_t) - INODE_CSUM_OFFSET - sizeof(uint32_t)) == 0;
+}
+
+static uint32_t stored_inode_crc(const inode_t *inode) {
+    uint32_t crc;
+    memcpy(&crc, (const uint8_t *)inode + INODE_CSUM_OFFSET, sizeof(crc));
+    return crc;
+}
+
+static uint32_t csum_block_crc(int blk) {
+    if (blk == SUPERBLOCK_NUM) {
+        return crc32c(get_block(blk), offsetof(superblock_t, reserved));
+    }
+    return crc32c(get_block(blk), BLOCK_SIZE);
+}
+
+static uint32_t csum_table_crc(csum_table_t *table) {
+    uint32_t saved = table->table_crc;
+    table->table_crc = 0;
+    uint32_t crc = crc32c(table, sizeof(*table));
+    table->table_crc = saved;
+    return crc;
+}
+
+static void mark_indirect_owner(uint32_t blk, int depth, int ino, uint16_t *owner) {
+    if (blk < DATA_BLOCK_START_NUM || blk >= TOTAL_BLOCKS || depth == 0 ||
+        owner[blk - DATA_BLOCK_START_NUM]) {
+        return;
+    }
+    owner[blk - DATA_BLOCK_START_NUM] = (uint16_t)(ino + 1);
+    uint32_t *entries = (uint32_t *)get_block(blk);
+    int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
+    for (int j = 0; j < entries_per_block; j++) {
+        if (entries[j] != 0) {
+            mark_indirect_owner(entries[j], depth - 1, ino, owner);
+        }
+    }
+}
+
+// Write the checksum table and the per-inode checksums for the current
+// image, starting the next clean generation. The caller commits the image.
+void stamp_checksum_table(void) {
+    csum_table_t table;
+    memset(&table, 0, sizeof(table));
+    table.magic = CSUM_TABLE_MAGIC;
+    table.version = CSUM_TABLE_VERSION;
+    table.generation = ctx->csum.enabled ? ctx->csum.generation + 1 : 1;
+    
+    for (int i = 0; i < INODE_COUNT; i++) {
+        uint32_t crc = inode_is_blank(&ctx->inode_table[i]) ? 0 : inode_crc(&ctx->inode_table[i]);
+        memcpy((uint8_t *)&ctx->inode_table[i] + INODE_CSUM_OFFSET, &crc, sizeof(crc));
+    }
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        for (int p = PTR_SINGLE; p < PTR_COUNT; p++) {
+            mark_indirect_owner(ctx->inode_soa.ptr[p][i], p, i, table.tree_owner);
+        }
+    }
+    for (int b = 0; b < DATA_BLOCKS_COUNT; b++) {
+        if (table.tree_owner[b]) {
+            table.tree_crc[b] = crc32c(get_block(b + DATA_BLOCK_START_NUM), BLOCK_SIZE);
+        }
+    }
+    for (int b = 0; b < DATA_BLOCK_START_NUM; b++) {
+        table.block_crc[b] = csum_block_crc(b);
+    }
+    table.table_crc = csum_table_crc(&table);
+    memcpy(ctx->superblock->reserved, &table, sizeof(table));
+    
+    ctx->csum.enabled = true;
+    ctx->csum.generation = table.generation;
+    ctx->csum.verified = false;
+}
+
+// Verify the checksums of inodes [first, last), which cover whole words of
+// the changed mask so the workers never share one
+static void csum_worker(void *arg, int first, int last) {
+    uint64_t *changed = arg;
+    for (int i = first; i < last; i++) {
+        int blk = INODE_TABLE_START_BLOCK_NUM + (int)((size_t)i * sizeof(inode_t) / BLOCK_SIZE);
+        int end_blk = INODE_TABLE_START_BLOCK_NUM + (int)(((size_t)i + 1) * sizeof(inode_t) - 1) / BLOCK_SIZE;
+        // Inodes entirely inside a matching table block need no check of
+        // their own
+        if (ctx->csum.block_ok[blk] && ctx->csum.block_ok[end_blk]) {
+            continue;
+        }
+        const inode_t *inode = &ctx->inode_table[i];
+        uint32_t crc = stored_inode_crc(inode);
+        if (crc == 0 && inode_is_blank(inode)) {
+            continue;
+        }
+        if (inode_crc(inode) != crc) {
+            changed[i / 64] |= UINT64_C(1) << (i % 64);
+        }
+    }
+}
+
+// Verify the checksum table against the image and work out which inodes
+// still need deep checks
+void verify_checksum_table(void) {
+    csum_state_t *cs = &ctx->csum;
+    csum_table_t table;
+    memcpy(&table, ctx->superblock->reserved, sizeof(table));
+    memset(cs, 0, sizeof(*cs));
+    cs->verified = true;
+    if (table.magic != CSUM_TABLE_MAGIC) {
+        return;
+    }
+    if (table.version != CSUM_TABLE_VERSION || table.table_crc != csum_table_crc(&table)) {
+        cs->corrupt = true;
+        return;
+    }
+    // The table CRC catches damage, not a crafted table; owners index the
+    // inode masks
+    for (int b = 0; b < DATA_BLOCKS_COUNT; b++) {
+        if (table.tree_owner[b] > INODE_COUNT) {
+            cs->corrupt = true;
+            return;
+        }
+    }
+    cs->enabled = true;
+    cs->generation = table.generation;
+    
+    for (int b = 0; b < DATA_BLOCK_START_NUM; b++) {
+        cs->block_ok[b] = csum_block_crc(b) == table.block_crc[b];
+    }
+    for (int b = 0; b < DATA_BLOCKS_COUNT; b++) {
+        cs->tree_ok[b] = !table.tree_owner[b] ||
+                         crc32c(get_block(b + DATA_BLOCK_START_NUM), BLOCK_SIZE) == table.tree_crc[b];
+    }
+    
+    run_workers(INODE_COUNT, 64, csum_worker, cs->changed);
+    
+    // Deep checks are needed for changed inodes and owners of changed
+    // indirect blocks
+    memcpy(cs->dirty, cs->changed, sizeof(cs->dirty));
+    for (int b = 0; b < DATA_BLOCKS_COUNT; b++) {
+        if (!cs->tree_ok[b]) {
+            int owner = table.tree_owner[b] - 1;
+            cs->dirty[owner / 64] |= UINT64_C(1) << (owner % 64);
+        }
+    }
+}
+
+// Scope for a phase from the checksum table: the inodes that changed since
+// the clean generation, or NULL when the phase has to see every inode
+static uint64_t *checksum_scope(check_id_t check) {
+    if (!ctx->csum.verified) {
+        verify_checksum_table();
+    }
+    if (!ctx->csum.enabled) {
+        return NULL;
+    }
+    if (check == CHECK_BAD_BLOCKS || check == CHECK_INODE_SANITY ||
+        (check == CHECK_INODE_BITMAP && ctx->csum.block_ok[INODE_BITMAP_BLOCK_NUM])) {
+        return ctx->csum.dirty;
+    }
+    return NULL;
+}
+
+// Report what the checksum table verification found
+static void report_checksum_table(bool fix) {
+    csum_state_t *cs = &ctx->csum;
+    if (!cs->verified) {
+        verify_checksum_table();
+    }
+    if (cs->corrupt) {
+        finding_t f = new_finding(CHECK_CHECKSUMS, FINDING_CHECKSUM_MISMATCH, -1, SUPERBLOCK_NUM, false);
+        f.severity = SEVERITY_WARNING;
+        report_finding(&f, "The checksum table in the superblock is corrupt; all inodes were checked");
+        return;
+    }
+    if (!cs->enabled) {
+        return;
+    }
+    (void)fix;
+    
+    csum_table_t table;
+    memcpy(&table, ctx->superblock->reserved, sizeof(table));
+    int blocks = 0, blocks_ok = 0;
+    for (int b = 0; b < DATA_BLOCK_START_NUM; b++) {
+        blocks++;
+        if (cs->block_ok[b]) {
+            blocks_ok++;
+            continue;
+        }
+        finding_t f = new_finding(CHECK_CHECKSUMS, FINDING_CHECKSUM_MISMATCH, -1, b, false);
+        f.severity = SEVERITY_WARNING;
+        f.aux = table.block_crc[b];
+        report_finding(&f, "Block %d (%s) changed since clean generation %llu",
+                       b, metadata_block_kind(b), (unsigned long long)cs->generation);
+    }
+    for (int b = 0; b < DATA_BLOCKS_COUNT; b++) {
+        if (!table.tree_owner[b]) {
+            continue;
+        }
+        blocks++;
+        if (cs->tree_ok[b]) {
+            blocks_ok++;
+            continue;
+        }
+        finding_t f = new_finding(CHECK_CHECKSUMS, FINDING_CHECKSUM_MISMATCH, table.tree_owner[b] - 1,
+                                  b + DATA_BLOCK_START_NUM, false);
+        f.severity = SEVERITY_WARNING;
+        f.aux = table.tree_crc[b];
+        report_finding(&f, "Indirect block %d of inode %d changed since clean generation %llu",
+                       b + DATA_BLOCK_START_NUM, table.tree_owner[b] - 1, (unsigned long long)cs->generation);
+    }
+    for (int i = next_set_bit(cs->changed, NULL, INODE_COUNT, -1); i >= 0;
+         i = next_set_bit(cs->changed, NULL, INODE_COUNT, i)) {
+        finding_t f = new_finding(CHECK_CHECKSUMS, FINDING_CHECKSUM_MISMATCH, i, 0, false);
+        f.severity = SEVERITY_WARNING;
+        f.aux = stored_inode_crc(&ctx->inode_table[i]);
+        report_finding(&f, "Inode %d changed since clean generation %llu",
+                       i, (unsigned long long)cs->generation);
+    }
+    
+    int dirty = 0;
+    for (int w = 0; w < INODE_MASK_WORDS; w++) {
+        dirty += __builtin_popcountll(cs->dirty[w]);
+    }
+    report_info("Checksum table (clean generation %llu): %d of %d metadata blocks unchanged, "
+                "%d inodes needed deep checks\n", (unsigned long long)cs->generation, blocks_ok, blocks, dirty);
+}
+
+// Compare the metadata blocks against the manifest and report on the
+// checksum table; a no-op without either
+bool verify_checksums(bool fix) {
+    const checksum_manifest_t *m = ctx->manifest;
+    if (!ctx->csum.verified) {
+        verify_checksum_table();
+    }
+    if (!m && !ctx->csum.enabled && !ctx->csum.corrupt) {
+        return true;
+    }
+    report_info("\n=== Metadata Checksum Verification ===\n");
+    report_checksum_table(fix);
+    if (!m) {
+        return true;
+    }
+    
+    bool isValid = true;
+    for (uint32_t e = 0; e < m->count; e++) {
+        uint32_t blk = m->entries[e].block;
+        uint32_t crc = crc32c(get_block(blk), BLOCK_SIZE);
+        if (crc != m->entries[e].crc) {
+            finding_t f = new_finding(CHECK_CHECKSUMS, FINDING_CHECKSUM_MISMATCH, -1, blk, false);
+            f.aux = m->entries[e].crc;
+            if (fix) {
+                f.action = ACTION_UNFIXABLE;
+            }
+            report_finding(&f, "Block %u (%s) has CRC32C 0x%08X but the manifest records 0x%08X",
+                           blk, metadata_block_kind(blk), crc, m->entries[e].crc);
+            isValid = false;
+        }
+    }
+    if (isValid) {
+        report_info("%u metadata blocks match the manifest\n", m->count);
+    }
+    return isValid;
+}
+
+/*
+ * Data hashing
+ *
+ * --hash-data computes a digest of every live inode's data for backup
+ * validation. The data blocks are hashed with XXH64 in block number order,
+ * split into contiguous ranges over check_jobs threads, so each thread
+ * streams through the image front to back. A file's digest is then the
+ * XXH64 of its block digests taken in logical order; the last block only
+ * contributes the bytes below the file size. A hole hashes as the same
+ * range of zero bytes, so moving data across a hole changes the digest.
+ */
+#define XXH_PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 UINT64_C(0x165667B19E3779F9)
+#define XXH_PRIME64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 UINT64_C(0x27D4EB2F165667C5)
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl64(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 of a byte range
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+    
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh64_round(v1, xxh_read64(p));
+            v2 = xxh64_round(v2, xxh_read64(p + 8));
+            v3 = xxh64_round(v3, xxh_read64(p + 16));
+            v4 = xxh64_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += (uint64_t)len;
+    
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+    }
+    
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef struct {
+    uint32_t blk;
+    uint32_t logical;     // Block index within the file
+    uint32_t len;         // Bytes of the block that belong to the file
+    uint64_t digest;
+} hash_extent_t;
+
+typedef struct {
+    hash_extent_t *extents;
+    int len, cap;
+    uint32_t size;        // Size of the current file
+    bool out_of_memory;
+} hash_plan_t;
+
+// Bytes of logical block logical that lie below the file size
+static uint32_t file_block_bytes(uint32_t size, uint32_t logical) {
+    uint64_t offset = (uint64_t)logical * BLOCK_SIZE;
+    if (offset >= size) {
+        return 0;
+    }
+    return size - offset < BLOCK_SIZE ? (uint32_t)(size - offset) : BLOCK_SIZE;
+}
+
+static void plan_hash_block(uint32_t blk, uint32_t logical, void *arg) {
+    hash_plan_t *plan = arg;
+    uint32_t len = file_block_bytes(plan->size, logical);
+    if (len == 0 || plan->out_of_memory) {
+        return;
+    }
+    if (plan->len == plan->cap &&
+        !grow_array((void **)&plan->extents, &plan->cap, sizeof(hash_extent_t))) {
+        plan->out_of_memory = true;
+        return;
+    }
+    plan->extents[plan->len++] = (hash_extent_t){ blk, logical, len, 0 };
+}
+
+static int compare_extent_blocks(const void *a, const void *b) {
+    const hash_extent_t *x = *(hash_extent_t *const *)a;
+    const hash_extent_t *y = *(hash_extent_t *const *)b;
+    return (x->blk > y->blk) - (x->blk < y->blk);
+}
+
+// Hash extents [first, last) of an array sorted by block number
+static void hash_worker(void *arg, int first, int last) {
+    hash_extent_t *const *order = arg;
+    for (int e = first; e < last; e++) {
+        hash_extent_t *x = order[e];
+        x->digest = xxh64(get_block(x->blk), x->len, 0);
+    }
+}
+
+// Hash the data of every live inode and print one digest per inode
+bool report_data_hashes(void) {
+    hash_plan_t plan = {0};
+    int *first = malloc((INODE_COUNT + 1) * sizeof(int));
+    if (!first) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    // Lay out each file's extents in logical order
+    for (int i = 0; i < INODE_COUNT; i++) {
+        first[i] = plan.len;
+        if (inode_is_live(i)) {
+            plan.size = ctx->inode_soa.size[i];
+            for_each_file_block(i, plan_hash_block, &plan);
+        }
+    }
+    first[INODE_COUNT] = plan.len;
+    
+    hash_extent_t **order = malloc((plan.len ? plan.len : 1) * sizeof(hash_extent_t *));
+    if (plan.out_of_memory || !order) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(plan.extents);
+        free(first);
+        free(order);
+        return false;
+    }
+    for (int e = 0; e < plan.len; e++) {
+        order[e] = &plan.extents[e];
+    }
+    qsort(order, plan.len, sizeof(hash_extent_t *), compare_extent_blocks);
+    
+    // Contiguous block ranges per thread
+    int jobs = run_workers(plan.len, 1, hash_worker, order);
+    
+    // Reassemble per-file digests in logical order
+    FILE *out = ctx->out;
+    if (out && ctx->output_format == OUTPUT_TEXT) {
+        fprintf(out, "\n=== Data Hashes (XXH64) ===\n");
+    }
+    static const uint8_t zero_block[BLOCK_SIZE];
+    uint64_t zero_digest = xxh64(zero_block, BLOCK_SIZE, 0);
+    uint64_t total_bytes = 0;
+    int files = 0;
+    uint8_t *digests = NULL;
+    size_t digests_cap = 0;
+    bool ok = true;
+    for (int i = next_live_inode(-1); i >= 0 && out; i = next_live_inode(i)) {
+        int count = first[i + 1] - first[i];
+        uint32_t size = ctx->inode_soa.size[i];
+        size_t logical_blocks = ((size_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (logical_blocks > digests_cap) {
+            uint8_t *grown = realloc(digests, logical_blocks * 8);
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            digests = grown;
+            digests_cap = logical_blocks;
+        }
+        // Extents come in logical order; the blocks between them are holes
+        const hash_extent_t *x = &plan.extents[first[i]], *end = x + count;
+        for (size_t l = 0; l < logical_blocks; l++) {
+            uint64_t block_digest;
+            if (x < end && x->logical == l) {
+                block_digest = x->digest;
+                x++;
+            } else {
+                uint32_t len = file_block_bytes(size, (uint32_t)l);
+                block_digest = len == BLOCK_SIZE ? zero_digest : xxh64(zero_block, len, 0);
+            }
+            for (int k = 0; k < 8; k++) {
+                digests[l * 8 + k] = (uint8_t)(block_digest >> (8 * k));
+            }
+        }
+        uint64_t digest = xxh64(digests ? digests : zero_block, logical_blocks * 8, 0);
+        total_bytes += size;
+        files++;
+        if (ctx->output_format == OUTPUT_JSON) {
+            fprintf(out, "{\"type\":\"file_hash\",\"inode\":%d,\"mode\":%u,\"blocks\":%d,\"bytes\":%llu,"
+                    "\"xxh64\":\"%016llx\"}\n", i, ctx->inode_soa.mode[i], count,
+                    (unsigned long long)size, (unsigned long long)digest);
+        } else if (ctx->output_format == OUTPUT_TEXT) {
+            fprintf(out, "Inode %d: %016llx (%d blocks, %llu bytes%s)\n", i, (unsigned long long)digest,
+                    count, (unsigned long long)size, inode_is_dir(i) ? ", directory" : "");
+        }
+    }
+    if (out && ctx->output_format == OUTPUT_TEXT) {
+        fprintf(out, "Hashed %llu bytes in %d files using %d threads\n",
+                (unsigned long long)total_bytes, files, jobs);
+    }
+    if (!ok) {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+    
+    free(digests);
+    free(plan.extents);
+    free(first);
+    free(order);
+    return ok;
+}
+
+/*
+ * Content duplicate report
+ *
+ * --dedup-report looks for distinct data blocks that hold the same bytes,
+ * which is unrelated to the pointer duplicates of check_duplicate_blocks().
+ * Every data block reached by a live inode is fingerprinted with XXH64 in
+ * parallel, then the blocks are bucketed by the top fingerprint bits into
+ * DEDUP_SHARDS shards. Each shard is an open-addressing table owned by one
+ * thread, so no locking is needed; a fingerprint hit is confirmed with
+ * memcmp before two blocks are grouped. All-zero blocks are counted
+ * separately, since they are better served by holes than by sharing.
+ */
+#define DEDUP_SHARDS 64
+
+typedef struct {
+    int n;
+    uint32_t *blk;        // Candidate blocks
+    uint64_t *fp;         // Their fingerprints
+    int *rep;             // First candidate with the same contents
+    int *shard_start;     // Candidates of shard s are order[shard_start[s] .. shard_start[s + 1])
+    int *order;
+    int *next;            // Next candidate in the same group, or -1
+    const uint8_t *image;
+} dedup_t;
+
+typedef struct {
+    int32_t *owner;
+    int ino;
+} dedup_claim_t;
+
+// Record the first inode reaching each data block
+static void claim_data_block(uint32_t blk, uint32_t logical, void *arg) {
+    (void)logical;
+    dedup_claim_t *claim = arg;
+    if (claim->owner[blk] < 0) {
+        claim->owner[blk] = claim->ino;
+    }
+}
+
+static inline int dedup_shard(uint64_t fp) {
+    return (int)(fp >> 58);  // Top six bits
+}
+
+// Fingerprint candidates [first, last)
+static void dedup_fingerprint(void *arg, int first, int last) {
+    dedup_t *d = arg;
+    for (int c = first; c < last; c++) {
+        d->fp[c] = xxh64(d->image + (size_t)d->blk[c] * BLOCK_SIZE, BLOCK_SIZE, 0);
+    }
+}
+
+// Group the candidates of shards [first, last)
+static void dedup_group(void *arg, int first, int last) {
+    dedup_t *d = arg;
+    for (int s = first; s < last; s++) {
+        int count = d->shard_start[s + 1] - d->shard_start[s];
+        if (count == 0) {
+            continue;
+        }
+        int cap = 1;
+        while (cap < 2 * count) {
+            cap <<= 1;
+        }
+        int *slots = malloc(cap * sizeof(int));
+        if (!slots) {
+            continue;  // Blocks of this shard stay ungrouped
+        }
+        for (int k = 0; k < cap; k++) {
+            slots[k] = -1;
+        }
+        for (int k = d->shard_start[s]; k < d->shard_start[s + 1]; k++) {
+            int c = d->order[k];
+            const uint8_t *data = d->image + (size_t)d->blk[c] * BLOCK_SIZE;
+            for (int h = (int)(d->fp[c] & (cap - 1));; h = (h + 1) & (cap - 1)) {
+                int other = slots[h];
+                if (other < 0) {
+                    slots[h] = c;
+                    break;
+                }
+                if (d->fp[other] == d->fp[c] &&
+                    memcmp(d->image + (size_t)d->blk[other] * BLOCK_SIZE, data, BLOCK_SIZE) == 0) {
+                    d->rep[c] = other;
+                    break;
+                }
+            }
+        }
+        free(slots);
+    }
+}
+
+// Find and print groups of data blocks with identical contents
+bool report_content_duplicates(void) {
+    int32_t owner[TOTAL_BLOCKS];
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        owner[b] = -1;
+    }
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        for_each_file_block(i, claim_data_block, &(dedup_claim_t){ owner, i });
+    }
+    
+    dedup_t d = { .image = ctx->fs_image };
+    d.blk = malloc(TOTAL_BLOCKS * sizeof(uint32_t));
+    d.fp = malloc(TOTAL_BLOCKS * sizeof(uint64_t));
+    d.rep = malloc(TOTAL_BLOCKS * sizeof(int));
+    d.order = malloc(TOTAL_BLOCKS * sizeof(int));
+    d.next = malloc(TOTAL_BLOCKS * sizeof(int));
+    d.shard_start = calloc(DEDUP_SHARDS + 1, sizeof(int));
+    if (!d.blk || !d.fp || !d.rep || !d.order || !d.next || !d.shard_start) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(d.blk);
+        free(d.fp);
+        free(d.rep);
+        free(d.order);
+        free(d.next);
+        free(d.shard_start);
+        return false;
+    }
+    
+    static const uint8_t zero_block[BLOCK_SIZE];
+    int zero_blocks = 0;
+    for (int b = DATA_BLOCK_START_NUM; b < TOTAL_BLOCKS; b++) {
+        if (owner[b] < 0) {
+            continue;
+        }
+        if (memcmp(get_block(b), zero_block, BLOCK_SIZE) == 0) {
+            zero_blocks++;
+            continue;
+        }
+        d.rep[d.n] = d.n;
+        d.blk[d.n++] = b;
+    }
+    
+    run_workers(d.n, 1, dedup_fingerprint, &d);
+    
+    // Bucket the candidates by shard
+    for (int c = 0; c < d.n; c++) {
+        d.shard_start[dedup_shard(d.fp[c]) + 1]++;
+    }
+    for (int s = 0; s < DEDUP_SHARDS; s++) {
+        d.shard_start[s + 1] += d.shard_start[s];
+    }
+    int fill[DEDUP_SHARDS];
+    memcpy(fill, d.shard_start, sizeof(fill));
+    for (int c = 0; c < d.n; c++) {
+        d.order[fill[dedup_shard(d.fp[c])]++] = c;
+    }
+    run_workers(DEDUP_SHARDS, 1, dedup_group, &d);
+    
+    // A representative always precedes its members, so one pass links each group
+    int *tail = d.order;
+    for (int c = 0; c < d.n; c++) {
+        d.next[c] = -1;
+        tail[c] = c;
+        if (d.rep[c] != c) {
+            d.next[tail[d.rep[c]]] = c;
+            tail[d.rep[c]] = c;
+        }
+    }
+    
+    FILE *out = ctx->out;
+    bool text = out && ctx->output_format == OUTPUT_TEXT;
+    bool json = out && ctx->output_format == OUTPUT_JSON;
+    if (text) {
+        fprintf(out, "\n=== Content Duplicates ===\n");
+    }
+    int groups = 0, duplicates = 0;
+    for (int c = 0; c < d.n; c++) {
+        if (d.rep[c] != c || d.next[c] < 0) {
+            continue;
+        }
+        groups++;
+        if (text) {
+            fprintf(out, "Identical data in block %u (inode %d)", d.blk[c], owner[d.blk[c]]);
+            for (int k = d.next[c]; k >= 0; k = d.next[k]) {
+                fprintf(out, ", block %u (inode %d)", d.blk[k], owner[d.blk[k]]);
+            }
+            fputc('\n', out);
+        } else if (json) {
+            fprintf(out, "{\"type\":\"dedup_group\",\"blocks\":[%u", d.blk[c]);
+            for (int k = d.next[c]; k >= 0; k = d.next[k]) {
+                fprintf(out, ",%u", d.blk[k]);
+            }
+            fprintf(out, "],\"inodes\":[%d", owner[d.blk[c]]);
+            for (int k = d.next[c]; k >= 0; k = d.next[k]) {
+                fprintf(out, ",%d", owner[d.blk[k]]);
+            }
+            fprintf(out, "]}\n");
+        }
+        for (int k = d.next[c]; k >= 0; k = d.next[k]) {
+            duplicates++;
+        }
+    }
+    
+    if (text) {
+        fprintf(out, "%d data blocks scanned, %d duplicate blocks in %d groups; "
+                "sharing them would save %llu bytes\n", d.n + zero_blocks, duplicates, groups,
+                (unsigned long long)duplicates * BLOCK_SIZE);
+        if (zero_blocks > 0) {
+            fprintf(out, "%d all-zero data blocks could be holes\n", zero_blocks);
+        }
+    } else if (json) {
+        fprintf(out, "{\"type\":\"dedup_summary\",\"blocks\":%d,\"duplicates\":%d,\"groups\":%d,"
+                "\"bytes_saved\":%llu,\"zero_blocks\":%d}\n", d.n + zero_blocks, duplicates, groups,
+                (unsigned long long)duplicates * BLOCK_SIZE, zero_blocks);
+    }
+    
+    free(d.blk);
+    free(d.fp);
+    free(d.rep);
+    free(d.order);
+    free(d.next);
+    free(d.shard_start);
+    return true;
+}
+
+/*
+ * Image diff
+ *
+ * --diff=NEWER reports how the metadata changed from the opened image to
+ * another snapshot of it. Blocks are compared first and everything below
+ * works only on the blocks that differ: bitmaps are XORed a word at a
+ * time, only inodes overlapping a changed inode table block are compared
+ * field by field, and indirect trees are descended only through changed
+ * blocks. Data blocks are reported as changed without their contents.
+ */
+typedef struct {
+    const uint8_t *old_image, *new_image;
+    bool changed[TOTAL_BLOCKS];
+    int changes;
+    FILE *out;
+    output_format_t format;
+} image_diff_t;
+
+static const struct {
+    const char *name;
+    size_t offset;
+} superblock_fields[] = {
+    { "block_size", offsetof(superblock_t, block_size) },
+    { "total_blocks", offsetof(superblock_t, total_blocks) },
+    { "inode_bitmap_block", offsetof(superblock_t, inode_bitmap_block) },
+    { "data_bitmap_block", offsetof(superblock_t, data_bitmap_block) },
+    { "inode_table_start", offsetof(superblock_t, inode_table_start) },
+    { "first_data_block", offsetof(superblock_t, first_data_block) },
+    { "inode_size", offsetof(superblock_t, inode_size) },
+    { "inode_count", offsetof(superblock_t, inode_count) },
+};
+
+static const struct {
+    const char *name;
+    size_t offset;
+} inode_fields[] = {
+    { "mode", offsetof(inode_t, mode) },
+    { "uid", offsetof(inode_t, uid) },
+    { "gid", offsetof(inode_t, gid) },
+    { "size", offsetof(inode_t, size) },
+    { "atime", offsetof(inode_t, atime) },
+    { "ctime", offsetof(inode_t, ctime) },
+    { "mtime", offsetof(inode_t, mtime) },
+    { "dtime", offsetof(inode_t, dtime) },
+    { "links_count", offsetof(inode_t, links_count) },
+    { "blocks_count", offsetof(inode_t, blocks_count) },
+    { "direct_block", offsetof(inode_t, direct_block) },
+    { "single_indirect", offsetof(inode_t, single_indirect) },
+    { "double_indirect", offsetof(inode_t, double_indirect) },
+    { "triple_indirect", offsetof(inode_t, triple_indirect) },
+};
+
+static inline uint32_t read_u32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Report a changed value; inode is -1 for superblock fields
+static void diff_field(image_diff_t *d, const char *area, int inode, const char *field,
+                       uint32_t old_value, uint32_t new_value) {
+    d->changes++;
+    if (d->format == OUTPUT_JSON) {
+        fprintf(d->out, "{\"type\":\"diff\",\"area\":\"%s\"", area);
+        if (inode >= 0) {
+            fprintf(d->out, ",\"inode\":%d", inode);
+        }
+        fprintf(d->out, ",\"field\":\"%s\",\"old\":%u,\"new\":%u}\n", field, old_value, new_value);
+    } else if (inode >= 0) {
+        fprintf(d->out, "Inode %d: %s %u -> %u\n", inode, field, old_value, new_value);
+    } else {
+        fprintf(d->out, "Superblock: %s %u -> %u\n", field, old_value, new_value);
+    }
+}
+
+// XOR two bitmaps a word at a time and report each flipped bit
+static void diff_bitmap(image_diff_t *d, int blk, int bits, int base, const char *area, const char *unit) {
+    const uint8_t *old_map = d->old_image + (size_t)blk * BLOCK_SIZE;
+    const uint8_t *new_map = d->new_image + (size_t)blk * BLOCK_SIZE;
+    for (int w = 0; w * 64 < bits; w++) {
+        uint64_t old_word = load_bitmap_word(old_map, w);
+        uint64_t new_word = load_bitmap_word(new_map, w);
+        uint64_t flipped = old_word ^ new_word;
+        if (bits - w * 64 < 64) {
+            flipped &= (UINT64_C(1) << (bits - w * 64)) - 1;
+        }
+        for (; flipped; flipped &= flipped - 1) {
+            int n = w * 64 + __builtin_ctzll(flipped);
+            bool now_set = (new_word >> (n % 64)) & 1;
+            d->changes++;
+            if (d->format == OUTPUT_JSON) {
+                fprintf(d->out, "{\"type\":\"diff\",\"area\":\"%s\",\"%s\":%d,\"old\":%d,\"new\":%d}\n",
+                        area, unit, base + n, !now_set, now_set);
+            } else {
+                fprintf(d->out, "%s: %s %d %s\n", strcmp(area, "inode_bitmap") == 0 ? "Inode bitmap" : "Data bitmap",
+                        unit, base + n, now_set ? "allocated" : "freed");
+            }
+        }
+    }
+}
+
+// Compare an indirect block present at the same place in both trees
+static void diff_tree(image_diff_t *d, int inode, uint32_t blk, int depth) {
+    if (blk < DATA_BLOCK_START_NUM || blk >= TOTAL_BLOCKS || !d->changed[blk]) {
+        return;
+    }
+    const uint8_t *old_block = d->old_image + (size_t)blk * BLOCK_SIZE;
+    const uint8_t *new_block = d->new_image + (size_t)blk * BLOCK_SIZE;
+    for (int j = 0; j < (int)(BLOCK_SIZE / sizeof(uint32_t)); j++) {
+        uint32_t old_entry = read_u32(old_block + j * 4);
+        uint32_t new_entry = read_u32(new_block + j * 4);
+        if (old_entry != new_entry) {
+            d->changes++;
+            if (d->format == OUTPUT_JSON) {
+                fprintf(d->out, "{\"type\":\"diff\",\"area\":\"tree\",\"inode\":%d,\"block\":%u,\"depth\":%d,"
+                        "\"slot\":%d,\"old\":%u,\"new\":%u}\n", inode, blk, depth, j, old_entry, new_entry);
+            } else {
+                fprintf(d->out, "Inode %d: level %d indirect block %u entry %d: %u -> %u\n",
+                        inode, depth, blk, j, old_entry, new_entry);
+            }
+        } else if (old_entry != 0 && depth > 1) {
+            diff_tree(d, inode, old_entry, depth - 1);
+        }
+    }
+}
+
+// Print the metadata changes from the loaded image to new_image
+bool diff_images(const uint8_t *new_image) {
+    image_diff_t d = { ctx->fs_image, new_image, { false }, 0, ctx->out, ctx->output_format };
+    int changed_blocks = 0;
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        d.changed[b] = memcmp(d.old_image + (size_t)b * BLOCK_SIZE, new_image + (size_t)b * BLOCK_SIZE,
+                              BLOCK_SIZE) != 0;
+        changed_blocks += d.changed[b];
+    }
+    if (d.format == OUTPUT_TEXT) {
+        fprintf(d.out, "=== Image Diff ===\n");
+    }
+    
+    if (d.changed[SUPERBLOCK_NUM]) {
+        const uint8_t *old_sb = d.old_image, *new_sb = new_image;
+        uint16_t old_magic, new_magic;
+        memcpy(&old_magic, old_sb + offsetof(superblock_t, magic), sizeof(old_magic));
+        memcpy(&new_magic, new_sb + offsetof(superblock_t, magic), sizeof(new_magic));
+        if (old_magic != new_magic) {
+            diff_field(&d, "superblock", -1, "magic", old_magic, new_magic);
+        }
+        for (size_t f = 0; f < sizeof(superblock_fields) / sizeof(superblock_fields[0]); f++) {
+            uint32_t old_value = read_u32(old_sb + superblock_fields[f].offset);
+            uint32_t new_value = read_u32(new_sb + superblock_fields[f].offset);
+            if (old_value != new_value) {
+                diff_field(&d, "superblock", -1, superblock_fields[f].name, old_value, new_value);
+            }
+        }
+        size_t reserved = offsetof(superblock_t, reserved);
+        if (memcmp(old_sb + reserved, new_sb + reserved, sizeof(((superblock_t *)0)->reserved)) != 0) {
+            d.changes++;
+            if (d.format == OUTPUT_JSON) {
+                fprintf(d.out, "{\"type\":\"diff\",\"area\":\"superblock\",\"field\":\"reserved\"}\n");
+            } else {
+                fprintf(d.out, "Superblock: reserved area (checksum table) changed\n");
+            }
+        }
+    }
+    
+    if (d.changed[INODE_BITMAP_BLOCK_NUM]) {
+        diff_bitmap(&d, INODE_BITMAP_BLOCK_NUM, INODE_COUNT, 0, "inode_bitmap", "inode");
+    }
+    if (d.changed[DATA_BITMAP_BLOCK_NUM]) {
+        diff_bitmap(&d, DATA_BITMAP_BLOCK_NUM, DATA_BLOCKS_COUNT, DATA_BLOCK_START_NUM, "data_bitmap", "block");
+    }
+    
+    // Inodes overlapping a changed table block, each compared once
+    int next_inode = 0;
+    for (int b = INODE_TABLE_START_BLOCK_NUM; b < INODE_TABLE_START_BLOCK_NUM + INODE_TABLE_BLOCKS; b++) {
+        if (!d.changed[b]) {
+            continue;
+        }
+        int first, last;
+        inode_table_block_range(b, &first, &last);
+        for (int i = first > next_inode ? first : next_inode; i <= last; i++) {
+            size_t offset = (size_t)INODE_TABLE_START_BLOCK_NUM * BLOCK_SIZE + (size_t)i * sizeof(inode_t);
+            const uint8_t *old_inode = d.old_image + offset, *new_inode = new_image + offset;
+            if (memcmp(old_inode, new_inode, sizeof(inode_t)) == 0) {
+                continue;
+            }
+            for (size_t f = 0; f < sizeof(inode_fields) / sizeof(inode_fields[0]); f++) {
+                uint32_t old_value = read_u32(old_inode + inode_fields[f].offset);
+                uint32_t new_value = read_u32(new_inode + inode_fields[f].offset);
+                if (old_value != new_value) {
+                    diff_field(&d, "inode", i, inode_fields[f].name, old_value, new_value);
+                }
+            }
+            uint32_t old_crc = read_u32(old_inode + offsetof(inode_t, reserved));
+            uint32_t new_crc = read_u32(new_inode + offsetof(inode_t, reserved));
+            if (old_crc != new_crc) {
+                diff_field(&d, "inode", i, "checksum", old_crc, new_crc);
+            }
+        }
+        next_inode = last + 1;
+    }
+    
+    // Indirect trees of live inodes whose root pointer did not move
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        size_t offset = (size_t)INODE_TABLE_START_BLOCK_NUM * BLOCK_SIZE + (size_t)i * sizeof(inode_t);
+        for (int p = PTR_SINGLE; p < PTR_COUNT; p++) {
+            size_t field = offset + offsetof(inode_t, direct_block) + p * sizeof(uint32_t);
+            uint32_t old_root = read_u32(d.old_image + field);
+            if (old_root != 0 && old_root == read_u32(new_image + field)) {
+                diff_tree(&d, i, old_root, p);
+            }
+        }
+    }
+    
+    // Changed data blocks, attributed to the inode reaching them in the old image
+    int32_t owner[TOTAL_BLOCKS];
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        owner[b] = -1;
+    }
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        for_each_file_block(i, claim_data_block, &(dedup_claim_t){ owner, i });
+    }
+    for (int b = DATA_BLOCK_START_NUM; b < TOTAL_BLOCKS; b++) {
+        if (!d.changed[b] || owner[b] < 0) {
+            continue;
+        }
+        d.changes++;
+        if (d.format == OUTPUT_JSON) {
+            fprintf(d.out, "{\"type\":\"diff\",\"area\":\"data\",\"inode\":%d,\"block\":%d}\n", owner[b], b);
+        } else {
+            fprintf(d.out, "Inode %d: data block %d changed\n", owner[b], b);
+        }
+    }
+    
+    if (d.format == OUTPUT_JSON) {
+        fprintf(d.out, "{\"type\":\"diff_summary\",\"changes\":%d,\"changed_blocks\":%d}\n",
+                d.changes, changed_blocks);
+    } else {
+        fprintf(d.out, "%d changes in %d of %d blocks\n", d.changes, changed_blocks, TOTAL_BLOCKS);
+    }
+    return d.changes == 0;
+}
+
+/*
+ * Metadata export
+ *
+ * --export-metadata=FILE writes a copy of the image that keeps only what
+ * the checkers read: the superblock, both bitmaps, the inode table, every
+ * indirect block reachable from a live inode and the data blocks of live
+ * directories. File data is left out as holes, so the export is sparse
+ * and safe to ship for reproducing a failure. The kept blocks are written
+ * in one ascending pass, seeking over the rest.
+ */
+
+// Mark the data blocks of a directory
+static void mark_directory_block(uint32_t blk, uint32_t logical, void *arg) {
+    (void)logical;
+    bool *keep = arg;
+    keep[blk] = true;
+}
+
+typedef struct {
+    const bool *keep;     // Blocks to copy
+    int written;          // Blocks copied so far
+} metadata_export_t;
+
+static bool write_metadata_export(FILE *f, void *arg) {
+    metadata_export_t *e = arg;
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        if (!e->keep[b]) {
+            continue;
+        }
+        if (fseek(f, (long)b * BLOCK_SIZE, SEEK_SET) != 0 || fwrite(get_block(b), BLOCK_SIZE, 1, f) != 1) {
+            return false;
+        }
+        e->written++;
+    }
+    // Trailing holes still count towards the image size
+    return fflush(f) == 0 && ftruncate(fileno(f), (off_t)TOTAL_BLOCKS * BLOCK_SIZE) == 0;
+}
+
+// Write the metadata-only image to path, replacing it atomically. Returns
+// the number of blocks written, or -1 on failure.
+int export_metadata(const char *path) {
+    bool keep[TOTAL_BLOCKS] = {false};
+    bool indirect[TOTAL_BLOCKS] = {false};
+    for (int b = 0; b < DATA_BLOCK_START_NUM; b++) {
+        keep[b] = true;
+    }
+    for (int i = next_live_inode(-1); i >= 0; i = next_live_inode(i)) {
+        for (int p = PTR_SINGLE; p < PTR_COUNT; p++) {
+            mark_indirect_blocks(ctx->inode_soa.ptr[p][i], p, indirect);
+        }
+        if (inode_is_dir(i)) {
+            for_each_file_block(i, mark_directory_block, keep);
+        }
+    }
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        keep[b] = keep[b] || indirect[b];
+    }
+    
+    metadata_export_t e = { keep, 0 };
+    if (!write_file_atomic(path, write_metadata_export, &e)) {
+        return -1;
+    }
+    return e.written;
+}
+
+/*
+ * Library interface
+ */
+
+// Phases in check_id_t order
+static bool (*const check_phases[CHECK_MAX])(bool) = {
+    validate_superblock, validate_data_bitmap, validate_inode_bitmap, check_duplicate_blocks,
+    check_bad_blocks, check_inode_sanity, check_directory_tree, verify_checksums
+};
+
+void vsfsck_default_options(vsfsck_options_t *opt) {
+    memset(opt, 0, sizeof(*opt));
+    opt->format = OUTPUT_TEXT;
+    opt->max_findings_per_inode = DEFAULT_MAX_FINDINGS_PER_INODE;
+    opt->jobs = 1;
+}
+
+static int64_t stdio_size(void *handle) {
+    FILE *file = handle;
+    if (fseek(file, 0, SEEK_END) != 0) {
+        return -1;
+    }
+    long size = ftell(file);
+    rewind(file);
+    return size;
+}
+
+static int stdio_read(void *handle, uint64_t offset, void *buf, size_t len) {
+    FILE *file = handle;
+    if (fseek(file, (long)offset, SEEK_SET) != 0 || fread(buf, 1, len, file) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+static int stdio_write(void *handle, uint64_t offset, const void *buf, size_t len) {
+    FILE *file = handle;
+    if (fseek(file, (long)offset, SEEK_SET) != 0 || fwrite(buf, 1, len, file) != len || fflush(file) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+vsfsck_backend_t vsfsck_stdio_backend(FILE *file) {
+    vsfsck_backend_t backend = { stdio_size, stdio_read, stdio_write, file };
+    return backend;
+}
+
+vsfsck_t *vsfsck_open(const vsfsck_backend_t *backend, const vsfsck_options_t *opt,
+                      vsfsck_status_t *status) {
+    vsfsck_options_t defaults;
+    if (!opt) {
+        vsfsck_default_options(&defaults);
+        opt = &defaults;
+    }
+    pthread_once(&time_format_once, time_format_init);
+    
+    vsfsck_status_t st = VSFSCK_OK;
+    vsfsck_t *fsck = calloc(1, sizeof(vsfsck_t));
+    if (fsck) {
+        fsck->check_jobs = opt->jobs;
+        fsck->clone_duplicates = opt->clone_duplicates;
+        fsck->out = opt->out;
+        fsck->output_format = opt->format;
+        fsck->max_findings_per_inode = opt->max_findings_per_inode;
+        fsck->on_finding = opt->on_finding;
+        fsck->user = opt->user;
+        fsck->fs_image = malloc(TOTAL_BLOCKS * BLOCK_SIZE);
+        fsck->block_ref_count = calloc(TOTAL_BLOCKS, sizeof(bool));
+    }
+    if (!fsck || !fsck->fs_image || !fsck->block_ref_count) {
+        st = VSFSCK_ERR_NOMEM;
+    } else {
+        st = vsfsck_reload(fsck, backend);
+    }
+    
+    if (status) {
+        *status = st;
+    }
+    if (st != VSFSCK_OK) {
+        vsfsck_close(fsck);
+        return NULL;
+    }
+    return fsck;
+}
+
+vsfsck_status_t vsfsck_reload(vsfsck_t *fsck, const vsfsck_backend_t *backend) {
+    int64_t size = backend->size(backend->handle);
+    if (size != TOTAL_BLOCKS * BLOCK_SIZE) {
+        return VSFSCK_ERR_SIZE;
+    }
+    if (backend->read(backend->handle, 0, fsck->fs_image, size) != 0) {
+        return VSFSCK_ERR_IO;
+    }
+    fsck->backend = *backend;
+    
+    // Per-image state starts over; the buffers are kept
+    fsck->quick_fraction = QUICK_DEFAULT_FRACTION;
+    fsck->quick_max_samples = QUICK_DEFAULT_MAX_SAMPLES;
+    fsck->quick_seed = 0;
+    fsck->check_budget = 0.0;
+    fsck->checkpoint_path = NULL;
+    memset(&fsck->budget, 0, sizeof(fsck->budget));
+    memset(fsck->finding_histogram, 0, sizeof(fsck->finding_histogram));
+    fsck->rate = (report_rate_t){ -1, -1, 0, 0, false };
+    fsck->clone_queue.len = 0;
+    fsck->shadow_stale = false;
+    fsck->csum.verified = false;
+    
+    vsfsck_t *prev = ctx;
+    ctx = fsck;
+    ctx->superblock = (superblock_t *)get_block(SUPERBLOCK_NUM);
+    ctx->inode_bitmap = get_block(INODE_BITMAP_BLOCK_NUM);
+    ctx->data_bitmap = get_block(DATA_BITMAP_BLOCK_NUM);
+    ctx->inode_table = (inode_t *)get_block(INODE_TABLE_START_BLOCK_NUM);
+    invalidate_free_extents();
+    bool ok = build_inode_soa();
+    ctx = prev;
+    return ok ? VSFSCK_OK : VSFSCK_ERR_NOMEM;
+}
+
+bool vsfsck_check(vsfsck_t *fsck, check_id_t check, bool fix) {
+    if ((unsigned)check >= CHECK_MAX) {
+        return false;
+    }
+    vsfsck_t *prev = ctx;
+    ctx = fsck;
+    // Re-checking after a repair pass starts from a fresh shadow
+    if (!fix && ctx->shadow_stale) {
+        build_inode_soa();
+        ctx->shadow_stale = false;
+    }
+    // Inodes the checksum table vouches for are skipped by the per-inode
+    // phases
+    bool scoped = !ctx->inode_scope && (ctx->inode_scope = checksum_scope(check)) != NULL;
+    bool ok = check_phases[check](fix);
+    if (scoped) {
+        ctx->inode_scope = NULL;
+    }
+    if (fix) {
+        ctx->shadow_stale = true;
+        ctx->csum.verified = false;
+    }
+    ctx = prev;
+    return ok;
+}
+
+bool vsfsck_check_all(vsfsck_t *fsck, bool fix, bool results[CHECK_MAX]) {
+    bool all_ok = true;
+    for (int c = 0; c < CHECK_MAX; c++) {
+        bool ok = vsfsck_check(fsck, c, fix);
+        if (results) {
+            results[c] = ok;
+        }
+        all_ok = all_ok && ok;
+    }
+    return all_ok;
+}
+
+vsfsck_status_t vsfsck_commit(vsfsck_t *fsck) {
+    if (!fsck->backend.write) {
+        return VSFSCK_ERR_READONLY;
+    }
+    if (fsck->backend.write(fsck->backend.handle, 0, fsck->fs_image, TOTAL_BLOCKS * BLOCK_SIZE) != 0) {
+        return VSFSCK_ERR_IO;
+    }
+    return VSFSCK_OK;
+}
+
+void vsfsck_close(vsfsck_t *fsck) {
+    if (!fsck) {
+        return;
+    }
+    vsfsck_t *prev = ctx;
+    ctx = fsck;
+    free_free_extents();
+    free_inode_soa();
+    free(ctx->clone_queue.jobs);
+    ctx = prev;
+    free(fsck->block_ref_count);
+    free(fsck->fs_image);
+    free(fsck);
+}
+
+const char *vsfsck_check_name(check_id_t check) {
+    return (unsigned)check < CHECK_MAX ? check_names[check] : "unknown";
+}
+
+const char *vsfsck_finding_name(finding_code_t code) {
+    return (unsigned)code < FINDING_MAX ? finding_names[code] : "unknown";
+}
+
+#ifndef VSFSCK_LIBRARY
+/*
+ * Batch mode
+ *
+ * --batch=LIST|DIR checks many images in one process. LIST names one image
+ * per line (blank lines and lines starting with '#' are skipped); for a
+ * directory every regular file in it is checked, in name order. A pool of
+ * --workers threads takes images off a shared counter. Each worker keeps a
+ * single context and reloads it for every image, so the image buffer, inode
+ * shadow and allocator are allocated once per worker rather than once per
+ * image. Findings are counted through the callback instead of printed, and
+ * one report with a line per image (in input order) and the summed
+ * histogram is written at the end. With --fix, images are only written back
+ * when a repair was made.
+ */
+typedef struct {
+    char *path;
+    vsfsck_status_t status;   // Load (or write back) result
+    bool consistent;          // All checks passed
+    bool repaired;            // Checks passed after the repairs
+    bool results[CHECK_MAX];  // Per-check verdicts of the first pass
+    unsigned long findings;   // Findings of the first pass
+} batch_image_t;
+
+typedef struct {
+    batch_image_t *images;
+    int count;
+    int next;                 // Next image to hand out (atomic)
+    bool fix;
+    vsfsck_options_t opt;
+} batch_t;
+
+typedef struct {
+    batch_t *batch;
+    batch_image_t *current;   // Image whose findings are counted (NULL = none)
+    unsigned long histogram[CHECK_MAX][FINDING_MAX];
+} batch_worker_t;
+
+static void batch_count_finding(void *user, const finding_t *f, const char *message) {
+    (void)message;
+    batch_worker_t *w = user;
+    if (w->current) {
+        w->current->findings++;
+        w->histogram[f->check][f->code]++;
+    }
+}
+
+// Check (and with fix, repair) one image using the worker's context, which
+// is opened on first use and reloaded afterwards. Findings are attributed to
+// the image through *current during the first pass only.
+static void check_image(vsfsck_t **fsck, const vsfsck_options_t *opt, bool fix,
+                        batch_image_t *img, batch_image_t **current) {
+    FILE *file = fopen(img->path, fix ? "rb+" : "rb");
+    if (!file) {
+        img->status = VSFSCK_ERR_IO;
+        return;
+    }
+    vsfsck_backend_t backend = vsfsck_stdio_backend(file);
+    if (!*fsck) {
+        *fsck = vsfsck_open(&backend, opt, &img->status);
+    } else {
+        img->status = vsfsck_reload(*fsck, &backend);
+    }
+    
+    if (img->status == VSFSCK_OK) {
+        *current = img;
+        img->consistent = vsfsck_check_all(*fsck, fix, img->results);
+        *current = NULL;
+        if (fix && !img->consistent) {
+            img->repaired = vsfsck_check_all(*fsck, false, NULL);
+            img->status = vsfsck_commit(*fsck);
+        }
+    }
+    fclose(file);
+}
+
+static void *batch_worker(void *arg) {
+    batch_worker_t *w = arg;
+    batch_t *b = w->batch;
+    vsfsck_options_t opt = b->opt;
+    opt.out = NULL;
+    opt.on_finding = batch_count_finding;
+    opt.user = w;
+    
+    vsfsck_t *fsck = NULL;
+    int i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+        check_image(&fsck, &opt, b->fix, &b->images[i], &w->current);
+    }
+    vsfsck_close(fsck);
+    return NULL;
+}
+
+static bool batch_add(batch_t *b, int *cap, const char *path) {
+    if (b->count == *cap && !grow_array((void **)&b->images, cap, sizeof(batch_image_t))) {
+        return false;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return false;
+    }
+    b->images[b->count++] = (batch_image_t){ .path = copy };
+    return true;
+}
+
+static int compare_batch_paths(const void *a, const void *b) {
+    return strcmp(((const batch_image_t *)a)->path, ((const batch_image_t *)b)->path);
+}
+
+// Collect the images named by a list file or contained in a directory
+static bool load_batch_list(batch_t *b, const char *source) {
+    int cap = 0;
+    struct stat st;
+    if (stat(source, &st) != 0) {
+        perror("Error opening batch list");
+        return false;
+    }
+    
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(source);
+        if (!dir) {
+            perror("Error opening batch directory");
+            return false;
+        }
+        struct dirent *de;
+        char path[4096];
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] == '.') {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s/%s", source, de->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && !batch_add(b, &cap, path)) {
+                closedir(dir);
+                fprintf(stderr, "Memory allocation failed\n");
+                return false;
+            }
+        }
+        closedir(dir);
+        qsort(b->images, b->count, sizeof(batch_image_t), compare_batch_paths);
+        return true;
+    }
+    
+    FILE *list = fopen(source, "r");
+    if (!list) {
+        perror("Error opening batch list");
+        return false;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (!batch_add(b, &cap, line)) {
+            fclose(list);
+            fprintf(stderr, "Memory allocation failed\n");
+            return false;
+        }
+    }
+    fclose(list);
+    return true;
+}
+
+// Write a string as a JSON string literal
+static void print_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static const char *status_reason(vsfsck_status_t status) {
+    switch (status) {
+    case VSFSCK_ERR_SIZE: return "image size mismatch";
+    case VSFSCK_ERR_IO: return "I/O error";
+    case VSFSCK_ERR_NOMEM: return "out of memory";
+    case VSFSCK_ERR_READONLY: return "read-only";
+    default: return "ok";
+    }
+}
+
+static const char *batch_status_text(const batch_image_t *img, bool fix) {
+    if (img->consistent) {
+        return "CONSISTENT";
+    }
+    if (fix) {
+        return img->repaired ? "FIXED" : "ERRORS REMAIN";
+    }
+    return "ERRORS DETECTED";
+}
+
+static const char *batch_status_json(const batch_image_t *img, bool fix) {
+    if (img->status != VSFSCK_OK) {
+        return "failed";
+    }
+    if (img->consistent) {
+        return "consistent";
+    }
+    if (fix) {
+        return img->repaired ? "fixed" : "errors_remain";
+    }
+    return "errors";
+}
+
+// Check every image of a batch and print the aggregated report
+int run_batch(const char *source, bool fix, const vsfsck_options_t *opt, int workers) {
+    batch_t batch = { .fix = fix, .opt = *opt };
+    if (!load_batch_list(&batch, source)) {
+        return 1;
+    }
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (workers > batch.count) {
+        workers = batch.count > 0 ? batch.count : 1;
+    }
+    
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    batch_worker_t *pool = calloc(workers, sizeof(batch_worker_t));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (!pool || !threads) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(pool);
+        free(threads);
+        return 1;
+    }
+    int started = 0;
+    for (int t = 0; t < workers; t++) {
+        pool[t].batch = &batch;
+        if (pthread_create(&threads[t], NULL, batch_worker, &pool[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        batch_worker(&pool[0]);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    
+    // Aggregate
+    unsigned long histogram[CHECK_MAX][FINDING_MAX] = {{0}};
+    for (int t = 0; t < workers; t++) {
+        for (int c = 0; c < CHECK_MAX; c++) {
+            for (int k = 0; k < FINDING_MAX; k++) {
+                histogram[c][k] += pool[t].histogram[c][k];
+            }
+        }
+    }
+    int consistent = 0, with_errors = 0, repaired = 0, failed = 0;
+    for (int i = 0; i < batch.count; i++) {
+        batch_image_t *img = &batch.images[i];
+        if (img->status != VSFSCK_OK) {
+            failed++;
+        } else if (img->consistent) {
+            consistent++;
+        } else {
+            with_errors++;
+            repaired += img->repaired;
+        }
+    }
+    double rate = seconds > 0.0 ? batch.count / seconds : 0.0;
+    
+    FILE *out = opt->out;
+    if (opt->format == OUTPUT_JSON) {
+        for (int i = 0; i < batch.count; i++) {
+            batch_image_t *img = &batch.images[i];
+            fprintf(out, "{\"type\":\"image\",\"path\":");
+            print_json_string(out, img->path);
+            fprintf(out, ",\"status\":\"%s\",\"findings\":%lu}\n", batch_status_json(img, fix), img->findings);
+        }
+        fprintf(out, "{\"type\":\"batch_summary\",\"images\":%d,\"consistent\":%d,\"errors\":%d,"
+                "\"fixed\":%d,\"failed\":%d,\"workers\":%d,\"seconds\":%.6f,\"images_per_second\":%.1f}\n",
+                batch.count, consistent, with_errors, repaired, failed, workers, seconds, rate);
+    } else {
+        fprintf(out, "VSFS Batch Consistency Check\n");
+        fprintf(out, "============================\n");
+        fprintf(out, "Images: %d\nWorkers: %d\nMode: %s\n\n", batch.count, workers,
+                fix ? "Check and fix" : "Check only");
+        for (int i = 0; i < batch.count; i++) {
+            batch_image_t *img = &batch.images[i];
+            if (img->status != VSFSCK_OK) {
+                fprintf(out, "%s: FAILED (%s)\n", img->path, status_reason(img->status));
+            } else if (img->findings > 0) {
+                fprintf(out, "%s: %s (%lu findings)\n", img->path, batch_status_text(img, fix), img->findings);
+            } else {
+                fprintf(out, "%s: %s\n", img->path, batch_status_text(img, fix));
+            }
+        }
+        fprintf(out, "\n=== Batch Summary ===\n");
+        fprintf(out, "Consistent: %d\n", consistent);
+        fprintf(out, "Errors detected: %d\n", with_errors);
+        if (fix) {
+            fprintf(out, "Fixed: %d\n", repaired);
+        }
+        fprintf(out, "Failed to check: %d\n", failed);
+        fprintf(out, "Elapsed: %.3f s (%.1f images/s)\n", seconds, rate);
+    }
+    print_histogram(out, opt->format, histogram);
+    
+    for (int i = 0; i < batch.count; i++) {
+        free(batch.images[i].path);
+    }
+    free(batch.images);
+    free(pool);
+    free(threads);
+    return failed > 0 ? 1 : 0;
+}
+
+/*
+ * Daemon mode
+ *
+ * --daemon=SOCKET listens on a Unix stream socket and keeps a pool of
+ * --workers checker threads (each with its own warm context, as in batch
+ * mode) alive between requests. A client sends one request per line:
+ *
+ *   CHECK [PRIORITY] PATH    check an image
+ *   FIX [PRIORITY] PATH      check and repair an image
+ *   STATS                    report queue and pool counters
+ *
+ * Requests from all connections share one queue ordered by priority
+ * (higher first, default 0) and then arrival. Every reply is a JSON line
+ * tagged with the request id: "queued" when accepted, one "finding" per
+ * finding as it is detected (none are rate limited) and a final "result"
+ * with the per-check verdicts. A client may half-close its end and keep
+ * reading until all of its results have arrived. SIGINT/SIGTERM stop the
+ * daemon after the queued requests are done.
+ *
+ * Anyone who can connect can have the daemon open any path it can reach,
+ * so the socket is created with mode 0600 and only its owner may use it.
+ * FIX requests write to the image and are refused unless the daemon was
+ * started with --allow-fix. A stale socket at the path is replaced; any
+ * other file is left alone and the daemon refuses to start.
+ */
+typedef struct {
+    FILE *out;                // Replies; lines are written under flockfile
+    int fd;                   // Requests
+    int refs;                 // Reader plus queued or running jobs (atomic)
+} daemon_conn_t;
+
+typedef struct {
+    unsigned long id;
+    int priority;
+    bool fix;
+    daemon_conn_t *conn;
+    batch_image_t image;
+} daemon_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    daemon_job_t **heap;      // Max-heap on (priority, -id)
+    int len;
+    int cap;
+    bool stopping;
+    unsigned long next_id;
+    unsigned long completed;
+    int running;
+    int workers;
+    bool allow_fix;           // Accept FIX requests
+    struct daemon_reader *readers;
+    vsfsck_options_t opt;
+} daemon_t;
+
+typedef struct {
+    daemon_t *daemon;
+    batch_image_t *current;   // Image of the job being checked
+    daemon_job_t *job;
+} daemon_worker_t;
+
+static volatile sig_atomic_t daemon_stop_requested;
+
+static void daemon_signal(int sig) {
+    (void)sig;
+    daemon_stop_requested = 1;
+}
+
+static void conn_release(daemon_conn_t *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        fclose(conn->out);
+        close(conn->fd);
+        free(conn);
+    }
+}
+
+static bool job_before(const daemon_job_t *a, const daemon_job_t *b) {
+    return a->priority != b->priority ? a->priority > b->priority : a->id < b->id;
+}
+
+static bool daemon_push(daemon_t *d, daemon_job_t *job) {
+    if (d->len == d->cap && !grow_array((void **)&d->heap, &d->cap, sizeof(daemon_job_t *))) {
+        return false;
+    }
+    int i = d->len++;
+    while (i > 0 && job_before(job, d->heap[(i - 1) / 2])) {
+        d->heap[i] = d->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    d->heap[i] = job;
+    return true;
+}
+
+static daemon_job_t *daemon_pop(daemon_t *d) {
+    daemon_job_t *top = d->heap[0];
+    daemon_job_t *last = d->heap[--d->len];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= d->len) {
+            break;
+        }
+        if (child + 1 < d->len && job_before(d->heap[child + 1], d->heap[child])) {
+            child++;
+        }
+        if (!job_before(d->heap[child], last)) {
+            break;
+        }
+        d->heap[i] = d->heap[child];
+        i = child;
+    }
+    if (d->len > 0) {
+        d->heap[i] = last;
+    }
+    return top;
+}
+
+static void daemon_stream_finding(void *user, const finding_t *f, const char *message) {
+    daemon_worker_t *w = user;
+    if (!w->current) {
+        return;
+    }
+    w->current->findings++;
+    FILE *out = w->job->conn->out;
+    flockfile(out);
+    fprintf(out, "{\"type\":\"finding\",\"id\":%lu,\"check\":\"%s\",\"code\":\"%s\",\"severity\":\"%s\","
+            "\"inode\":%d,\"block\":%u,\"level\":%u,\"slot\":%d,\"aux\":%u,\"action\":\"%s\",\"message\":",
+            w->job->id, check_names[f->check], finding_names[f->code], severity_names[f->severity],
+            f->inode, f->block, f->level, f->slot, f->aux, action_names[f->action]);
+    print_json_string(out, message);
+    fputs("}\n", out);
+    fflush(out);
+    funlockfile(out);
+}
+
+static void daemon_send_result(const daemon_job_t *job) {
+    const batch_image_t *img = &job->image;
+    FILE *out = job->conn->out;
+    flockfile(out);
+    fprintf(out, "{\"type\":\"result\",\"id\":%lu,\"path\":", job->id);
+    print_json_string(out, img->path);
+    fprintf(out, ",\"status\":\"%s\",\"findings\":%lu", batch_status_json(img, job->fix), img->findings);
+    if (img->status == VSFSCK_OK) {
+        for (int c = 0; c < CHECK_MAX; c++) {
+            fprintf(out, ",\"%s\":%s", check_names[c], img->results[c] ? "true" : "false");
+        }
+    } else {
+        fprintf(out, ",\"error\":\"%s\"", status_reason(img->status));
+    }
+    fputs("}\n", out);
+    fflush(out);
+    funlockfile(out);
+}
+
+static void *daemon_worker(void *arg) {
+    daemon_worker_t *w = arg;
+    daemon_t *d = w->daemon;
+    vsfsck_options_t opt = d->opt;
+    opt.out = NULL;
+    opt.on_finding = daemon_stream_finding;
+    opt.user = w;
+    
+    vsfsck_t *fsck = NULL;
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (d->len == 0 && !d->stopping) {
+            pthread_cond_wait(&d->ready, &d->lock);
+        }
+        if (d->len == 0) {
+            break;
+        }
+        daemon_job_t *job = daemon_pop(d);
+        d->running++;
+        pthread_mutex_unlock(&d->lock);
+        
+        w->job = job;
+        check_image(&fsck, &opt, job->fix, &job->image, &w->current);
+        daemon_send_result(job);
+        conn_release(job->conn);
+        free(job->image.path);
+        free(job);
+        
+        pthread_mutex_lock(&d->lock);
+        d->running--;
+        d->completed++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    vsfsck_close(fsck);
+    return NULL;
+}
+
+static void daemon_reply_error(daemon_conn_t *conn, const char *message) {
+    flockfile(conn->out);
+    fprintf(conn->out, "{\"type\":\"error\",\"message\":");
+    print_json_string(conn->out, message);
+    fputs("}\n", conn->out);
+    fflush(conn->out);
+    funlockfile(conn->out);
+}
+
+// Parse and queue one request line
+static void daemon_request(daemon_t *d, daemon_conn_t *conn, char *line) {
+    if (strcmp(line, "STATS") == 0) {
+        pthread_mutex_lock(&d->lock);
+        int queued = d->len, running = d->running;
+        unsigned long completed = d->completed;
+        pthread_mutex_unlock(&d->lock);
+        flockfile(conn->out);
+        fprintf(conn->out, "{\"type\":\"stats\",\"queued\":%d,\"running\":%d,\"completed\":%lu,\"workers\":%d}\n",
+                queued, running, completed, d->workers);
+        fflush(conn->out);
+        funlockfile(conn->out);
+        return;
+    }
+    
+    bool fix;
+    if (strncmp(line, "CHECK ", 6) == 0) {
+        fix = false;
+        line += 6;
+    } else if (strncmp(line, "FIX ", 4) == 0) {
+        if (!d->allow_fix) {
+            daemon_reply_error(conn, "repairs are disabled; start the daemon with --allow-fix");
+            return;
+        }
+        fix = true;
+        line += 4;
+    } else {
+        daemon_reply_error(conn, "unknown request");
+        return;
     }
     
-    free(inode_refs);
-    return isValid;
+    // An integer followed by more text is the priority
+    int priority = 0;
+    char *end;
+    long value = strtol(line, &end, 10);
+    if (end != line && *end == ' ' && end[1] != '\0') {
+        priority = (int)value;
+        line = end + 1;
+    }
+    if (*line == '\0') {
+        daemon_reply_error(conn, "missing image path");
+        return;
+    }
+    
+    daemon_job_t *job = calloc(1, sizeof(daemon_job_t));
+    char *path = strdup(line);
+    if (!job || !path) {
+        free(job);
+        free(path);
+        daemon_reply_error(conn, "out of memory");
+        return;
+    }
+    job->priority = priority;
+    job->fix = fix;
+    job->conn = conn;
+    job->image.path = path;
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL);
+    
+    pthread_mutex_lock(&d->lock);
+    job->id = ++d->next_id;
+    bool queued = daemon_push(d, job);
+    if (queued) {
+        pthread_cond_signal(&d->ready);
+        // Reply before unlocking so "queued" precedes any finding of the job
+        flockfile(conn->out);
+    }
+    pthread_mutex_unlock(&d->lock);
+    
+    if (!queued) {
+        daemon_reply_error(conn, "out of memory");
+        conn_release(conn);
+        free(path);
+        free(job);
+        return;
+    }
+    fprintf(conn->out, "{\"type\":\"queued\",\"id\":%lu,\"priority\":%d,\"path\":", job->id, priority);
+    print_json_string(conn->out, path);
+    fputs("}\n", conn->out);
+    fflush(conn->out);
+    funlockfile(conn->out);
 }
 
+typedef struct daemon_reader {
+    daemon_t *daemon;
+    daemon_conn_t *conn;
+    FILE *in;                 // Closed with done set, under the daemon lock
+    pthread_t thread;
+    bool done;
+    struct daemon_reader *next;
+} daemon_reader_t;
 
-// 5. Bad Block Checker //22101328
-bool check_bad_blocks(bool fix) {
-    printf("\n=== Bad Block Check ===\n");
+// Read request lines from one client until it closes its end
+static void *daemon_reader(void *arg) {
+    daemon_reader_t *r = arg;
+    char line[4096];
+    while (fgets(line, sizeof(line), r->in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0') {
+            daemon_request(r->daemon, r->conn, line);
+        }
+    }
+    conn_release(r->conn);
+    pthread_mutex_lock(&r->daemon->lock);
+    fclose(r->in);
+    r->done = true;
+    pthread_mutex_unlock(&r->daemon->lock);
+    return NULL;
+}
+
+// Join the reader threads that have finished, or with all set, stop reading
+// from every client and join them all
+static void daemon_join_readers(daemon_t *d, bool all) {
+    daemon_reader_t *finished = NULL;
+    pthread_mutex_lock(&d->lock);
+    daemon_reader_t **link = &d->readers;
+    while (*link) {
+        daemon_reader_t *r = *link;
+        if (!r->done && !all) {
+            link = &r->next;
+            continue;
+        }
+        if (!r->done) {
+            shutdown(fileno(r->in), SHUT_RD);
+        }
+        *link = r->next;
+        r->next = finished;
+        finished = r;
+    }
+    pthread_mutex_unlock(&d->lock);
     
-    bool isValid = true;
+    while (finished) {
+        daemon_reader_t *r = finished;
+        finished = r->next;
+        pthread_join(r->thread, NULL);
+        free(r);
+    }
+}
+
+// Serve check requests on a Unix socket until SIGINT or SIGTERM
+int run_daemon(const char *socket_path, const vsfsck_options_t *opt, int workers, bool allow_fix) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
     
-    for (int i = 0; i < INODE_COUNT; i++) {
-        inode_t *inode = &inode_table[i];
-        
-        // Skip invalid inodes
-        if (!is_inode_valid(inode)) {
-            continue;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        perror("Error creating socket");
+        return 1;
+    }
+    // Replace only a socket left behind by an earlier run
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket\n", socket_path);
+            close(listener);
+            return 1;
         }
-        
-        // Check direct block
-        if (inode->direct_block >= TOTAL_BLOCKS) {
-            printf("Error: Inode %d has bad direct block: %u\n", i, inode->direct_block);
-            if (fix) {
-                printf("Fixing: Setting direct block of inode %d to 0\n", i);
-                inode->direct_block = 0;
-            }
-            isValid = false;
+        unlink(socket_path);
+    }
+    mode_t old_umask = umask(0177);
+    int bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound != 0 || listen(listener, SOMAXCONN) != 0) {
+        perror("Error binding socket");
+        close(listener);
+        return 1;
+    }
+    
+    // No SA_RESTART, so accept() returns when a stop is requested
+    struct sigaction sa = { .sa_handler = daemon_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    daemon_t d = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER,
+                   .workers = workers, .allow_fix = allow_fix, .opt = *opt };
+    daemon_worker_t *pool = calloc(workers, sizeof(daemon_worker_t));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (!pool || !threads) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(pool);
+        free(threads);
+        close(listener);
+        return 1;
+    }
+    int started = 0;
+    for (int t = 0; t < workers; t++) {
+        pool[t].daemon = &d;
+        if (pthread_create(&threads[t], NULL, daemon_worker, &pool[t]) != 0) {
+            break;
         }
-        
-        // Check single indirect block
-        if (inode->single_indirect >= TOTAL_BLOCKS) {
-            printf("Error: Inode %d has bad single indirect block: %u\n", i, inode->single_indirect);
-            if (fix) {
-                printf("Fixing: Setting single indirect block of inode %d to 0\n", i);
-                inode->single_indirect = 0;
-            }
-            isValid = false;
-        } else if (inode->single_indirect != 0) {
-            uint32_t *indirect_block = get_block(inode->single_indirect);
-            if (indirect_block) {
-                int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
-                for (int j = 0; j < entries_per_block; j++) {
-                    uint32_t data_block_num = indirect_block[j];
-                    if (data_block_num >= TOTAL_BLOCKS) {
-                        printf("Error: Inode %d has bad data block %u in single indirect block\n", i, data_block_num);
-                        if (fix) {
-                            printf("Fixing: Setting invalid data block entry %d in single indirect block of inode %d to 0\n", j, i);
-                            indirect_block[j] = 0;
-                        }
-                        isValid = false;
-                    }
-                }
-            }
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error starting worker threads\n");
+        free(pool);
+        free(threads);
+        close(listener);
+        return 1;
+    }
+    d.workers = started;
+    fprintf(stderr, "vsfsck: listening on %s with %d workers\n", socket_path, started);
+    
+    while (!daemon_stop_requested) {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
         }
-        
-        // Check double indirect block
-        if (inode->double_indirect >= TOTAL_BLOCKS) {
-            printf("Error: Inode %d has bad double indirect block: %u\n", i, inode->double_indirect);
-            if (fix) {
-                printf("Fixing: Setting double indirect block of inode %d to 0\n", i);
-                inode->double_indirect = 0;
-            }
-            isValid = false;
-        } else if (inode->double_indirect != 0) {
-            uint32_t *double_indirect_block = get_block(inode->double_indirect);
-            if (double_indirect_block) {
-                int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
-                for (int j = 0; j < entries_per_block; j++) {
-                    uint32_t indirect_block_num = double_indirect_block[j];
-                    if (indirect_block_num >= TOTAL_BLOCKS) {
-                        printf("Error: Inode %d has bad indirect block %u in double indirect block\n", i, indirect_block_num);
-                        if (fix) {
-                            printf("Fixing: Setting invalid indirect block entry %d in double indirect block of inode %d to 0\n", j, i);
-                            double_indirect_block[j] = 0;
-                        }
-                        isValid = false;
-                    } else if (indirect_block_num != 0) {
-                        uint32_t *indirect_block = get_block(indirect_block_num);
-                        if (indirect_block) {
-                            int entries_per_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
-                            for (int k = 0; k < entries_per_indirect_block; k++) {
-                                uint32_t data_block_num = indirect_block[k];
-                                if (data_block_num >= TOTAL_BLOCKS) {
-                                    printf("Error: Inode %d has bad data block %u in double indirect block\n", i, data_block_num);
-                                    if (fix) {
-                                        printf("Fixing: Setting invalid data block entry %d in indirect block of inode %d to 0\n", k, i);
-                                        indirect_block[k] = 0;
-                                    }
-                                    isValid = false;
-                                }
-                            }
-                        }
-                    }
-                }
+        daemon_join_readers(&d, false);
+        daemon_conn_t *conn = calloc(1, sizeof(daemon_conn_t));
+        daemon_reader_t *reader = calloc(1, sizeof(daemon_reader_t));
+        FILE *out = conn && reader ? fdopen(dup(fd), "w") : NULL;
+        FILE *in = out ? fdopen(dup(fd), "r") : NULL;
+        if (!in) {
+            if (out) {
+                fclose(out);
             }
+            free(conn);
+            free(reader);
+            close(fd);
+            continue;
         }
-        
-        // Check triple indirect block
-        if (inode->triple_indirect >= TOTAL_BLOCKS) {
-            printf("Error: Inode %d has bad triple indirect block: %u\n", i, inode->triple_indirect);
-            if (fix) {
-                printf("Fixing: Setting triple indirect block of inode %d to 0\n", i);
-                inode->triple_indirect = 0;
-            }
-            isValid = false;
-        }  else if (inode->triple_indirect != 0) {
-            uint32_t *triple_indirect_block = get_block(inode->triple_indirect);
-            if (triple_indirect_block) {
-                int entries_per_block = BLOCK_SIZE / sizeof(uint32_t);
-                for (int j = 0; j < entries_per_block; j++) {
-                    uint32_t double_indirect_block_num = triple_indirect_block[j];
-                    if (double_indirect_block_num >= TOTAL_BLOCKS) {
-                        printf("Error: Inode %d has bad double indirect block %u in triple indirect block\n", i, double_indirect_block_num);
-                        if (fix) {
-                            printf("Fixing: Setting invalid double indirect block entry %d in triple indirect block of inode %d to 0\n", j, i);
-                            triple_indirect_block[j] = 0;
-                        }
-                        isValid = false;
-                    } else if (double_indirect_block_num != 0) {
-                        uint32_t *double_indirect_block = get_block(double_indirect_block_num);
-                        if (double_indirect_block) {
-                            int entries_per_double_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
-                            for (int k = 0; k < entries_per_double_indirect_block; k++) {
-                                uint32_t single_indirect_block_num = double_indirect_block[k];
-                                if (single_indirect_block_num >= TOTAL_BLOCKS) {
-                                    printf("Error: Inode %d has bad single indirect block %u in triple indirect block\n", i, single_indirect_block_num);
-                                    if (fix) {
-                                        printf("Fixing: Setting invalid single indirect block entry %d in double indirect block of inode %d to 0\n", k, i);
-                                        double_indirect_block[k] = 0;
-                                    }
-                                    isValid = false;
-                                } else if (single_indirect_block_num != 0) {
-                                    uint32_t *single_indirect_block = get_block(single_indirect_block_num);
-                                    if (single_indirect_block) {
-                                        int entries_per_single_indirect_block = BLOCK_SIZE / sizeof(uint32_t);
-                                        for (int m = 0; m < entries_per_single_indirect_block; m++) {
-                                            uint32_t data_block_num = single_indirect_block[m];
-                                            if (data_block_num >= TOTAL_BLOCKS) {
-                                                printf("Error: Inode %d has bad data block %u in triple indirect block\n", i, data_block_num);
-                                                if (fix) {
-                                                    printf("Fixing: Setting invalid data block entry %d in single indirect block of inode %d to 0\n", m, i);
-                                                    single_indirect_block[m] = 0;
-                                                }
-                                                isValid = false;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+        conn->out = out;
+        conn->fd = fd;
+        conn->refs = 1;
+        reader->daemon = &d;
+        reader->conn = conn;
+        reader->in = in;
+        pthread_mutex_lock(&d.lock);
+        if (pthread_create(&reader->thread, NULL, daemon_reader, reader) != 0) {
+            pthread_mutex_unlock(&d.lock);
+            conn_release(conn);
+            fclose(in);
+            free(reader);
+            continue;
         }
+        reader->next = d.readers;
+        d.readers = reader;
+        pthread_mutex_unlock(&d.lock);
     }
     
-    return isValid;
+    close(listener);
+    unlink(socket_path);
+    // No new requests once the readers are gone, so the workers can drain
+    daemon_join_readers(&d, true);
+    pthread_mutex_lock(&d.lock);
+    d.stopping = true;
+    pthread_cond_broadcast(&d.ready);
+    pthread_mutex_unlock(&d.lock);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(d.heap);
+    free(pool);
+    free(threads);
+    return 0;
 }
 
 /*
  * Main function
  */
+static char stdout_buffer[REPORT_BUFFER_SIZE];
+
 int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s <file_system_image> [--fix]\n", argv[0]);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file_system_image> [--fix] [--format=text|json|binary] "
+                "[--max-per-inode=N] [--jobs=N] [--clone-dups] [--quick[=FRACTION]] [--quick-max=N] "
+                "[--seed=N] [--budget=SECONDS --checkpoint=FILE] [--index=FILE [--changes=LOG]] [--manifest=FILE] [--enable-checksums] [--hash-data] [--dedup-report]\n"
+                "       %s <file_system_image> [--index=FILE] --owner=BLOCK [--format=text|json]\n"
+                "       %s <old_image> --diff=NEW_IMAGE [--format=text|json]\n"
+                "       %s <file_system_image> --export-metadata=FILE\n"
+                "       %s --batch=LIST|DIR [--fix] [--format=text|json] [--workers=N] [--jobs=N] "
+                "[--clone-dups]\n"
+                "       %s --daemon=SOCKET [--allow-fix] [--workers=N] [--jobs=N] [--clone-dups]\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
     
     char *image_file = argv[1];
-    bool fix_errors = (argc == 3 && strcmp(argv[2], "--fix") == 0);
+    const char *batch_source = NULL;
+    const char *daemon_socket = NULL;
+    int pool_workers = 0;
+    bool fix_errors = false;
+    bool allow_fix = false;
+    bool quick_mode = false;
+    double quick_fraction = QUICK_DEFAULT_FRACTION;
+    uint32_t quick_max_samples = QUICK_DEFAULT_MAX_SAMPLES;
+    uint64_t quick_seed = 0;
+    double check_budget = 0.0;
+    const char *checkpoint_path = NULL;
+    const char *index_path = NULL;
+    const char *changes_path = NULL;
+    long owner_block = -1;
+    const char *manifest_path = NULL;
+    bool enable_checksums = false;
+    bool hash_data = false;
+    bool dedup_report = false;
+    const char *diff_path = NULL;
+    const char *export_path = NULL;
+    vsfsck_options_t opt;
+    vsfsck_default_options(&opt);
+    opt.out = stdout;
+    int first_option = 2;
+    if (strncmp(argv[1], "--", 2) == 0) {
+        first_option = 1;
+    }
+    for (int a = first_option; a < argc; a++) {
+        if (strncmp(argv[a], "--batch=", 8) == 0) {
+            batch_source = argv[a] + 8;
+        } else if (strncmp(argv[a], "--daemon=", 9) == 0) {
+            daemon_socket = argv[a] + 9;
+        } else if (strncmp(argv[a], "--workers=", 10) == 0) {
+            pool_workers = atoi(argv[a] + 10);
+        } else if (strcmp(argv[a], "--fix") == 0) {
+            fix_errors = true;
+        } else if (strcmp(argv[a], "--allow-fix") == 0) {
+            allow_fix = true;
+        } else if (strcmp(argv[a], "--format=text") == 0) {
+            opt.format = OUTPUT_TEXT;
+        } else if (strcmp(argv[a], "--format=json") == 0) {
+            opt.format = OUTPUT_JSON;
+        } else if (strcmp(argv[a], "--format=binary") == 0) {
+            opt.format = OUTPUT_BINARY;
+        } else if (strncmp(argv[a], "--max-per-inode=", 16) == 0) {
+            opt.max_findings_per_inode = (unsigned)strtoul(argv[a] + 16, NULL, 10);
+        } else if (strcmp(argv[a], "--clone-dups") == 0) {
+            opt.clone_duplicates = true;
+        } else if (strncmp(argv[a], "--jobs=", 7) == 0) {
+            opt.jobs = atoi(argv[a] + 7);
+        } else if (strcmp(argv[a], "--quick") == 0) {
+            quick_mode = true;
+        } else if (strncmp(argv[a], "--quick=", 8) == 0) {
+            quick_mode = true;
+            quick_fraction = strtod(argv[a] + 8, NULL);
+            if (!(quick_fraction > 0.0 && quick_fraction <= 1.0)) {
+                fprintf(stderr, "--quick fraction must be in (0, 1]\n");
+                return 1;
+            }
+        } else if (strncmp(argv[a], "--quick-max=", 12) == 0) {
+            quick_max_samples = (uint32_t)strtoul(argv[a] + 12, NULL, 10);
+            if (quick_max_samples == 0) {
+                quick_max_samples = 1;
+            }
+        } else if (strncmp(argv[a], "--seed=", 7) == 0) {
+            quick_seed = strtoull(argv[a] + 7, NULL, 10);
+        } else if (strncmp(argv[a], "--budget=", 9) == 0) {
+            check_budget = strtod(argv[a] + 9, NULL);
+        } else if (strncmp(argv[a], "--checkpoint=", 13) == 0) {
+            checkpoint_path = argv[a] + 13;
+        } else if (strncmp(argv[a], "--index=", 8) == 0) {
+            index_path = argv[a] + 8;
+        } else if (strncmp(argv[a], "--changes=", 10) == 0) {
+            changes_path = argv[a] + 10;
+        } else if (strcmp(argv[a], "--hash-data") == 0) {
+            hash_data = true;
+        } else if (strcmp(argv[a], "--dedup-report") == 0) {
+            dedup_report = true;
+        } else if (strcmp(argv[a], "--enable-checksums") == 0) {
+            enable_checksums = true;
+        } else if (strncmp(argv[a], "--manifest=", 11) == 0) {
+            manifest_path = argv[a] + 11;
+        } else if (strncmp(argv[a], "--export-metadata=", 18) == 0) {
+            export_path = argv[a] + 18;
+        } else if (strncmp(argv[a], "--diff=", 7) == 0) {
+            diff_path = argv[a] + 7;
+        } else if (strncmp(argv[a], "--owner=", 8) == 0) {
+            char *end;
+            owner_block = strtol(argv[a] + 8, &end, 10);
+            if (*end != '\0' || owner_block < 0 || owner_block >= TOTAL_BLOCKS) {
+                fprintf(stderr, "Invalid block number: %s\n", argv[a] + 8);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[a]);
+            return 1;
+        }
+    }
+    if (daemon_socket) {
+        if (batch_source || fix_errors || quick_mode || checkpoint_path || index_path || manifest_path ||
+            enable_checksums || hash_data || dedup_report || opt.format != OUTPUT_TEXT) {
+            fprintf(stderr, "--daemon supports --allow-fix, --workers, --jobs and --clone-dups; "
+                    "fixing is chosen per request\n");
+            return 1;
+        }
+        return run_daemon(daemon_socket, &opt, pool_workers, allow_fix);
+    }
+    if (allow_fix) {
+        fprintf(stderr, "--allow-fix only applies to --daemon\n");
+        return 1;
+    }
+    if (batch_source) {
+        if (quick_mode || checkpoint_path || index_path || manifest_path || enable_checksums || hash_data ||
+            dedup_report || opt.format == OUTPUT_BINARY) {
+            fprintf(stderr, "--batch supports --fix, --format=text|json, --workers, --jobs and --clone-dups\n");
+            return 1;
+        }
+        setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+        return run_batch(batch_source, fix_errors, &opt, pool_workers);
+    }
+    if (quick_mode && fix_errors) {
+        fprintf(stderr, "--quick only samples the image and cannot be combined with --fix\n");
+        return 1;
+    }
+    if (check_budget > 0.0 && !checkpoint_path) {
+        fprintf(stderr, "--budget needs a --checkpoint file to save progress to\n");
+        return 1;
+    }
+    if (checkpoint_path && (fix_errors || quick_mode)) {
+        fprintf(stderr, "--checkpoint cannot be combined with --fix or --quick\n");
+        return 1;
+    }
+    if (changes_path && (!index_path || fix_errors || quick_mode || checkpoint_path)) {
+        fprintf(stderr, "--changes needs --index and cannot be combined with --fix, --quick or --checkpoint\n");
+        return 1;
+    }
+    if ((index_path || manifest_path || enable_checksums || hash_data || dedup_report) && quick_mode) {
+        fprintf(stderr, "--index, --manifest, --enable-checksums, --hash-data and --dedup-report "
+                "cannot be combined with --quick\n");
+        return 1;
+    }
+    if (owner_block >= 0 && (fix_errors || quick_mode || checkpoint_path || changes_path ||
+                             opt.format == OUTPUT_BINARY)) {
+        fprintf(stderr, "--owner is a query and cannot be combined with checks or repairs\n");
+        return 1;
+    }
+    if (diff_path && (fix_errors || quick_mode || checkpoint_path || index_path || manifest_path ||
+                      enable_checksums || hash_data || dedup_report || owner_block >= 0 ||
+                      opt.format == OUTPUT_BINARY)) {
+        fprintf(stderr, "--diff compares two images and cannot be combined with checks or repairs\n");
+        return 1;
+    }
+    if (export_path && (fix_errors || quick_mode || checkpoint_path || index_path || manifest_path ||
+                        enable_checksums || hash_data || dedup_report || owner_block >= 0 || diff_path ||
+                        opt.format != OUTPUT_TEXT)) {
+        fprintf(stderr, "--export-metadata only copies the image and cannot be combined with other modes\n");
+        return 1;
+    }
     
     // Load the file system image
     // Open in read/write mode for fixing
@@ -767,96 +5853,339 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    // Allocate memory for the file system image
-    fs_image = malloc(file_size);
-    if (!fs_image) {
-        perror("Error allocating memory for file system image");
+    vsfsck_backend_t backend = vsfsck_stdio_backend(file);
+    vsfsck_status_t status;
+    vsfsck_t *fsck = vsfsck_open(&backend, &opt, &status);
+    if (!fsck) {
+        perror(status == VSFSCK_ERR_IO ? "Error reading file system image"
+                                       : "Error allocating memory for file system image");
         fclose(file);
         return 1;
     }
     
-    // Read the file system image into memory
-    if (fread(fs_image, 1, file_size, file) != file_size) {
-        perror("Error reading file system image");
-        free(fs_image);
+    // The rest of the tool reports through the context directly
+    ctx = fsck;
+    ctx->quick_fraction = quick_fraction;
+    ctx->quick_max_samples = quick_max_samples;
+    ctx->quick_seed = quick_seed;
+    ctx->check_budget = check_budget;
+    ctx->checkpoint_path = checkpoint_path;
+    
+    bool results[CHECK_MAX];
+    int first_phase = 0;
+    for (int c = 0; c < CHECK_MAX; c++) {
+        results[c] = true;
+    }
+    
+    if (checkpoint_path) {
+        int loaded = load_checkpoint();
+        if (loaded < 0) {
+            vsfsck_close(fsck);
+            fclose(file);
+            return 1;
+        }
+        if (loaded > 0) {
+            first_phase = ctx->budget.ckpt.phase;
+            for (int c = 0; c < CHECK_MAX; c++) {
+                results[c] = ctx->budget.ckpt.results[c];
+            }
+        }
+    }
+    
+    block_index_t *index = NULL;
+    int index_loaded = 0;
+    bool changed[TOTAL_BLOCKS];
+    bool incremental = false;
+    if (index_path || owner_block >= 0) {
+        index = calloc(1, sizeof(block_index_t));
+        if (!index) {
+            fprintf(stderr, "Memory allocation failed\n");
+            vsfsck_close(fsck);
+            fclose(file);
+            return 1;
+        }
+    }
+    if (index_path) {
+        index_loaded = load_block_index(index_path, index);
+        if (index_loaded <= 0) {
+            memset(index, 0, sizeof(block_index_t));
+        }
+    }
+    
+    if (export_path) {
+        int written = export_metadata(export_path);
+        if (written < 0) {
+            perror("Error writing metadata export");
+        } else {
+            printf("Exported %d of %d blocks to %s; file data is left as holes\n",
+                   written, TOTAL_BLOCKS, export_path);
+        }
+        vsfsck_close(fsck);
         fclose(file);
-        return 1;
+        return written < 0 ? 1 : 0;
     }
     
-    // Initialize global pointers
-    superblock = (superblock_t *)get_block(SUPERBLOCK_NUM);
-    inode_bitmap = get_block(INODE_BITMAP_BLOCK_NUM);
-    data_bitmap = get_block(DATA_BITMAP_BLOCK_NUM);
-    inode_table = (inode_t *)get_block(INODE_TABLE_START_BLOCK_NUM);
-    block_ref_count = calloc(TOTAL_BLOCKS, sizeof(bool));
-    if (!block_ref_count) {
-        perror("Error allocating memory for block reference tracking");
-        free(fs_image);
+    if (diff_path) {
+        uint8_t *new_image = malloc(TOTAL_BLOCKS * BLOCK_SIZE);
+        FILE *new_file = fopen(diff_path, "rb");
+        bool loaded = new_image && new_file && fread(new_image, 1, TOTAL_BLOCKS * BLOCK_SIZE, new_file) ==
+                      TOTAL_BLOCKS * BLOCK_SIZE && fgetc(new_file) == EOF;
+        if (loaded) {
+            diff_images(new_image);
+        } else if (!new_image) {
+            fprintf(stderr, "Memory allocation failed\n");
+        } else if (!new_file) {
+            perror("Error opening image to compare");
+        } else {
+            fprintf(stderr, "Error: %s is not a file system image of %d bytes\n", diff_path,
+                    TOTAL_BLOCKS * BLOCK_SIZE);
+        }
+        if (new_file) {
+            fclose(new_file);
+        }
+        free(new_image);
+        vsfsck_close(fsck);
         fclose(file);
-        return 1;
+        return loaded ? 0 : 1;
+    }
+    
+    if (owner_block >= 0) {
+        bool rebuilt = index_loaded <= 0 || !index_is_current(index);
+        if (rebuilt) {
+            build_block_index(index);
+        }
+        print_block_owner(index, owner_block, rebuilt);
+        free(index);
+        vsfsck_close(fsck);
+        fclose(file);
+        return 0;
+    }
+    
+    checksum_manifest_t *manifest = NULL;
+    if (manifest_path) {
+        bool missing;
+        manifest = load_manifest(manifest_path, &missing);
+        if (!manifest && !missing) {
+            fprintf(stderr, "Warning: Manifest %s is corrupt; it is not verified and will be rewritten\n",
+                    manifest_path);
+        }
+        ctx->manifest = manifest;
+    }
+    
+    if (changes_path) {
+        if (load_change_log(changes_path, changed) < 0) {
+            free_manifest(manifest);
+            free(index);
+            vsfsck_close(fsck);
+            fclose(file);
+            return 1;
+        }
+        incremental = index_loaded > 0 && index_covers_changes(index, changed);
+        if (index_loaded == 0) {
+            fprintf(stderr, "Warning: No index at %s; running a full check\n", index_path);
+        } else if (index_loaded < 0) {
+            fprintf(stderr, "Warning: Index %s is corrupt; running a full check\n", index_path);
+        } else if (!incremental) {
+            fprintf(stderr, "Warning: %s names only some of the blocks changed since index generation %llu; "
+                    "running a full check\n", changes_path, (unsigned long long)index->header.generation);
+        }
     }
     
     // Run consistency checks
-    printf("VSFS Consistency Checker\n");
-    printf("========================\n");
-    printf("File system image: %s\n", image_file);
-    printf("Mode: %s\n", fix_errors ? "Check and fix" : "Check only");
+    setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+    report_begin();
+    report_info("VSFS Consistency Checker\n");
+    report_info("========================\n");
+    report_info("File system image: %s\n", image_file);
+    report_info("Mode: %s\n", quick_mode ? "Quick sampled check" : incremental ? "Incremental check" :
+                fix_errors ? "Check and fix" : "Check only");
+    
+    if (quick_mode) {
+        quick_stats_t stats;
+        bool sb_valid = validate_superblock(false);
+        bool inode_bitmap_valid = validate_inode_bitmap(false);
+        bool sample_clean = check_inodes_sampled(&stats);
+        
+        report_info("\n=== Quick Check Summary ===\n");
+        report_info("Superblock: %s\n", sb_valid ? "Valid" : "Errors found");
+        report_info("Inode bitmap: %s\n", inode_bitmap_valid ? "Valid" : "Errors found");
+        report_quick_stats(&stats);
+        
+        bool fs_valid = sb_valid && inode_bitmap_valid && sample_clean;
+        report_info("\nOverall file system status: %s\n", fs_valid ? "NO ERRORS IN SAMPLE" : "ERRORS DETECTED");
+        report_histogram();
+        
+        vsfsck_close(fsck);
+        fclose(file);
+        // The verdict of the sample is the exit status
+        return fs_valid ? 0 : 1;
+    }
+    
+    if (ctx->budget.resumed) {
+        report_info("Resuming from %s: %s check at inode %d\n", checkpoint_path,
+                    check_names[first_phase], ctx->budget.ckpt.next_inode);
+    }
+    budget_start();
     
-    bool sb_valid = validate_superblock(fix_errors);
-    bool data_bitmap_valid = validate_data_bitmap(fix_errors);
-    bool inode_bitmap_valid = validate_inode_bitmap(fix_errors);
-    bool no_duplicates = check_duplicate_blocks(fix_errors);
-    bool no_bad_blocks = check_bad_blocks(fix_errors);
+    if (incremental) {
+        incremental_stats_t stats;
+        check_incremental(index, changed, results, &stats);
+        report_flush_suppressed();
+        if (ctx->output_format == OUTPUT_JSON) {
+            fprintf(ctx->out, "{\"type\":\"incremental\",\"changed_blocks\":%d,\"inodes\":%d,"
+                    "\"directory_tree\":%s}\n", stats.changed_blocks, stats.inodes,
+                    stats.directory_tree ? "true" : "false");
+        }
+        report_info("\nIncremental scope: %d changed blocks, %d inodes rechecked, directory tree %s\n",
+                    stats.changed_blocks, stats.inodes, stats.directory_tree ? "rechecked" : "not affected");
+    } else {
+        for (int c = first_phase; c < CHECK_MAX; c++) {
+            if (c > first_phase && budget_stop(c, 0)) {
+                break;
+            }
+            results[c] = vsfsck_check(fsck, c, fix_errors) && results[c];
+            if (ctx->budget.stopped) {
+                break;
+            }
+        }
+    }
+    
+    if (ctx->budget.stopped) {
+        bool saved = save_checkpoint(results);
+        report_flush_suppressed();
+        if (ctx->output_format == OUTPUT_JSON) {
+            fprintf(ctx->out, "{\"type\":\"checkpoint\",\"saved\":%s,\"check\":\"%s\",\"inode\":%d}\n",
+                    saved ? "true" : "false", check_names[ctx->budget.ckpt.phase], ctx->budget.ckpt.next_inode);
+        }
+        report_info("\nTime budget exhausted during the %s check at inode %d\n",
+                    check_names[ctx->budget.ckpt.phase], ctx->budget.ckpt.next_inode);
+        if (saved) {
+            report_info("Progress saved to %s; run again with the same --checkpoint to resume\n",
+                        checkpoint_path);
+        } else {
+            perror("Error writing checkpoint");
+        }
+        free_manifest(manifest);
+        free(index);
+        vsfsck_close(fsck);
+        fclose(file);
+        return 0;
+    }
+    if (checkpoint_path) {
+        remove(checkpoint_path);
+    }
+    
+    bool sb_valid = results[CHECK_SUPERBLOCK];
+    bool data_bitmap_valid = results[CHECK_DATA_BITMAP];
+    bool inode_bitmap_valid = results[CHECK_INODE_BITMAP];
+    bool no_duplicates = results[CHECK_DUPLICATE_BLOCKS];
+    bool no_bad_blocks = results[CHECK_BAD_BLOCKS];
+    bool inodes_sane = results[CHECK_INODE_SANITY];
+    bool tree_valid = results[CHECK_DIRECTORY_TREE];
     
-    printf("\n=== Consistency Check Summary ===\n");
-    printf("Superblock: %s\n", sb_valid ? "Valid" : "Errors found");
-    printf("Data bitmap: %s\n", data_bitmap_valid ? "Valid" : "Errors found");
-    printf("Inode bitmap: %s\n", inode_bitmap_valid ? "Valid" : "Errors found");
-    printf("Duplicate blocks: %s\n", no_duplicates ? "None found" : "Errors found");
-    printf("Bad blocks: %s\n", no_bad_blocks ? "None found" : "Errors found");
+    report_info("\n=== Consistency Check Summary ===\n");
+    report_info("Superblock: %s\n", sb_valid ? "Valid" : "Errors found");
+    report_info("Data bitmap: %s\n", data_bitmap_valid ? "Valid" : "Errors found");
+    report_info("Inode bitmap: %s\n", inode_bitmap_valid ? "Valid" : "Errors found");
+    report_info("Duplicate blocks: %s\n", no_duplicates ? "None found" : "Errors found");
+    report_info("Bad blocks: %s\n", no_bad_blocks ? "None found" : "Errors found");
+    report_info("Inode metadata: %s\n", inodes_sane ? "Valid" : "Errors found");
+    report_info("Directory tree: %s\n", tree_valid ? "Valid" : "Errors found");
+    if (manifest) {
+        report_info("Metadata checksums: %s\n", results[CHECK_CHECKSUMS] ? "Valid" : "Errors found");
+    }
     
-    bool fs_valid = sb_valid && data_bitmap_valid && inode_bitmap_valid && no_duplicates && no_bad_blocks;
+    bool fs_valid = sb_valid && data_bitmap_valid && inode_bitmap_valid && no_duplicates && no_bad_blocks &&
+                    inodes_sane && tree_valid && results[CHECK_CHECKSUMS];
+    report_summary("summary", results);
     
-    printf("\nOverall file system status: %s\n", fs_valid ? "CONSISTENT" : "ERRORS DETECTED");
+    report_info("\nOverall file system status: %s\n", fs_valid ? "CONSISTENT" : "ERRORS DETECTED");
+    report_histogram();
     
+    bool index_valid = fs_valid;
     if (fix_errors && !fs_valid) {
-        printf("\n=== Re-running Checks After Fixes ===\n");
-        bool sb_valid_recheck = validate_superblock(false);
-        bool data_bitmap_valid_recheck = validate_data_bitmap(false);
-        bool inode_bitmap_valid_recheck = validate_inode_bitmap(false);
-        bool no_duplicates_recheck = check_duplicate_blocks(false);
-        bool no_bad_blocks_recheck = check_bad_blocks(false);
-        
-        bool fs_valid_recheck = sb_valid_recheck && data_bitmap_valid_recheck && 
-                               inode_bitmap_valid_recheck && no_duplicates_recheck && 
-                               no_bad_blocks_recheck;
+        report_info("\n=== Re-running Checks After Fixes ===\n");
+        bool results_recheck[CHECK_MAX];
+        // Repairs rewrite metadata, so the manifest only applies to the
+        // first pass; a mismatch found there cannot be repaired
+        ctx->manifest = NULL;
+        bool fs_valid_recheck = vsfsck_check_all(fsck, false, results_recheck);
+        results_recheck[CHECK_CHECKSUMS] = results[CHECK_CHECKSUMS];
+        fs_valid_recheck = fs_valid_recheck && results[CHECK_CHECKSUMS];
+        report_summary("post_fix_summary", results_recheck);
         
-        printf("\n=== Post-Fix Consistency Check Summary ===\n");
-        printf("Superblock: %s\n", sb_valid_recheck ? "Valid" : "Errors remain");
-        printf("Data bitmap: %s\n", data_bitmap_valid_recheck ? "Valid" : "Errors remain");
-        printf("Inode bitmap: %s\n", inode_bitmap_valid_recheck ? "Valid" : "Errors remain");
-        printf("Duplicate blocks: %s\n", no_duplicates_recheck ? "None found" : "Errors remain");
-        printf("Bad blocks: %s\n", no_bad_blocks_recheck ? "None found" : "Errors remain");
+        report_info("\n=== Post-Fix Consistency Check Summary ===\n");
+        report_info("Superblock: %s\n", results_recheck[CHECK_SUPERBLOCK] ? "Valid" : "Errors remain");
+        report_info("Data bitmap: %s\n", results_recheck[CHECK_DATA_BITMAP] ? "Valid" : "Errors remain");
+        report_info("Inode bitmap: %s\n", results_recheck[CHECK_INODE_BITMAP] ? "Valid" : "Errors remain");
+        report_info("Duplicate blocks: %s\n", results_recheck[CHECK_DUPLICATE_BLOCKS] ? "None found" : "Errors remain");
+        report_info("Bad blocks: %s\n", results_recheck[CHECK_BAD_BLOCKS] ? "None found" : "Errors remain");
+        report_info("Inode metadata: %s\n", results_recheck[CHECK_INODE_SANITY] ? "Valid" : "Errors remain");
+        report_info("Directory tree: %s\n", results_recheck[CHECK_DIRECTORY_TREE] ? "Valid" : "Errors remain");
+        if (manifest) {
+            report_info("Metadata checksums: %s\n", results_recheck[CHECK_CHECKSUMS] ? "Valid" : "Errors remain");
+        }
         
-        printf("\nPost-fix file system status: %s\n", 
+        report_info("\nPost-fix file system status: %s\n", 
                fs_valid_recheck ? "CONSISTENT" : "ERRORS REMAIN");
+        report_histogram();
+        index_valid = fs_valid_recheck;
                
         if (!fs_valid_recheck) {
-            printf("Warning: Some errors could not be fixed automatically!\n");
-            printf("Consider running additional maintenance or backup your data.\n");
+            report_info("Warning: Some errors could not be fixed automatically!\n");
+            report_info("Consider running additional maintenance or backup your data.\n");
         }
         
         // Write the changes back to the file
-        fseek(file, 0, SEEK_SET);
-        if (fwrite(fs_image, 1, file_size, file) != file_size) {
+        if (vsfsck_commit(fsck) != VSFSCK_OK) {
             perror("Error writing corrected image to file");
         }
     }
     
+    if (hash_data) {
+        report_data_hashes();
+    }
+    if (dedup_report) {
+        report_content_duplicates();
+    }
+    
+    // A checksum table is (re)stamped when asked for, or when repairs
+    // changed an image that carries one
+    if (index_valid && (enable_checksums || (fix_errors && !fs_valid && ctx->csum.enabled))) {
+        stamp_checksum_table();
+        if (vsfsck_commit(fsck) != VSFSCK_OK) {
+            perror("Error writing checksum table");
+        } else {
+            report_info("Checksum table stamped at clean generation %llu\n",
+                        (unsigned long long)ctx->csum.generation);
+        }
+    } else if (enable_checksums) {
+        fprintf(stderr, "Checksum table not written: the image is not consistent\n");
+    }
+    
+    // The manifest and the index only describe consistent images
+    if (manifest_path && index_valid && !save_manifest(manifest_path)) {
+        perror("Error writing checksum manifest");
+    }
+    free_manifest(manifest);
+    if (index_path) {
+        if (!index_valid) {
+            remove(index_path);
+        } else {
+            if (!incremental) {
+                build_block_index(index);
+            }
+            if (!save_block_index(index_path, index)) {
+                perror("Error writing block index");
+            }
+        }
+        free(index);
+    }
+    
     // Clean up
-    free(block_ref_count);
-    free(fs_image);
+    vsfsck_close(fsck);
     fclose(file);
     
     return 0;
-}
\ No newline at end of file
+}
+#endif // VSFSCK_LIBRARY
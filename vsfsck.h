@@ -0,0 +1,199 @@
+/*
+ * libvsfsck: VSFS consistency checking as a library
+ *
+ * vsfsck.c is both the command line tool and the library. Build the
+ * library by compiling it with VSFSCK_LIBRARY defined, which leaves out
+ * main():
+ *
+ *     cc -O2 -pthread -fPIC -shared -fvisibility=hidden -DVSFSCK_LIBRARY \
+ *        -o libvsfsck.so vsfsck.c
+ *
+ * With -fvisibility=hidden only the functions marked VSFSCK_API below are
+ * exported, so the library's internal helpers cannot clash with symbols
+ * of the program that loads it.
+ *
+ * Each image is checked through its own vsfsck_t. Contexts share no
+ * mutable state, so different threads may work on different contexts at
+ * the same time; a single context must not be used by two threads at once.
+ */
+#ifndef VSFSCK_H
+#define VSFSCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __GNUC__
+#define VSFSCK_API __attribute__((visibility("default")))
+#else
+#define VSFSCK_API
+#endif
+
+/*
+ * Structured findings
+ *
+ * Every inconsistency is described by a fixed-size finding_t record. The
+ * human-readable text is only one consumer of it: with --format=json each
+ * record becomes one JSON line, and with --format=binary the records are
+ * written back to back after a small header, so tooling never has to parse
+ * the free-form messages.
+ */
+typedef enum {
+    CHECK_SUPERBLOCK = 0,
+    CHECK_DATA_BITMAP,
+    CHECK_INODE_BITMAP,
+    CHECK_DUPLICATE_BLOCKS,
+    CHECK_BAD_BLOCKS,
+    CHECK_INODE_SANITY,
+    CHECK_DIRECTORY_TREE,
+    CHECK_CHECKSUMS,
+    CHECK_MAX
+} check_id_t;
+
+typedef enum {
+    FINDING_SB_FIELD = 0,          // Superblock field mismatch (slot = field index)
+    FINDING_BLOCK_NOT_MARKED,      // Referenced block clear in data bitmap
+    FINDING_BLOCK_NOT_REFERENCED,  // Block set in data bitmap but unreferenced
+    FINDING_INODE_NOT_MARKED,      // Valid inode clear in inode bitmap
+    FINDING_INODE_NOT_VALID,       // Invalid inode set in inode bitmap
+    FINDING_DUPLICATE_BLOCK,       // Block claimed twice (aux = first owner)
+    FINDING_BAD_BLOCK,             // Pointer outside the image
+    FINDING_INODE_SIZE,            // size larger than blocks_count can hold
+    FINDING_INODE_TIME_FUTURE,     // Timestamp in the future (aux = timestamp)
+    FINDING_INODE_TIME_ORDER,      // atime/mtime earlier than creation time
+    FINDING_INODE_MODE,            // Unknown file type or stray mode bits (aux = mode)
+    FINDING_INODE_BLOCK_COUNT,     // blocks_count differs from reachable blocks (aux = reachable)
+    FINDING_ROOT_NOT_DIR,          // Root inode is not a live directory
+    FINDING_DANGLING_ENTRY,        // Entry names a dead inode (inode = dir, aux = target)
+    FINDING_ORPHAN_INODE,          // Live inode not reachable from the root
+    FINDING_LINK_COUNT,            // links_count differs from entries (aux = counted)
+    FINDING_CHECKSUM_MISMATCH,     // Metadata block differs from its recorded CRC32C (aux = recorded)
+    FINDING_MAX
+} finding_code_t;
+
+typedef enum {
+    SEVERITY_INFO = 0,
+    SEVERITY_WARNING,
+    SEVERITY_ERROR
+} severity_t;
+
+typedef enum {
+    ACTION_NONE = 0,     // Reported only
+    ACTION_FIXED,        // Repaired in the in-memory image
+    ACTION_UNFIXABLE     // --fix was requested but no repair is possible
+} action_t;
+
+typedef struct {
+    uint8_t check;       // check_id_t
+    uint8_t code;        // finding_code_t
+    uint8_t severity;    // severity_t
+    uint8_t action;      // action_t
+    uint8_t level;       // 0 = pointer held by the inode, 1..3 = depth in indirect tree
+    uint8_t pad;
+    int16_t slot;        // Inode pointer index at level 0, entry index otherwise (-1 = none)
+    int32_t inode;       // Inode involved (-1 = none)
+    uint32_t block;      // Block number or offending pointer value
+    uint32_t aux;        // Check specific: first owner, observed value, ...
+} finding_t;
+
+#ifndef __cplusplus
+_Static_assert(sizeof(finding_t) == 20, "finding_t is part of the binary report format");
+#endif
+
+/*
+ * Binary report format (--format=binary)
+ *
+ * The stream starts with the 4 bytes REPORT_BINARY_MAGIC and a uint32_t
+ * REPORT_BINARY_VERSION, followed by finding_t records in host byte
+ * order. When the rate limit drops findings, a record with code
+ * FINDING_SUPPRESSED follows the run: check and inode name the run and
+ * aux holds how many of its findings were dropped. Version 1 streams had
+ * no such records.
+ */
+#define REPORT_BINARY_MAGIC "VSFN"
+#define REPORT_BINARY_VERSION 2
+#define FINDING_SUPPRESSED 0xFF
+
+typedef enum {
+    OUTPUT_TEXT = 0,
+    OUTPUT_JSON,
+    OUTPUT_BINARY
+} output_format_t;
+
+
+typedef struct vsfsck vsfsck_t;
+
+typedef enum {
+    VSFSCK_OK = 0,
+    VSFSCK_ERR_SIZE,     // Image is not the size of a VSFS image
+    VSFSCK_ERR_IO,       // The backend failed to read or write
+    VSFSCK_ERR_NOMEM,
+    VSFSCK_ERR_READONLY  // vsfsck_commit() on a backend without write
+} vsfsck_status_t;
+
+/*
+ * Image backend. The image is read into memory once by vsfsck_open() and
+ * written back in one piece by vsfsck_commit(). read and write return 0 on
+ * success; write may be NULL for read-only images.
+ */
+typedef struct {
+    int64_t (*size)(void *handle);
+    int (*read)(void *handle, uint64_t offset, void *buf, size_t len);
+    int (*write)(void *handle, uint64_t offset, const void *buf, size_t len);
+    void *handle;
+} vsfsck_backend_t;
+
+// Called for every finding, including ones the report rate limit drops.
+// message is the human-readable text without the "Error: " prefix.
+typedef void (*vsfsck_finding_fn)(void *user, const finding_t *finding, const char *message);
+
+typedef struct {
+    FILE *out;                        // Report stream, NULL for none
+    output_format_t format;           // Format written to out
+    unsigned max_findings_per_inode;  // Report rate limit, 0 = unlimited
+    int jobs;                         // Threads for the directory walk
+    bool clone_duplicates;            // Repair duplicates by copying blocks
+    vsfsck_finding_fn on_finding;
+    void *user;                       // Passed to on_finding
+} vsfsck_options_t;
+
+// Fill in the defaults the command line tool uses (no output stream)
+VSFSCK_API void vsfsck_default_options(vsfsck_options_t *opt);
+
+// Backend over a stdio stream opened with "rb" or "rb+"
+VSFSCK_API vsfsck_backend_t vsfsck_stdio_backend(FILE *file);
+
+// Load an image and prepare it for checking. Returns NULL with *status set
+// on failure; opt may be NULL for the defaults.
+VSFSCK_API vsfsck_t *vsfsck_open(const vsfsck_backend_t *backend, const vsfsck_options_t *opt,
+                                 vsfsck_status_t *status);
+
+// Load another image into an existing context, reusing its buffers. The
+// options stay; findings counts and other per-image state start over.
+VSFSCK_API vsfsck_status_t vsfsck_reload(vsfsck_t *fsck, const vsfsck_backend_t *backend);
+
+// Run one check; with fix, repairs are made in the in-memory image
+VSFSCK_API bool vsfsck_check(vsfsck_t *fsck, check_id_t check, bool fix);
+
+// Run every check in order, storing each verdict in results (may be NULL).
+// Returns whether all of them passed.
+VSFSCK_API bool vsfsck_check_all(vsfsck_t *fsck, bool fix, bool results[CHECK_MAX]);
+
+// Write the in-memory image back through the backend
+VSFSCK_API vsfsck_status_t vsfsck_commit(vsfsck_t *fsck);
+
+VSFSCK_API void vsfsck_close(vsfsck_t *fsck);
+
+VSFSCK_API const char *vsfsck_check_name(check_id_t check);
+VSFSCK_API const char *vsfsck_finding_name(finding_code_t code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VSFSCK_H